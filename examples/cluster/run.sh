@@ -0,0 +1,58 @@
+#!/bin/sh
+
+echo1() {
+  # echo in 1 line
+  echo "$@" | tr -d "\n"
+}
+
+DEBUG_LOG=.debug.$$.log
+ERROR_LOG=error.log
+PORT1=${PORT1:-17001}
+PORT2=${PORT2:-17002}
+
+# Start 2 workers on localhost, with separated cache dirs so both have to fetch test data
+CACHE_DIR=$PWD/.cache.$$
+ljudge --cache-dir $CACHE_DIR/1 --threads 2 --worker 127.0.0.1:$PORT1 2>> $DEBUG_LOG &
+WORKER1=$!
+ljudge --cache-dir $CACHE_DIR/2 --threads 2 --worker 127.0.0.1:$PORT2 2>> $DEBUG_LOG &
+WORKER2=$!
+sleep 1
+
+src=a.c
+echo -n 'Test distributed judging: '
+RESULT=`ljudge --debug --keep-stdout --nodes 127.0.0.1:$PORT1,127.0.0.1:$PORT2 --user-code $src --testcase --input 1.in --output 1.out --testcase --input 2.in --output 2.out --testcase --input 1.in --output 1.out --testcase --input 2.in --output 2.out 2>> $DEBUG_LOG | cat`
+EXITCODE=$?
+if [ "$EXITCODE" != 0 ] || [ -z "$RESULT" ] || (echo1 "$RESULT" | grep -qi ERROR) || (echo1 "$RESULT" | grep -qv ACCEPT); then
+  # Log error
+  echo `date` 'Error running distributed test (exit code ' $EXITCODE ')' >> $ERROR_LOG
+  echo1 "$RESULT" >> $ERROR_LOG
+  cat $DEBUG_LOG >> $ERROR_LOG
+  echo >> $ERROR_LOG
+  # notify user
+  echo1 'ERROR' "$RESULT"
+  echo
+  else
+  echo OKAY
+fi
+
+# Testcases of a dead worker go to the other one
+kill $WORKER2
+echo -n 'Test a dead worker: '
+RESULT=`ljudge --debug --nodes 127.0.0.1:$PORT1,127.0.0.1:$PORT2 --user-code $src --testcase --input 1.in --output 1.out --testcase --input 2.in --output 2.out 2>> $DEBUG_LOG | cat`
+EXITCODE=$?
+if [ "$EXITCODE" != 0 ] || [ -z "$RESULT" ] || (echo1 "$RESULT" | grep -qi ERROR) || (echo1 "$RESULT" | grep -qv ACCEPT); then
+  # Log error
+  echo `date` 'Error running dead worker test (exit code ' $EXITCODE ')' >> $ERROR_LOG
+  echo1 "$RESULT" >> $ERROR_LOG
+  cat $DEBUG_LOG >> $ERROR_LOG
+  echo >> $ERROR_LOG
+  # notify user
+  echo1 'ERROR' "$RESULT"
+  echo
+  else
+  echo OKAY
+fi
+
+kill $WORKER1
+rm -rf $CACHE_DIR
+[ -e $DEBUG_LOG ] && unlink $DEBUG_LOG
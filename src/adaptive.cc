@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <ctime>
+#include <thread>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "adaptive.hpp"
+
+extern "C" {
+#include "deps/log.h/log.h"
+}
+
+// re-run the calibration under load this often
+static const double CALIBRATION_INTERVAL = 30;  // seconds
+// runs shorter than this are too coarse to tell anything
+static const double MIN_SAMPLE_CPU_TIME = 0.05;  // seconds
+// weight of a new sample in the moving average
+static const double SAMPLE_WEIGHT = 0.2;
+// a sleeping program has a large ratio, it is not contention. cap it
+static const double MAX_SAMPLE_DEVIATION = 1;
+// samples between two changes of concurrency, so a change can show its effect
+static const int SAMPLES_PER_CHANGE = 4;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+ConcurrencyController::ConcurrencyController(int max_concurrency, double max_jitter, const Calibration& calibrate)
+  : calibration_(calibrate), max_concurrency_(std::max(1, max_concurrency)), max_jitter_(max_jitter),
+    concurrency_(std::max(1, max_concurrency)), running_(0), jitter_(0), baseline_(0), overhead_(0), last_calibration_(0),
+    calibrating_(false), calibration_failed_(false), samples_since_change_(0) {
+}
+
+void ConcurrencyController::start_calibration() {
+  calibrating_ = true;
+  // controllers live as long as the process
+  std::thread(&ConcurrencyController::calibrate, this).detach();
+}
+
+void ConcurrencyController::calibrate() {
+  double cpu_time = 0, real_time = 0;
+  bool ok = calibration_(cpu_time, real_time);
+  std::lock_guard<std::mutex> lock(mutex_);
+  calibrating_ = false;
+  last_calibration_ = now();
+  if ((!ok || cpu_time < MIN_SAMPLE_CPU_TIME) && baseline_ <= 0) {
+    // a later run would be under load, it can not be the idle baseline
+    calibration_failed_ = true;
+    log_warn("idle calibration failed, adaptive concurrency only uses testcase timings");
+  } else if (!ok || cpu_time < MIN_SAMPLE_CPU_TIME) {
+    log_warn("calibration failed, adaptive concurrency is not using it");
+  } else if (baseline_ <= 0) {
+    baseline_ = cpu_time;
+    overhead_ = std::max(0.0, real_time - cpu_time);
+    log_debug("calibration: %.3fs cpu time, %.3fs real time when idle", cpu_time, real_time);
+  } else {
+    log_debug("calibration: %.3fs cpu time (idle: %.3fs), %.3fs real time, %d running", cpu_time, baseline_, real_time, running_);
+    add_sample(std::max(0.0, cpu_time / baseline_ - 1));
+  }
+  changed_.notify_all();
+}
+
+void ConcurrencyController::add_sample(double deviation) {
+  jitter_ = jitter_ * (1 - SAMPLE_WEIGHT) + std::min(deviation, MAX_SAMPLE_DEVIATION) * SAMPLE_WEIGHT;
+  if (++samples_since_change_ < SAMPLES_PER_CHANGE) return;
+
+  int old = concurrency_;
+  if (jitter_ > max_jitter_ && concurrency_ > 1) {
+    concurrency_ = std::max(1, concurrency_ - std::max(1, concurrency_ / 4));
+  } else if (jitter_ < max_jitter_ / 2 && concurrency_ < max_concurrency_) {
+    ++concurrency_;
+  }
+  if (concurrency_ != old) {
+    samples_since_change_ = 0;
+    log_info("concurrency %d -> %d (jitter %.1f%%, bound %.1f%%)", old, concurrency_, jitter_ * 100, max_jitter_ * 100);
+    changed_.notify_all();
+  }
+}
+
+void ConcurrencyController::acquire() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // the idle machine is measured before anything runs
+  if (last_calibration_ == 0 && !calibrating_) start_calibration();
+  while (calibrating_ && baseline_ <= 0) changed_.wait(lock);
+  if (!calibrating_ && !calibration_failed_ && now() - last_calibration_ > CALIBRATION_INTERVAL) start_calibration();
+  while (running_ >= concurrency_) changed_.wait(lock);
+  ++running_;
+}
+
+void ConcurrencyController::release(double cpu_time, double real_time) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  --running_;
+  if (cpu_time >= MIN_SAMPLE_CPU_TIME) add_sample(std::max(0.0, real_time - overhead_ - cpu_time) / cpu_time);
+  changed_.notify_all();
+}
+
+int ConcurrencyController::concurrency() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return concurrency_;
+}
+
+double ConcurrencyController::jitter() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return jitter_;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+// Adaptive concurrency (--max-jitter). Testcases are admitted while fewer
+// than concurrency() run. The jitter estimate mixes two signals:
+//
+//   - a fixed cpu bound workload (the calibration) is run once when idle
+//     and again every CALIBRATION_INTERVAL seconds under load, by a
+//     thread of its own, so no testcase waits for it (except for the idle
+//     run). The growth of its cpu time over the idle run is the noise
+//     added by contention. If the idle run fails, it is not run again.
+//   - real time / cpu time of every testcase. Time spent runnable but
+//     not running makes it grow above 1. The real time the idle
+//     calibration spent outside its cpu time (starting the sandbox) is
+//     not counted.
+//
+// Concurrency drops by a quarter when the estimate is above max_jitter and
+// grows by one when it is under half of it.
+class ConcurrencyController {
+  public:
+    // runs the calibration workload. false if it failed
+    typedef std::function<bool(double& cpu_time, double& real_time)> Calibration;
+
+    ConcurrencyController(int max_concurrency, double max_jitter, const Calibration& calibrate);
+
+    void acquire();  // blocks while concurrency() testcases run
+    void release(double cpu_time, double real_time);  // usage of the finished run, 0 if unknown
+
+    int concurrency();
+    double jitter();  // current estimate, as a fraction
+
+  private:
+    void start_calibration();  // called with mutex_ held
+    void calibrate();  // in a thread started by start_calibration
+    void add_sample(double deviation);  // called with mutex_ held
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    Calibration calibration_;
+    int max_concurrency_;
+    double max_jitter_;
+    int concurrency_;
+    int running_;
+    double jitter_;
+    double baseline_;  // cpu time of the idle calibration run, 0 if not known yet
+    double overhead_;  // real time - cpu time of the idle calibration run
+    double last_calibration_;
+    bool calibrating_;
+    bool calibration_failed_;  // the idle run failed, calibration is not used at all
+    int samples_since_change_;
+};
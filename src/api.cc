@@ -0,0 +1,78 @@
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <cstdio>
+#include <string>
+#include "gc.hpp"
+#include "judge.hpp"
+#include "ljudge.h"
+#include "request.hpp"
+#include "response.hpp"
+
+extern "C" {
+#include "deps/log.h/log.h"
+}
+
+struct CallbackCookie {
+  ljudge_callback callback;
+  void *userdata;
+};
+
+static ssize_t write_to_callback(void *cookie, const char *buf, size_t size) {
+  CallbackCookie *c = (CallbackCookie *)cookie;
+  c->callback(LJUDGE_DATA_RESPONSE, buf, size, c->userdata);
+  return size;
+}
+
+static void report_error(ljudge_callback callback, void *userdata, const std::string& message) {
+  callback(LJUDGE_DATA_ERROR, message.data(), message.length(), userdata);
+}
+
+int ljudge_judge(const char *request, ljudge_callback callback, void *userdata) {
+  Options opts;
+  Testcase default_case;
+  std::string error;
+  init_options(opts, default_case);
+  if (!prepare_request(request ? request : "", opts, default_case, error)) {
+    report_error(callback, userdata, error);
+    return LJUDGE_ERROR_REQUEST;
+  }
+
+  // the response writers write to a FILE. forward it to the callback
+  CallbackCookie cookie = { callback, userdata };
+  cookie_io_functions_t io = { NULL, write_to_callback, NULL, NULL };
+  FILE *fp = fopencookie(&cookie, "w", io);
+  if (!fp) {
+    report_error(callback, userdata, "cannot create response stream");
+    return LJUDGE_ERROR_INTERNAL;
+  }
+
+  // the host program is long-running, empty the trash of contexts in the background
+  CacheBudget cache_budget = { opts.cache_size, opts.cache_entries };
+  start_garbage_collector(opts.cache_dir, cache_budget);
+
+  int ret = LJUDGE_OK;
+  {
+    Context ctx(opts.cache_dir);
+    JsonWriter json_writer(fp, opts.pretty_print);
+    CborWriter cbor_writer(fp);
+    try {
+      judge(ctx, opts, (opts.format == FORMAT_CBOR) ? (ResponseWriter&)cbor_writer : (ResponseWriter&)json_writer);
+    } catch (const std::exception& ex) {
+      fflush(fp);
+      report_error(callback, userdata, ex.what());
+      ret = LJUDGE_ERROR_INTERNAL;
+    }
+  }
+  fclose(fp);
+  return ret;
+}
+
+void ljudge_set_debug_level(int level) {
+  debug_level = level;
+}
+
+const char *ljudge_version(void) {
+  return LJUDGE_VERSION;
+}
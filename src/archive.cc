@@ -0,0 +1,642 @@
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include "archive.hpp"
+#include "codec.hpp"
+#include "fs.hpp"
+#include "sha1.hpp"
+#include "deps/tinyformat/tinyformat.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+extern "C" {
+#include "deps/log.h/log.h"
+}
+
+using std::string;
+using tfm::format;
+
+// zip compression methods
+static const int ZIP_STORED = 0;
+static const int ZIP_DEFLATED = 8;
+
+struct ArchiveEntry {
+  unsigned long long offset;  // zip: of the local header, tar: of the data
+  unsigned long long size;
+  unsigned long long compressed_size;
+  int method;
+  bool is_zip;
+};
+
+typedef std::map<string, ArchiveEntry> ArchiveIndex;
+
+// indexes of archives read by this process
+static const size_t MAX_CACHED_ARCHIVES = 256;
+static std::mutex archive_mutex;
+static std::map<string, std::shared_ptr<const ArchiveIndex> > archive_indexes;
+
+// stdin pipe of archive entries and compressed files
+static const int PIPE_BUFFER_SIZE = 1 << 20;
+
+static const char *archive_exts[] = {".zip!", ".tar!"};
+
+bool split_archive_ref(const string& path, string& archive, string& entry) {
+  for (size_t i = 0; i < sizeof(archive_exts) / sizeof(archive_exts[0]); ++i) {
+    size_t pos = path.find(archive_exts[i]);
+    if (pos == string::npos) continue;
+    pos += strlen(archive_exts[i]) - 1;
+    archive = path.substr(0, pos);
+    entry = path.substr(pos + 1);
+    return true;
+  }
+  return false;
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, data, len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return false;
+    data += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+bool parse_fd_ref(const string& path, int& fd) {
+  size_t len = strlen(FD_REF_PREFIX);
+  if (path.compare(0, len, FD_REF_PREFIX) != 0 || path.length() == len) return false;
+  char *end;
+  long value = strtol(path.c_str() + len, &end, 10);
+  if (*end || value < 0 || value > INT_MAX) return false;
+  fd = (int)value;
+  return true;
+}
+
+static string make_fd_ref(int fd) {
+  return format(FD_REF_PREFIX "%d", fd);
+}
+
+string adopt_data_fd(int fd, string& error) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    error = format("fd %d is not open", fd);
+    return "";
+  }
+  // stdio is left alone, other fds are not for the sandbox
+  if (fd > STDERR_FILENO) fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (S_ISREG(st.st_mode) && lseek(fd, 0, SEEK_CUR) >= 0) return make_fd_ref(fd);
+
+  // not seekable, keep what is read for every run
+  int memfd = memfd_create("ljudge-data", MFD_CLOEXEC);
+  if (memfd < 0) {
+    error = format("cannot create a memfd for fd %d: %s", fd, strerror(errno));
+    return "";
+  }
+  char buf[1 << 16];
+  while (true) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 || (n > 0 && !write_all(memfd, buf, n))) {
+      error = format("cannot read fd %d: %s", fd, strerror(errno));
+      close(memfd);
+      return "";
+    }
+    if (n == 0) break;
+  }
+  if (fd > STDERR_FILENO) close(fd);
+  return make_fd_ref(memfd);
+}
+
+string get_data_file_path(const string& path) {
+  string archive, entry;
+  return split_archive_ref(path, archive, entry) ? archive : path;
+}
+
+static unsigned long long read_le(const char *p, int nbytes) {
+  unsigned long long value = 0;
+  for (int i = nbytes - 1; i >= 0; --i) value = (value << 8) | (unsigned char)p[i];
+  return value;
+}
+
+static string normalize_entry_name(string name) {
+  while (name.compare(0, 2, "./") == 0) name = name.substr(2);
+  return name;
+}
+
+static bool read_zip_index(const char *data, size_t size, ArchiveIndex& index) {
+  // end of central directory record, followed by a comment of up to 64k
+  static const size_t EOCD_SIZE = 22;
+  if (size < EOCD_SIZE) return false;
+  size_t eocd = size - EOCD_SIZE;
+  size_t lowest = size > EOCD_SIZE + 0xffff ? size - EOCD_SIZE - 0xffff : 0;
+  while (read_le(data + eocd, 4) != 0x06054b50) {
+    if (eocd == lowest) return false;
+    --eocd;
+  }
+  unsigned long long count = read_le(data + eocd + 10, 2);
+  unsigned long long cd_offset = read_le(data + eocd + 16, 4);
+  if ((count == 0xffff || cd_offset == 0xffffffff) && eocd >= 20 && read_le(data + eocd - 20, 4) == 0x07064b50) {
+    // zip64
+    unsigned long long eocd64 = read_le(data + eocd - 20 + 8, 8);
+    if (size < 56 || eocd64 > size - 56 || read_le(data + eocd64, 4) != 0x06064b50) return false;
+    count = read_le(data + eocd64 + 32, 8);
+    cd_offset = read_le(data + eocd64 + 48, 8);
+  }
+
+  unsigned long long p = cd_offset;
+  for (unsigned long long i = 0; i < count; ++i) {
+    // offsets are untrusted, compare them without overflowing
+    if (size < 46 || p > size - 46 || read_le(data + p, 4) != 0x02014b50) return false;
+    const char *h = data + p;
+    ArchiveEntry entry;
+    entry.is_zip = true;
+    int flags = read_le(h + 8, 2);
+    entry.method = read_le(h + 10, 2);
+    entry.compressed_size = read_le(h + 20, 4);
+    entry.size = read_le(h + 24, 4);
+    entry.offset = read_le(h + 42, 4);
+    size_t name_len = read_le(h + 28, 2), extra_len = read_le(h + 30, 2), comment_len = read_le(h + 32, 2);
+    if (46 + name_len + extra_len > size - p) return false;
+    string name(h + 46, name_len);
+    // zip64 extended information has the fields which are 0xffffffff above, in order
+    for (const char *e = h + 46 + name_len, *end = e + extra_len; e + 4 <= end; ) {
+      int id = read_le(e, 2), len = read_le(e + 2, 2);
+      if (len > end - e - 4) break;
+      const char *v = e + 4;
+      if (id == 0x0001) {
+        if (entry.size == 0xffffffff && v + 8 <= e + 4 + len) entry.size = read_le(v, 8), v += 8;
+        if (entry.compressed_size == 0xffffffff && v + 8 <= e + 4 + len) entry.compressed_size = read_le(v, 8), v += 8;
+        if (entry.offset == 0xffffffff && v + 8 <= e + 4 + len) entry.offset = read_le(v, 8), v += 8;
+      }
+      e += 4 + len;
+    }
+    p += 46 + name_len + extra_len + comment_len;
+    // skip directories and encrypted entries
+    if (name.empty() || name[name.length() - 1] == '/' || (flags & 1)) continue;
+    index[normalize_entry_name(name)] = entry;
+  }
+  return true;
+}
+
+static unsigned long long read_tar_number(const char *p, size_t len) {
+  // base-256 for large sizes (GNU), otherwise octal
+  if ((unsigned char)p[0] & 0x80) {
+    unsigned long long value = (unsigned char)p[0] & 0x7f;
+    for (size_t i = 1; i < len; ++i) value = (value << 8) | (unsigned char)p[i];
+    return value;
+  }
+  unsigned long long value = 0;
+  for (size_t i = 0; i < len && p[i]; ++i) {
+    if (p[i] >= '0' && p[i] <= '7') value = value * 8 + (p[i] - '0');
+  }
+  return value;
+}
+
+static bool is_tar_header(const char *h) {
+  unsigned long long sum = 0;
+  for (int i = 0; i < 512; ++i) sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)h[i];
+  return sum == read_tar_number(h + 148, 8);
+}
+
+// value of "path" in pax extended header records: "<len> <key>=<value>\n"
+static string get_pax_path(const char *data, size_t size) {
+  string path;
+  for (size_t p = 0; p < size; ) {
+    size_t len = strtoul(data + p, NULL, 10);
+    if (len == 0 || p + len > size) break;
+    string record(data + p, len);
+    size_t key = record.find(' '), eq = record.find('=');
+    if (key != string::npos && eq != string::npos && record.compare(key + 1, eq - key - 1, "path") == 0) {
+      path = record.substr(eq + 1, record.length() - eq - 2);
+    }
+    p += len;
+  }
+  return path;
+}
+
+static bool read_tar_index(const char *data, size_t size, ArchiveIndex& index) {
+  static const size_t BLOCK = 512;
+  string long_name;
+  for (size_t p = 0; p + BLOCK <= size; ) {
+    const char *h = data + p;
+    if (h[0] == 0) break;  // end of archive
+    if (!is_tar_header(h)) return false;
+    unsigned long long len = read_tar_number(h + 124, 12);
+    char type = h[156];
+    unsigned long long offset = p + BLOCK;
+    if (len > size - offset) return false;
+    if (type == 'L') {
+      // GNU long name of the next entry
+      long_name = string(data + offset, strnlen(data + offset, len));
+    } else if (type == 'x') {
+      long_name = get_pax_path(data + offset, len);
+    } else if (type == '0' || type == '\0' || type == '7') {
+      string name = long_name;
+      if (name.empty()) {
+        name = string(h, strnlen(h, 100));
+        // ustar prefix
+        if (memcmp(h + 257, "ustar", 5) == 0 && h[345]) name = string(h + 345, strnlen(h + 345, 155)) + "/" + name;
+      }
+      ArchiveEntry entry;
+      entry.is_zip = false;
+      entry.method = ZIP_STORED;
+      entry.offset = offset;
+      entry.size = entry.compressed_size = len;
+      index[normalize_entry_name(name)] = entry;
+      long_name.clear();
+    } else if (type != 'g') {
+      long_name.clear();
+    }
+    p = offset + (len + BLOCK - 1) / BLOCK * BLOCK;
+  }
+  return true;
+}
+
+static std::shared_ptr<const ArchiveIndex> get_archive_index(const string& archive, string& error) {
+  struct stat st;
+  if (stat(archive.c_str(), &st) != 0) {
+    error = format("cannot read archive %s", archive);
+    return std::shared_ptr<const ArchiveIndex>();
+  }
+  string key = format("%lu:%lu:%ld.%09ld:%lld", (unsigned long)st.st_dev, (unsigned long)st.st_ino, (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, (long long)st.st_size);
+  {
+    std::lock_guard<std::mutex> lock(archive_mutex);
+    __typeof(archive_indexes.begin()) it = archive_indexes.find(key);
+    if (it != archive_indexes.end()) return it->second;
+  }
+
+  // only the headers are touched, the entries are not read
+  std::shared_ptr<ArchiveIndex> index(new ArchiveIndex());
+  fs::MappedFile file(archive);
+  bool is_zip = fs::extname(archive) == ".zip";
+  if (!file.ok() || !(is_zip ? read_zip_index(file.data(), file.size(), *index) : read_tar_index(file.data(), file.size(), *index))) {
+    error = format("%s is not a valid %s archive", archive, is_zip ? "zip" : "tar");
+    return std::shared_ptr<const ArchiveIndex>();
+  }
+  log_debug("indexed %s: %d entries", archive.c_str(), (int)index->size());
+
+  std::lock_guard<std::mutex> lock(archive_mutex);
+  if (archive_indexes.size() >= MAX_CACHED_ARCHIVES) archive_indexes.erase(archive_indexes.begin());
+  archive_indexes[key] = index;
+  return index;
+}
+
+// find the entry and where its (maybe compressed) data starts
+static bool locate_entry(const string& archive, const string& name, ArchiveEntry& entry, unsigned long long& data_offset, string& error) {
+  std::shared_ptr<const ArchiveIndex> index = get_archive_index(archive, error);
+  if (!index) return false;
+  __typeof(index->begin()) it = index->find(normalize_entry_name(name));
+  if (it == index->end()) {
+    error = format("%s is not found in %s", name, archive);
+    return false;
+  }
+  entry = it->second;
+  if (entry.method != ZIP_STORED && entry.method != ZIP_DEFLATED) {
+    error = format("%s in %s uses an unsupported compression method (%d)", name, archive, entry.method);
+    return false;
+  }
+  if (!entry.is_zip) {
+    data_offset = entry.offset;
+  } else {
+    // the local header can have a different extra field than the central directory
+    fs::MappedFile header(archive, entry.offset, 30);
+    if (!header.ok() || read_le(header.data(), 4) != 0x04034b50) {
+      error = format("%s in %s is corrupted", name, archive);
+      return false;
+    }
+    data_offset = entry.offset + 30 + read_le(header.data() + 26, 2) + read_le(header.data() + 28, 2);
+  }
+  // sizes in the central directory are untrusted, the data must be in the file
+  struct stat st;
+  if (stat(archive.c_str(), &st) != 0 || data_offset > (unsigned long long)st.st_size || entry.compressed_size > st.st_size - data_offset) {
+    error = format("%s in %s is corrupted", name, archive);
+    return false;
+  }
+  return true;
+}
+
+// the (maybe compressed) data of path, mapped, and how to decompress it
+static std::shared_ptr<fs::MappedFile> map_data_file(const string& path, Codec& codec, string& error, bool copy = false) {
+  string archive, name;
+  int fd;
+  if (parse_fd_ref(path, fd)) {
+    codec = CODEC_NONE;
+    std::shared_ptr<fs::MappedFile> file(new fs::MappedFile(fd, 0, -1, copy));
+    if (!file->ok()) error = format("cannot read fd %d", fd);
+    return file->ok() ? file : std::shared_ptr<fs::MappedFile>();
+  }
+  if (!split_archive_ref(path, archive, name)) {
+    codec = get_codec(path);
+    if (!check_codec(codec, error)) return std::shared_ptr<fs::MappedFile>();
+    std::shared_ptr<fs::MappedFile> file(new fs::MappedFile(path, 0, -1, copy));
+    if (!file->ok()) error = format("cannot read %s", path);
+    return file->ok() ? file : std::shared_ptr<fs::MappedFile>();
+  }
+  ArchiveEntry entry;
+  unsigned long long data_offset;
+  if (!locate_entry(archive, name, entry, data_offset, error)) return std::shared_ptr<fs::MappedFile>();
+  codec = entry.method == ZIP_DEFLATED ? CODEC_DEFLATE : CODEC_NONE;
+  std::shared_ptr<fs::MappedFile> file(new fs::MappedFile(archive, data_offset, entry.compressed_size, copy));
+  if (!file->ok()) error = format("cannot read %s", path);
+  return file->ok() ? file : std::shared_ptr<fs::MappedFile>();
+}
+
+bool get_data_file_range(const string& path, string& file, unsigned long long& offset, unsigned long long& length) {
+  string archive, name, error;
+  int fd;
+  if (parse_fd_ref(path, fd)) return false;
+  if (!split_archive_ref(path, archive, name)) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    file = path;
+    offset = 0;
+    length = st.st_size;
+    return true;
+  }
+  ArchiveEntry entry;
+  if (!locate_entry(archive, name, entry, offset, error)) return false;
+  file = archive;
+  length = entry.compressed_size;
+  return true;
+}
+
+bool is_plain_data_file(const string& path) {
+  string archive, entry;
+  int fd;
+  return !split_archive_ref(path, archive, entry) && !parse_fd_ref(path, fd) && get_codec(path) == CODEC_NONE;
+}
+
+string get_data_file_name(const string& path) {
+  string archive, entry;
+  int fd;
+  if (parse_fd_ref(path, fd)) return format("fd%d", fd);
+  if (split_archive_ref(path, archive, entry)) return fs::basename(entry);
+  return fs::basename(strip_codec_ext(path));
+}
+
+bool check_data_file(const string& path, string& error) {
+  string archive, name;
+  int fd;
+  if (parse_fd_ref(path, fd)) {
+    if (fcntl(fd, F_GETFD) != -1) return true;
+    error = format("fd %d is not open", fd);
+    return false;
+  }
+  if (!split_archive_ref(path, archive, name)) return check_codec(get_codec(path), error);
+  ArchiveEntry entry;
+  unsigned long long data_offset;
+  return locate_entry(archive, name, entry, data_offset, error);
+}
+
+// what DataFiles of the same file share
+struct DataContent {
+  std::shared_ptr<fs::MappedFile> file;
+  string buffer;  // decompressed
+  const char *data;
+  size_t size;
+  size_t chomped_size;
+  std::once_flag sha1_once;
+  string sha1;
+};
+
+// with copy, the content never refers to a mapping of the file. cached
+// contents outlive judgments, the file can be truncated meanwhile
+static std::shared_ptr<DataContent> load_data_content(const string& path, bool copy) {
+  Codec codec = CODEC_NONE;
+  string error;
+  std::shared_ptr<DataContent> content(new DataContent());
+  content->file = map_data_file(path, codec, error, copy);
+  if (!content->file) {
+    log_debug("%s", error.c_str());
+    return std::shared_ptr<DataContent>();
+  }
+  if (codec != CODEC_NONE) {
+    string& buffer = content->buffer;
+    bool ok = decode_data(codec, content->file->data(), content->file->size(), [&buffer](const char *data, size_t len) {
+      buffer.append(data, len);
+      return true;
+    });
+    content->file.reset();
+    if (!ok) {
+      log_debug("%s is corrupted", path.c_str());
+      return std::shared_ptr<DataContent>();
+    }
+    content->data = buffer.data();
+    content->size = buffer.size();
+  } else {
+    content->data = content->file->data();
+    content->size = content->file->size();
+  }
+  content->chomped_size = (content->size > 0 && content->data[content->size - 1] == '\n') ? content->size - 1 : content->size;
+  return content;
+}
+
+// most recently used first
+typedef std::list<string> DataCacheOrder;
+
+struct DataCacheEntry {
+  std::shared_ptr<DataContent> content;
+  DataCacheOrder::iterator order;
+};
+
+static std::mutex data_cache_mutex;
+static long long data_cache_budget = 0;
+static long long data_cache_used = 0;
+static std::map<string, DataCacheEntry> data_cache;
+static DataCacheOrder data_cache_order;
+static std::atomic<long> data_cache_hits(0);
+static std::atomic<long> data_cache_misses(0);
+
+// changes when the file changes. false if it is not a regular file
+static bool get_data_cache_key(const string& path, string& key) {
+  string archive, name;
+  int fd;
+  // the content of a fd can change without a trace
+  if (parse_fd_ref(path, fd)) return false;
+  if (!split_archive_ref(path, archive, name)) archive = path;
+  struct stat st;
+  if (stat(archive.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+  key = format("%lu:%lu:%ld.%09ld:%ld.%09ld:%lld!%s", (unsigned long)st.st_dev, (unsigned long)st.st_ino, (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+      (long)st.st_ctim.tv_sec, (long)st.st_ctim.tv_nsec, (long long)st.st_size, name);
+  return true;
+}
+
+// drop least recently used contents over the budget. DataFiles using them keep them
+static void shrink_data_cache() {
+  while (data_cache_used > data_cache_budget && !data_cache_order.empty()) {
+    __typeof(data_cache.begin()) it = data_cache.find(data_cache_order.back());
+    data_cache_used -= it->second.content->size;
+    data_cache.erase(it);
+    data_cache_order.pop_back();
+  }
+}
+
+void set_data_cache_size(long long size) {
+  std::lock_guard<std::mutex> lock(data_cache_mutex);
+  data_cache_budget = size;
+  shrink_data_cache();
+}
+
+DataCacheStats get_data_cache_stats() {
+  DataCacheStats stats;
+  stats.hits = data_cache_hits;
+  stats.misses = data_cache_misses;
+  std::lock_guard<std::mutex> lock(data_cache_mutex);
+  stats.entries = data_cache.size();
+  stats.size = data_cache_used;
+  return stats;
+}
+
+DataFile::DataFile(const string& path) {
+  string key;
+  bool cacheable;
+  {
+    std::lock_guard<std::mutex> lock(data_cache_mutex);
+    cacheable = data_cache_budget > 0;
+  }
+  if (cacheable) cacheable = get_data_cache_key(path, key);
+  if (cacheable) {
+    std::lock_guard<std::mutex> lock(data_cache_mutex);
+    __typeof(data_cache.begin()) it = data_cache.find(key);
+    if (it != data_cache.end()) {
+      data_cache_order.splice(data_cache_order.begin(), data_cache_order, it->second.order);
+      content_ = it->second.content;
+      ++data_cache_hits;
+      return;
+    }
+  }
+
+  // not holding the lock, other files can be used meanwhile
+  content_ = load_data_content(path, cacheable);
+  if (!cacheable || !content_) return;
+  ++data_cache_misses;
+  std::lock_guard<std::mutex> lock(data_cache_mutex);
+  if ((long long)content_->size > data_cache_budget || data_cache.count(key)) return;
+  data_cache_order.push_front(key);
+  DataCacheEntry entry = { content_, data_cache_order.begin() };
+  data_cache[key] = entry;
+  data_cache_used += content_->size;
+  shrink_data_cache();
+}
+
+const char *DataFile::data() const {
+  return content_ ? content_->data : "";
+}
+
+size_t DataFile::size() const {
+  return content_ ? content_->size : 0;
+}
+
+size_t DataFile::chomped_size() const {
+  return content_ ? content_->chomped_size : 0;
+}
+
+const string& DataFile::sha1() const {
+  static const string empty;
+  if (!content_) return empty;
+  DataContent& content = *content_;
+  std::call_once(content.sha1_once, [&content]() {
+    content.sha1 = ::sha1(content.data, content.size);
+  });
+  return content.sha1;
+}
+
+static void feed_data(string path, std::shared_ptr<fs::MappedFile> file, Codec codec, int fd, std::promise<bool> fed) {
+  // the reader can exit without reading everything, get EPIPE instead
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  bool written = true;
+  bool ok = decode_data(codec, file->data(), file->size(), [fd, &written](const char *data, size_t len) {
+    return written = write_all(fd, data, len);
+  });
+  // the program stopping early is fine, the data ending early is not
+  if (!ok && written) log_debug("%s is corrupted, the program got a part of it", path.c_str());
+  close(fd);
+  fed.set_value(ok || !written);
+}
+
+// a fd which can not be reopened (ex. the file is not readable by us) is
+// shared by runs, each reads from the start without moving its offset
+static void feed_fd(int src, int fd, std::promise<bool> fed) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  std::string buf(1 << 18, '\0');
+  bool ok = true;
+  for (off_t pos = 0; ; ) {
+    ssize_t n = pread(src, &buf[0], buf.size(), pos);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) ok = false;
+    if (n <= 0 || !write_all(fd, buf.data(), n)) break;
+    pos += n;
+  }
+  close(fd);
+  fed.set_value(ok);
+}
+
+int open_data_file(const string& path, std::future<bool> *fed) {
+  if (is_plain_data_file(path)) return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+  int src;
+  if (parse_fd_ref(path, src)) {
+    // an open file description of its own, at offset 0. the program can seek
+    // in it, and the offset shared with src is never moved
+    int fd = open(format("/proc/self/fd/%d", src).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) return fd;
+    log_debug("cannot reopen fd %d: %s, feeding it through a pipe", src, strerror(errno));
+  }
+
+  std::promise<bool> promise;
+  if (fed) *fed = promise.get_future();
+
+  if (parse_fd_ref(path, src)) {
+    int pipe_fd[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) != 0) return -1;
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+    std::thread(feed_fd, src, pipe_fd[1], std::move(promise)).detach();
+    return pipe_fd[0];
+  }
+
+  Codec codec = CODEC_NONE;
+  string error;
+  std::shared_ptr<fs::MappedFile> file = map_data_file(path, codec, error);
+  if (!file) {
+    log_debug("%s", error.c_str());
+    return -1;
+  }
+  int pipe_fd[2];
+  if (pipe2(pipe_fd, O_CLOEXEC) != 0) return -1;
+  // the feeder runs ahead of the program by up to this much. ignore errors,
+  // the size is limited by /proc/sys/fs/pipe-max-size
+  fcntl(pipe_fd[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+  std::thread(feed_data, path, file, codec, pipe_fd[1], std::move(promise)).detach();
+  return pipe_fd[0];
+}
+
+bool extract_data_file(const string& path, const string& dest) {
+  DataFile file(path);
+  if (!file.ok()) return false;
+  int fd = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) return false;
+  bool ok = write_all(fd, file.data(), file.size());
+  if (close(fd) != 0) ok = false;
+  return ok;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <future>
+#include <memory>
+#include <string>
+#include "fs.hpp"
+
+// Test data can be read from problem archives without unpacking them. A path
+// like problem.zip!1.in (or problem.tar!data/1.in) refers to an entry.
+// Stored zip entries and tar entries are mapped in place, deflated zip
+// entries are inflated while they are read. The entry list of an archive is
+// read once per process and kept, keyed by its inode and mtime. Compressed
+// files (1.in.gz, see codec.hpp) are decompressed the same way.
+
+// test data in a file descriptor inherited by this process (--input-fd)
+#define FD_REF_PREFIX "fd:"
+
+// true if path is <archive>.zip!<entry> or <archive>.tar!<entry>
+bool split_archive_ref(const std::string& path, std::string& archive, std::string& entry);
+
+// true if path is fd:<n>
+bool parse_fd_ref(const std::string& path, int& fd);
+
+// take test data from fd, returns a fd:<n> reference to it. seekable files
+// (and memfds) are used as they are, every run reopens them (see open_data_file).
+// others (pipes) are read once into a memfd. empty (with error) on errors
+std::string adopt_data_fd(int fd, std::string& error);
+
+// the file holding the data of path: the archive of an entry, or path itself
+std::string get_data_file_path(const std::string& path);
+
+// basename of the data, ex. 1.in for problem.zip!data/1.in or 1.in.gz, fd3 for fd:3
+std::string get_data_file_name(const std::string& path);
+
+// where the (maybe compressed) data of path is stored: a range of file.
+// false if it is not in a named file
+bool get_data_file_range(const std::string& path, std::string& file, unsigned long long& offset, unsigned long long& length);
+
+// false for archive entries, compressed files and file descriptors, they
+// can not be used as they are
+bool is_plain_data_file(const std::string& path);
+
+// false (with error) if path is a reference to a missing entry, the archive
+// can not be read, it is compressed by something not available, or it is a
+// file descriptor which is not open
+bool check_data_file(const std::string& path, std::string& error);
+
+struct DataContent;
+
+// the content of a plain file (mapped), an archive entry or a compressed
+// file. with set_data_cache_size, contents are kept in a process-wide LRU
+// cache, keyed by dev, inode, mtime, ctime and size of the file, and shared
+// by threads. the file is checked (stat) every time, changes are noticed.
+// cached contents are read into memory instead of mapped, a file truncated
+// in place can not fault them
+class DataFile {
+  public:
+    DataFile(const std::string& path);
+    bool ok() const { return content_ != NULL; }
+    const char *data() const;
+    size_t size() const;
+    size_t chomped_size() const;  // without the ending '\n'
+    const std::string& sha1() const;  // computed once per content
+  private:
+    DataFile(const DataFile&);
+    DataFile& operator=(const DataFile&);
+    std::shared_ptr<DataContent> content_;
+};
+
+// bytes of contents DataFile may keep. 0 (default): nothing is kept
+void set_data_cache_size(long long size);
+
+struct DataCacheStats {
+  long hits;
+  long misses;
+  long entries;
+  long long size;
+};
+
+DataCacheStats get_data_cache_stats();
+
+// open for reading, close-on-exec. file descriptors are reopened through
+// /proc/self/fd, so the reader gets its own offset, starting at 0. archive
+// entries and compressed files are written to a pipe by a thread
+// (decompressing on the way), and so are file descriptors which can not be
+// reopened (pread'ing from the start). -1 on errors. the thread sets fed
+// when it is done: false if the data could not be read (ex. a truncated
+// .gz), the reader then got only a part of it
+int open_data_file(const std::string& path, std::future<bool> *fed = NULL);
+
+// write the (decompressed) content to dest
+bool extract_data_file(const std::string& path, const std::string& dest);
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Compare judging N submissions with one `ljudge --batch` against running N
+# separate `ljudge` processes, P at a time. Uses examples/a-plus-b.
+#
+#   bench/batch.sh [N] [P]
+#
+# Both ways use P threads in total, so the difference comes from what one
+# process shares: config lookups, chroot checks, checker builds and the
+# worker pool across submissions.
+
+N=${1:-200}
+P=${2:-`nproc`}
+LJUDGE=${LJUDGE:-ljudge}
+
+cd `dirname $0`/../../examples/a-plus-b || exit 1
+
+now() {
+  date +%s.%N
+}
+
+REQUESTS=.bench.$$.jsonl
+for i in `seq $N`; do
+  echo '{"userCode": "a.c", "checkerCode": "legacy_checker.c", "testcases": [{"input": "1.in", "output": "1.out"}, {"input": "2.in", "output": "2.out"}]}'
+done > $REQUESTS
+
+START=`now`
+$LJUDGE --batch --threads $P < $REQUESTS > /dev/null
+END=`now`
+echo "batch:     $N submissions in `awk "BEGIN { print $END - $START }"` seconds"
+
+START=`now`
+seq $N | xargs -P $P -I{} $LJUDGE --threads 1 --user-code a.c --checker-code legacy_checker.c \
+  --testcase --input 1.in --output 1.out --testcase --input 2.in --output 2.out > /dev/null
+END=`now`
+echo "processes: $N submissions in `awk "BEGIN { print $END - $START }"` seconds"
+
+unlink $REQUESTS
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Compare how fast a program can read its stdin when the input is a plain
+# file and when it is compressed (.gz, .zst, .xz) and decompressed by the
+# feeder thread of ljudge. The program measures its own reading rate.
+#
+#   bench/compressed.sh [MB]
+
+MB=${1:-256}
+LJUDGE=${LJUDGE:-ljudge}
+
+cd `dirname $0`/../../examples/a-plus-b || exit 1
+
+SRC=.bench.$$.c
+cat > $SRC <<'CODE'
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <time.h>
+static char buf[1 << 16];
+int main() {
+  struct timespec start, end;
+  unsigned long long total = 0;
+  size_t n;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) total += n;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%.0f MB in %.3fs, %.0f MB/s\n", total / 1e6, seconds, total / 1e6 / seconds);
+  return 0;
+}
+CODE
+
+# compressible like typical test data
+INPUT=.bench.$$.in
+seq 1000000000 | head -c ${MB}m > $INPUT
+
+run() {
+  echo -n "$1: "
+  $LJUDGE --skip-checker --max-cpu-time 30 --max-real-time 60 --max-output 1m --user-code $SRC --input $2 \
+    | grep -o '"stdout":"[^"]*' | cut -d'"' -f4 | sed 's|\\n$||; s|\\/|/|g'
+}
+
+run "plain" $INPUT
+for c in "gzip .gz" "zstd .zst" "xz .xz"; do
+  set -- $c
+  if command -v $1 > /dev/null; then
+    $1 -c $INPUT > $INPUT$2
+    run "$2   " $INPUT$2
+    unlink $INPUT$2
+  fi
+done
+
+unlink $INPUT
+unlink $SRC
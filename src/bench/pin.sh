@@ -0,0 +1,44 @@
+#!/bin/sh
+# Compare the variance of measured cpu time with and without --pin-cpus.
+# Runs a cpu bound program as N testcases, with all cpus busy.
+#
+#   bench/pin.sh [N] [cores|threads]
+
+N=${1:-32}
+MODE=${2:-cores}
+LJUDGE=${LJUDGE:-ljudge}
+
+cd `dirname $0`/../../examples/a-plus-b || exit 1
+
+SRC=.bench.$$.c
+cat > $SRC <<'CODE'
+#include <stdio.h>
+int main() {
+  volatile unsigned long x = 0;
+  for (unsigned long i = 0; i < 300000000UL; ++i) x += i ^ (x >> 3);
+  printf("%lu\n", (unsigned long)(x & 1));
+  return 0;
+}
+CODE
+
+TESTCASES=
+for i in `seq $N`; do
+  TESTCASES="$TESTCASES --testcase --input 1.in"
+done
+
+# mean and relative standard deviation of "time" of testcases
+stats() {
+  grep -o '"time":[0-9.e+-]*' | cut -d: -f2 | awk '
+    { sum += $1; sq += $1 * $1; n++ }
+    END {
+      mean = sum / n; sd = sqrt(sq / n - mean * mean)
+      printf("%d testcases, mean %.3fs, stddev %.3fs (%.1f%%)\n", n, mean, sd, 100 * sd / mean)
+    }'
+}
+
+printf "unpinned:        "
+$LJUDGE --skip-checker --max-cpu-time 10 --max-real-time 30 --user-code $SRC $TESTCASES | stats
+printf -- "--pin-cpus $MODE: "
+$LJUDGE --skip-checker --pin-cpus $MODE --max-cpu-time 10 --max-real-time 30 --user-code $SRC $TESTCASES | stats
+
+unlink $SRC
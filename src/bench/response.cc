@@ -0,0 +1,91 @@
+// Compare building a picojson tree (the old way) with streaming reports
+// using JsonWriter, for a response with many test cases.
+//
+//   make bench
+//   bench/response tree 10000 > /dev/null
+//   bench/response stream 10000 > /dev/null
+//
+// Every test case keeps a TRUNC_LOG sized stdout and stderr, like
+// --keep-stdout --keep-stderr does. Time and peak RSS go to stderr.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <vector>
+#include "../fs.hpp"
+#include "../response.hpp"
+#include "../deps/picojson/picojson.h"
+
+namespace j = picojson;
+using std::string;
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static string prepare_output(const char *name, char fill) {
+  string path = string("/tmp/ljudge-bench-") + name;
+  string content(TRUNC_LOG, fill);
+  for (size_t i = 0; i < content.length(); i += 61) content[i] = '\n';
+  fs::nwrite(path, content.data(), content.length());
+  return path;
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s tree|stream ncase\n", argv[0]);
+    return 1;
+  }
+  string mode = argv[1];
+  int ncase = atoi(argv[2]);
+  string stdout_path = prepare_output("stdout", 'o');
+  string stderr_path = prepare_output("stderr", '"');
+
+  double start = now();
+  if (mode == "tree") {
+    std::vector<j::value> results(ncase);
+    for (int i = 0; i < ncase; ++i) {
+      j::object result;
+      result["result"] = j::value(string("ACCEPTED"));
+      result["time"] = j::value(0.012);
+      result["memory"] = j::value((double)1220608);
+      result["stdout"] = j::value(fs::nread(stdout_path, TRUNC_LOG));
+      result["stderr"] = j::value(fs::nread(stderr_path, TRUNC_LOG));
+      results[i] = j::value(result);
+    }
+    j::object jo;
+    jo["testcases"] = j::value(results);
+    printf("%s", j::value(jo).serialize(false).c_str());
+  } else if (mode == "stream") {
+    JsonWriter writer(stdout);
+    writer.begin_object(1);
+    writer.write_key("testcases");
+    writer.begin_array();
+    for (int i = 0; i < ncase; ++i) {
+      TestcaseReport report;
+      report.result = "ACCEPTED";
+      report.has_usage = true;
+      report.time = 0.012;
+      report.memory = 1220608;
+      report.stdout_path = stdout_path;
+      report.stderr_path = stderr_path;
+      write_testcase_report(writer, report);
+    }
+    writer.end_array();
+    writer.end_object();
+  } else {
+    fprintf(stderr, "unknown mode: %s\n", mode.c_str());
+    return 1;
+  }
+  fflush(stdout);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(stderr, "%s: %d cases, %.3f seconds, peak RSS %ld KB\n", mode.c_str(), ncase, now() - start, usage.ru_maxrss);
+  return 0;
+}
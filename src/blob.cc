@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <functional>
+#include <list>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blob.hpp"
+#include "fs.hpp"
+#include "gc.hpp"
+#include "sha1.hpp"
+#include "utils.hpp"
+#include "deps/tinyformat/tinyformat.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+extern "C" {
+#include "deps/log.h/log.h"
+}
+
+using std::string;
+using tfm::format;
+
+// the content, inside blobs/<sha1>/. hidden so that it is not a name
+static const char BLOB_DATA[] = ".data";
+
+static bool is_blob_name(const string& name) {
+  return !name.empty() && name[0] != '.' && name.find('/') == string::npos;
+}
+
+// link <sha1>/<name> to the content. an existing name is kept
+static bool link_blob_name(const string& dir, const string& name) {
+  if (name.empty()) return true;
+  string path = fs::join(dir, name);
+  if (link(fs::join(dir, BLOB_DATA).c_str(), path.c_str()) == 0 || errno == EEXIST) return true;
+  log_debug("cannot link %s: %s", path.c_str(), strerror(errno));
+  return false;
+}
+
+// move tmp_path to <sha1>/.data unless another process got there first
+static bool publish_blob_data(const string& dir, const string& tmp_path) {
+  bool ok = link(tmp_path.c_str(), fs::join(dir, BLOB_DATA).c_str()) == 0 || errno == EEXIST;
+  unlink(tmp_path.c_str());
+  return ok;
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, data, len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return false;
+    data += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+static string get_blob_tmp_path(const string& dir) {
+  static std::atomic<unsigned int> counter(0);
+  return fs::join(dir, format("%s.%lu.%u.tmp", BLOB_DATA, (unsigned long)getpid(), counter++));
+}
+
+bool receive_blob(const string& blobs_dir, const string& sha1, const string& name, unsigned long long size, const std::function<bool(char *, size_t)>& read, string& error) {
+  string dir = fs::join(blobs_dir, sha1);
+  string tmp_path = get_blob_tmp_path(dir);
+  int fd = fs::mkdir_p(dir) < 0 ? -1 : open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  bool stored = fd >= 0;
+  Sha1Stream hash;
+  std::string buf(1 << 16, '\0');
+  // the bytes are read even if they can not be stored, the source stays in sync
+  for (unsigned long long received = 0; received < size; ) {
+    size_t len = (size_t)std::min((unsigned long long)buf.size(), size - received);
+    if (!read(&buf[0], len)) {
+      if (fd >= 0) close(fd);
+      unlink(tmp_path.c_str());
+      return false;
+    }
+    hash.update(buf.data(), len);
+    if (stored && !write_all(fd, buf.data(), len)) stored = false;
+    received += len;
+  }
+  if (fd >= 0) {
+    if (fsync(fd) != 0) stored = false;
+    if (close(fd) != 0) stored = false;
+  }
+  if (hash.hex() != sha1) {
+    error = format("%s is corrupted", sha1);
+  } else if (!stored || !publish_blob_data(dir, tmp_path) || !link_blob_name(dir, name)) {
+    error = format("cannot store %s in %s", sha1, blobs_dir);
+  }
+  unlink(tmp_path.c_str());
+  return true;
+}
+
+bool import_blob(const string& blobs_dir, const string& path, string& ref, string& error) {
+  fs::MappedFile file(path);
+  if (!file.ok()) {
+    error = format("cannot read %s", path);
+    return false;
+  }
+  string hash = sha1(file.data(), file.size());
+  string name = fs::basename(path);
+  if (!is_blob_name(name)) name = "";
+  ref = name.empty() ? hash : format("%s/%s", hash, name);
+  string dir = fs::join(blobs_dir, hash);
+  if (fs::mkdir_p(dir) < 0) {
+    error = format("cannot mkdir %s", dir);
+    return false;
+  }
+  if (fs::exists(fs::join(dir, BLOB_DATA))) {
+    log_debug("%s is already stored as %s", path.c_str(), hash.c_str());
+  } else {
+    // reflinks where the filesystem can
+    string tmp_path = get_blob_tmp_path(dir);
+    if (fs::copy(path, tmp_path, 0644) != 0 || !publish_blob_data(dir, tmp_path)) {
+      unlink(tmp_path.c_str());
+      error = format("cannot store %s", path);
+      return false;
+    }
+  }
+  if (!link_blob_name(dir, name)) {
+    error = format("cannot link %s into %s", name, dir);
+    return false;
+  }
+  return true;
+}
+
+string get_blob_path(const string& blobs_dir, const string& sha1, const string& name) {
+  string dir = fs::join(blobs_dir, sha1);
+  string data_path = fs::join(dir, BLOB_DATA);
+  if (name.empty()) return fs::exists(data_path) ? data_path : "";
+  string path = fs::join(dir, name);
+  // names stored before the content was kept separately are plain files
+  if (fs::exists(path)) return path;
+  if (!fs::exists(data_path) || !link_blob_name(dir, name)) return "";
+  return path;
+}
+
+bool resolve_blob_ref(const string& blobs_dir, string& path, string& error) {
+  static const size_t prefix_len = sizeof(BLOB_REF_PREFIX) - 1;
+  if (path.compare(0, prefix_len, BLOB_REF_PREFIX) != 0) return true;
+  string ref = path.substr(prefix_len);
+  string hash = ref.substr(0, 40);
+  string name = ref.length() > 40 ? ref.substr(41) : "";
+  if (!is_sha1(hash) || (ref.length() > 40 && (ref[40] != '/' || !is_blob_name(name)))) {
+    error = format("'%s' must be " BLOB_REF_PREFIX "<sha1>[/<name>]", path);
+    return false;
+  }
+  string local_path = get_blob_path(blobs_dir, hash, name);
+  if (local_path.empty()) {
+    error = format("%s is not in %s. import it with --import", path, blobs_dir);
+    return false;
+  }
+  path = local_path;
+  return true;
+}
+
+BlobCheck verify_blobs(const string& cache_dir) {
+  BlobCheck check = { 0, 0 };
+  string blobs_dir = fs::join(cache_dir, SUBDIR_BLOBS);
+  std::list<string> hashes = fs::scandir(blobs_dir);
+  for (__typeof(hashes.begin()) it = hashes.begin(); it != hashes.end(); ++it) {
+    if (!is_sha1(*it)) continue;
+    string dir = fs::join(blobs_dir, *it);
+    // older blobs have names only. all of them hold the same content
+    std::list<string> names = fs::scandir(dir);
+    bool corrupted = false;
+    for (__typeof(names.begin()) jt = names.begin(); jt != names.end(); ++jt) {
+      if (*jt != BLOB_DATA && !is_blob_name(*jt)) continue;
+      fs::MappedFile file(fs::join(dir, *jt));
+      if (!file.ok() || sha1(file.data(), file.size()) != *it) {
+        log_warn("blob %s/%s is corrupted", it->c_str(), jt->c_str());
+        corrupted = true;
+        break;
+      }
+      // hard links share the content, one is enough
+      if (*jt == BLOB_DATA) break;
+    }
+    if (!corrupted) {
+      ++check.ok;
+    } else if (move_to_trash(cache_dir, dir) || fs::rm_rf(dir) == 0) {
+      ++check.corrupted;
+    }
+  }
+  return check;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+// sub-directory name in cache_dir. content addressed files
+#define SUBDIR_BLOBS "blobs"
+
+// prefix of blob references in requests: blob:<sha1>[/<name>]
+#define BLOB_REF_PREFIX "blob:"
+
+// The blob store keeps each content once, as blobs/<sha1>/.data. Names
+// (blobs/<sha1>/<name>, the name matters for source code) are hard links to
+// it. Sandboxes and checkers get these paths (stdin or lrun --bindfs-ro),
+// nothing is copied.
+
+struct BlobCheck {
+  int ok;
+  int corrupted;  // moved to the trash
+};
+
+// hash the file and store it unless the content is there. ref is <sha1>/<basename>
+bool import_blob(const std::string& blobs_dir, const std::string& path, std::string& ref, std::string& error);
+
+// store size bytes, given by read in chunks, under their sha1 and name.
+// they go to a temp file in blobs_dir while they are hashed, never into
+// memory at once. false if read fails. otherwise all bytes were read, and
+// error is set if they do not match sha1 or can not be stored
+bool receive_blob(const std::string& blobs_dir, const std::string& sha1, const std::string& name, unsigned long long size, const std::function<bool(char *, size_t)>& read, std::string& error);
+
+// local path of a stored <sha1>/<name>, linking the name if only the
+// content is there. name can be empty. empty if the content is missing
+std::string get_blob_path(const std::string& blobs_dir, const std::string& sha1, const std::string& name);
+
+// if path is blob:<sha1>[/<name>], replace it with the local path.
+// false (with error) if it is a reference but the blob is missing
+bool resolve_blob_ref(const std::string& blobs_dir, std::string& path, std::string& error);
+
+// hash every content again. corrupted ones (with their names) are moved
+// to the trash of cache_dir
+BlobCheck verify_blobs(const std::string& cache_dir);
@@ -0,0 +1,841 @@
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "archive.hpp"
+#include "blob.hpp"
+#include "cluster.hpp"
+#include "fs.hpp"
+#include "request.hpp"
+#include "sha1.hpp"
+#include "utils.hpp"
+#include "deps/picojson/picojson.h"
+#include "deps/tinyformat/tinyformat.h"
+
+extern "C" {
+#include "deps/log.h/log.h"
+}
+
+using tfm::format;
+namespace j = picojson;
+
+#define fatal(...) { throw JudgeError(format(__VA_ARGS__)); }
+
+// a node which does not answer this long (on top of the limits) is considered dead
+static const int NODE_TIMEOUT = 60;  // seconds
+// largest file a worker fetches, in bytes. it is written to disk as it arrives
+static const long long MAX_BLOB_SIZE = 1LL << 30;
+// connections a worker serves at once, per thread. more wait to be accepted
+static const int CONNECTIONS_PER_THREAD = 4;
+
+// one message per line. blobs follow their header as raw bytes
+class Connection {
+  public:
+    explicit Connection(int fd) : fd_(fd) {}
+    ~Connection() { close(fd_); }
+
+    bool write(const string& data) {
+      return write(data.data(), data.length());
+    }
+
+    bool write(const char *data, size_t len) {
+      for (size_t written = 0; written < len; ) {
+        // no SIGPIPE if the peer is gone
+        ssize_t ret = send(fd_, data + written, len - written, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return false;
+        written += ret;
+      }
+      return true;
+    }
+
+    bool write_message(const j::object& message) {
+      return write(j::value(message).serialize() + "\n");
+    }
+
+    bool read_bytes(char *data, size_t size) {
+      while (size > 0) {
+        if (buf_.empty() && !fill()) return false;
+        size_t len = std::min(size, buf_.length());
+        memcpy(data, buf_.data(), len);
+        buf_.erase(0, len);
+        data += len;
+        size -= len;
+      }
+      return true;
+    }
+
+    // return false on EOF, I/O error, or malformed message
+    bool read_message(j::object& message, string& type) {
+      size_t pos;
+      while ((pos = buf_.find('\n')) == string::npos) {
+        if (!fill()) return false;
+      }
+      string line = buf_.substr(0, pos);
+      buf_.erase(0, pos + 1);
+
+      j::value jv;
+      string error;
+      if (!parse_json(line, jv, error) || !jv.is<j::object>()) return false;
+      message = jv.get<j::object>();
+      if (!message.count("type") || !message["type"].is<string>()) return false;
+      type = message["type"].get<string>();
+      return true;
+    }
+
+    void set_timeout(int seconds) {
+      struct timeval tv = { seconds, 0 };
+      setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+  private:
+    bool fill() {
+      char chunk[65536];
+      ssize_t ret;
+      do {
+        ret = recv(fd_, chunk, sizeof(chunk), 0);
+      } while (ret < 0 && errno == EINTR);
+      if (ret <= 0) return false;
+      buf_.append(chunk, ret);
+      return true;
+    }
+
+    Connection(const Connection&);
+    Connection& operator=(const Connection&);
+
+    int fd_;
+    string buf_;
+};
+
+static j::object make_message(const string& type) {
+  j::object message;
+  message["type"] = j::value(type);
+  return message;
+}
+
+// "host:port" or "port"
+static void split_address(const string& address, string& host, string& port) {
+  size_t pos = address.rfind(':');
+  if (pos == string::npos) {
+    host = "";
+    port = address;
+  } else {
+    host = address.substr(0, pos);
+    port = address.substr(pos + 1);
+  }
+}
+
+// "<sha1>/<basename>", must not escape the blobs directory
+static bool is_blob_ref(const string& ref) {
+  size_t pos = ref.find('/');
+  if (pos != 40 || !is_sha1(ref.substr(0, 40))) return false;
+  string name = ref.substr(41);
+  return !name.empty() && name[0] != '.' && name.find('/') == string::npos;
+}
+
+static string get_blob_ref(const string& path) {
+  // archive entries and compressed files are sent as plain files
+  DataFile file(path);
+  return format("%s/%s", file.sha1(), get_data_file_name(path));
+}
+
+
+// ---- worker ----
+
+struct Worker {
+  Options defaults;
+  Testcase default_case;
+  string blobs_dir;
+  string code_dir;  // compiled user code, shared by all connections
+  int nthread;  // requests judged at once, more wait
+  std::atomic<int> running;  // requests being judged, reported to coordinators as load
+  std::mutex mutex;
+  std::condition_variable finished;
+  int judging;
+  int connections;  // being served, at most nthread * CONNECTIONS_PER_THREAD
+};
+
+// at most worker.nthread requests are judged at once, whatever the number of connections
+struct ScopedWorkerThread {
+  ScopedWorkerThread(Worker& worker) : worker_(worker) {
+    std::unique_lock<std::mutex> lock(worker.mutex);
+    worker.finished.wait(lock, [&worker]() { return worker.judging < worker.nthread; });
+    ++worker.judging;
+  }
+  ~ScopedWorkerThread() {
+    std::lock_guard<std::mutex> lock(worker_.mutex);
+    --worker_.judging;
+    // the accept loop waits on it too
+    worker_.finished.notify_all();
+  }
+  Worker& worker_;
+};
+
+// blobs and compiled checkers found locally, or not
+struct CacheCount {
+  int hits;
+  int misses;
+};
+
+// make sure the blob is in blobs_dir, fetch it from the coordinator if not. path is where it is
+static bool ensure_blob(Worker& worker, Connection& conn, const string& ref, string& path, CacheCount& count, string& error) {
+  string hash = ref.substr(0, 40), name = ref.substr(41);
+  path = get_blob_path(worker.blobs_dir, hash, name);
+  if (!path.empty()) {
+    ++count.hits;
+    return true;
+  }
+  ++count.misses;
+
+  log_debug("worker: fetching %s", ref.c_str());
+  j::object fetch = make_message("fetch");
+  fetch["path"] = j::value(ref);
+  j::object header;
+  string type;
+  if (!conn.write_message(fetch) || !conn.read_message(header, type)) return false;
+  if (type != "blob" || !header["size"].is<double>()) {
+    error = header["error"].is<string>() ? header["error"].get<string>() : format("cannot fetch %s", ref);
+    return true;
+  }
+  double size = header["size"].get<double>();
+  // the bytes that follow can not be skipped, drop the connection
+  if (!(size >= 0 && size <= MAX_BLOB_SIZE)) {
+    log_warn("worker: %s is too large (%.0f bytes)", ref.c_str(), size);
+    return false;
+  }
+  if (!receive_blob(worker.blobs_dir, hash, name, (unsigned long long)size, [&conn](char *data, size_t len) { return conn.read_bytes(data, len); }, error)) return false;
+  if (error.empty()) path = get_blob_path(worker.blobs_dir, hash, name);
+  return true;
+}
+
+// replace the file reference in jo[key] with a local path
+static bool resolve_blob(Worker& worker, Connection& conn, j::object& jo, const char *key, CacheCount& count, string& error) {
+  if (!jo.count(key) || !error.empty()) return true;
+  if (!jo[key].is<string>() || !is_blob_ref(jo[key].get<string>())) {
+    error = format("'%s' must be <sha1>/<basename>", key);
+    return true;
+  }
+  string ref = jo[key].get<string>(), path;
+  if (!ensure_blob(worker, conn, ref, path, count, error)) return false;
+  jo[key] = j::value(path);
+  return true;
+}
+
+// return false if the connection is broken
+static bool handle_run(Worker& worker, Connection& conn, j::object& message) {
+  string error;
+  if (!message["request"].is<j::object>()) error = "'request' must be an object";
+  j::object request = error.empty() ? message["request"].get<j::object>() : j::object();
+  // local settings are not up to the coordinator
+  const char *local_keys[] = { "etcDir", "cacheDir", "format", "prettyPrint", "threads" };
+  for (size_t i = 0; i < sizeof(local_keys) / sizeof(local_keys[0]); ++i) request.erase(local_keys[i]);
+  // files are only exchanged as blobs (see resolve_blob), other paths would
+  // let a peer read or write local files
+  const char *path_keys[] = { "userStdout", "userStderr" };
+  j::array no_testcases;
+  j::array& testcases = (request.count("testcases") && request["testcases"].is<j::array>()) ? request["testcases"].get<j::array>() : no_testcases;
+  for (size_t i = 0; i < testcases.size() && error.empty(); ++i) {
+    if (!testcases[i].is<j::object>()) continue;
+    for (size_t k = 0; k < sizeof(path_keys) / sizeof(path_keys[0]); ++k) {
+      if (testcases[i].get<j::object>().count(path_keys[k])) error = format("'%s' is not accepted by workers", path_keys[k]);
+    }
+  }
+
+  // checked before fetching anything, resolve_blob does nothing after an error
+  CacheCount count = { 0, 0 };
+  if (!resolve_blob(worker, conn, request, "userCode", count, error)) return false;
+  if (!resolve_blob(worker, conn, request, "checkerCode", count, error)) return false;
+  for (size_t i = 0; i < testcases.size(); ++i) {
+    if (!testcases[i].is<j::object>()) continue;
+    if (!resolve_blob(worker, conn, testcases[i].get<j::object>(), "input", count, error)) return false;
+    if (!resolve_blob(worker, conn, testcases[i].get<j::object>(), "output", count, error)) return false;
+  }
+
+  Options opts = worker.defaults;
+  if (error.empty()) prepare_request(j::value(request).serialize(), opts, worker.default_case, error);
+  opts.nthread = 1;  // parallelism comes from connections
+
+  if (error.empty() && !opts.checker_code_path.empty()) {
+    // same layout as get_code_work_dir. the blob name starts with the sha1 of the code
+    string checker_sha1 = fs::basename(fs::dirname(opts.checker_code_path));
+    string checker_dir = fs::join(opts.cache_dir, SUBDIR_CHECKER, format("%s/%s", checker_sha1.substr(0, 2), checker_sha1.substr(2)));
+    ++(fs::is_dir(checker_dir) ? count.hits : count.misses);
+  }
+
+  string response;
+  if (error.empty()) {
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&buf, &size);
+    ScopedWorkerThread thread(worker);
+    ++worker.running;
+    try {
+      if (!fp) fatal("cannot create response buffer");
+      Context ctx(opts.cache_dir);
+      ctx.code_base_dir = worker.code_dir;
+      JsonWriter writer(fp);
+      judge(ctx, opts, writer);
+    } catch (const std::exception& ex) {
+      error = ex.what();
+    }
+    --worker.running;
+    if (fp) fclose(fp);
+    response = string(buf ? buf : "", size);
+    free(buf);
+  }
+
+  if (!error.empty()) {
+    j::object reply = make_message("error");
+    reply["error"] = j::value(error);
+    return conn.write_message(reply);
+  }
+  // response is already serialized. keys are in picojson order
+  return conn.write(format("{\"cache\":{\"hits\":%d,\"misses\":%d},\"response\":%s,\"type\":\"result\"}\n", count.hits, count.misses, response));
+}
+
+static void serve_connection(Worker *worker, int fd) {
+  Connection conn(fd);
+  j::object message;
+  string type;
+  while (conn.read_message(message, type)) {
+    bool ok;
+    if (type == "hello") {
+      j::object reply = make_message("hello");
+      reply["threads"] = j::value((double)worker->nthread);
+      reply["running"] = j::value((double)worker->running);
+      reply["version"] = j::value(string(LJUDGE_VERSION));
+      ok = conn.write_message(reply);
+    } else if (type == "run") {
+      ok = handle_run(*worker, conn, message);
+    } else {
+      j::object reply = make_message("error");
+      reply["error"] = j::value(format("unknown message type: %s", type));
+      ok = conn.write_message(reply);
+    }
+    if (!ok) break;
+  }
+  log_debug("worker: connection closed");
+  std::lock_guard<std::mutex> lock(worker->mutex);
+  --worker->connections;
+  worker->finished.notify_all();
+}
+
+void serve_worker(const string& address, int nthread, const Options& defaults, const Testcase& default_case) {
+  Worker worker;
+  worker.defaults = defaults;
+  worker.default_case = default_case;
+  worker.blobs_dir = fs::join(defaults.cache_dir, SUBDIR_BLOBS);
+  // <pid>.<name> like other process tmp dirs
+  worker.code_dir = fs::join(defaults.cache_dir, SUBDIR_TEMP, format("%lu.worker", (unsigned long)getpid()));
+#ifdef _OPENMP
+  if (nthread <= 0) nthread = get_resources().cpus;
+#endif
+  worker.nthread = nthread > 0 ? nthread : 1;
+  worker.running = 0;
+  worker.judging = 0;
+  worker.connections = 0;
+  if (fs::mkdir_p(worker.blobs_dir) < 0) fatal("cannot mkdir: %s", worker.blobs_dir.c_str());
+  if (fs::mkdir_p(worker.code_dir) < 0) fatal("cannot mkdir: %s", worker.code_dir.c_str());
+
+  string host, port;
+  split_address(address, host, port);
+  struct addrinfo hints, *addrs = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  // there is no authentication, other interfaces must be asked for (ex. 0.0.0.0:port)
+  int ret = getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &addrs);
+  if (ret != 0) fatal("cannot resolve %s: %s", address, gai_strerror(ret));
+
+  int listen_fd = -1;
+  for (struct addrinfo *ai = addrs; ai && listen_fd < 0; ai = ai->ai_next) {
+    listen_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (listen_fd < 0) continue;
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(listen_fd, 64) != 0) {
+      close(listen_fd);
+      listen_fd = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  if (listen_fd < 0) fatal("cannot listen on %s: %s", address, strerror(errno));
+  log_info("worker: listening on %s, %d threads", address.c_str(), worker.nthread);
+
+  for (;;) {
+    {
+      // each connection can hold a thread and a blob being received
+      std::unique_lock<std::mutex> lock(worker.mutex);
+      worker.finished.wait(lock, [&worker]() { return worker.connections < worker.nthread * CONNECTIONS_PER_THREAD; });
+    }
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fatal("accept: %s", strerror(errno));
+    }
+    {
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      ++worker.connections;
+    }
+    std::thread(serve_connection, &worker, fd).detach();
+  }
+}
+
+
+// ---- coordinator ----
+
+// points of every node on the hash ring
+static const int RING_REPLICAS = 64;
+// a problem spills over to the next node on the ring when its nodes would be
+// this much busier than the average (consistent hashing with bounded loads)
+static const double LOAD_SLACK = 0.25;
+
+struct NodeState {
+  string address;
+  Connection *conn;  // from the hello, NULL if the node is down. taken by its first channel
+  int threads;
+  int load;  // requests running on the node when it said hello
+  int runs;
+  CacheCount cache;  // blob and checker cache hits on the node, for this submission
+};
+
+struct DistributedJudge {
+  Context *ctx;
+  const Options *opts;
+  ResponseWriter *writer;
+  map<string, string> blobs;  // ref -> local path
+  vector<string> messages;  // "run" message of every testcase
+  string locality_key;  // decides which nodes are preferred
+  vector<NodeState> nodes;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<int> queue;  // testcases to run
+  int running;
+  vector<TestcaseReport> reports;
+  vector<bool> done;
+  int next_emit;
+  bool has_compilation;  // response head is written
+  bool compiled;
+  string error;  // first worker error, used if no compilation arrives
+  int live_channels;
+
+  DistributedJudge() : ctx(NULL), opts(NULL), writer(NULL), running(0), next_emit(0), has_compilation(false), compiled(false), live_channels(0) {}
+};
+
+static int connect_node(const string& node) {
+  string host, port;
+  split_address(node, host, port);
+  struct addrinfo hints, *addrs = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &addrs) != 0) return -1;
+  int fd = -1;
+  for (struct addrinfo *ai = addrs; ai && fd < 0; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  if (fd >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+  }
+  return fd;
+}
+
+static j::value limit_to_json(const Limit& limit) {
+  j::object jl;
+  jl["cpuTime"] = j::value(limit.cpu_time);
+  jl["realTime"] = j::value(limit.real_time);
+  jl["memory"] = j::value((double)limit.memory);
+  jl["output"] = j::value((double)limit.output);
+  jl["stack"] = j::value((double)limit.stack);
+  return j::value(jl);
+}
+
+static string add_blob(DistributedJudge& dj, const string& path) {
+  string ref = get_blob_ref(path);
+  dj.blobs[ref] = path;
+  return ref;
+}
+
+static void prepare_messages(DistributedJudge& dj) {
+  const Options& opts = *dj.opts;
+  j::object request;
+  request["userCode"] = j::value(add_blob(dj, opts.user_code_path));
+  if (!opts.checker_code_path.empty()) request["checkerCode"] = j::value(add_blob(dj, opts.checker_code_path));
+  request["skipChecker"] = j::value(opts.skip_checker);
+  request["keepStdout"] = j::value(opts.keep_stdout);
+  request["keepStderr"] = j::value(opts.keep_stderr);
+  request["compilerLimit"] = limit_to_json(opts.compiler_limit);
+  j::object envs;
+  for (__typeof(opts.envs.begin()) it = opts.envs.begin(); it != opts.envs.end(); ++it) envs[it->first] = j::value(it->second);
+  request["envs"] = j::value(envs);
+
+  // what a node caches for a problem: the checker, its work dir under
+  // SUBDIR_CHECKER is named by the sha1 of the code, and the test data
+  string content = opts.checker_code_path.empty() ? "" : request["checkerCode"].get<string>();
+  for (size_t i = 0; i < opts.cases.size(); ++i) {
+    const Testcase& testcase = opts.cases[i];
+    j::object jt;
+    jt["input"] = j::value(add_blob(dj, testcase.input_path));
+    content += "\n" + jt["input"].get<string>();
+    if (!testcase.output_sha1.empty()) {
+      jt["outputSha1"] = j::value(testcase.output_sha1 + "," + testcase.output_pe_sha1);
+    } else if (!testcase.output_path.empty()) {
+      jt["output"] = j::value(add_blob(dj, testcase.output_path));
+    }
+    if (jt.count("outputSha1")) content += "," + jt["outputSha1"].get<string>();
+    if (jt.count("output")) content += "," + jt["output"].get<string>();
+    jt["limit"] = limit_to_json(testcase.runtime_limit);
+    jt["checkerLimit"] = limit_to_json(testcase.checker_limit);
+    request["testcases"] = j::value(j::array(1, j::value(jt)));
+
+    j::object message = make_message("run");
+    message["request"] = j::value(request);
+    dj.messages.push_back(j::value(message).serialize() + "\n");
+  }
+  dj.locality_key = opts.affinity.empty() ? content : opts.affinity;
+}
+
+static string get_json_string(j::object& jo, const char *key) {
+  return jo[key].is<string>() ? jo[key].get<string>() : "";
+}
+
+static void read_compile_result(j::object& jo, CompileResult& result) {
+  result.log = get_json_string(jo, "log");
+  result.error = get_json_string(jo, "error");
+  result.success = jo["success"].is<bool>() && jo["success"].get<bool>();
+}
+
+// captured outputs are written to local scratch files, write_testcase_report reads them
+static string write_temp_output(Context& ctx, const string& prefix, const string& content) {
+  string path = get_scratch_file_path(ctx, prefix, (long long)content.length());
+  if (fs::nwrite(path, content.data(), content.length()) != (int)content.length()) fatal("cannot write %s", path.c_str());
+  return path;
+}
+
+static TestcaseReport read_testcase_report(Context& ctx, j::object& jo) {
+  TestcaseReport report;
+  report.result = get_json_string(jo, "result");
+  report.exceed = get_json_string(jo, "exceed");
+  report.error = get_json_string(jo, "error");
+  if (jo["time"].is<double>() && jo["memory"].is<double>()) {
+    report.has_usage = true;
+    report.time = jo["time"].get<double>();
+    report.memory = (long long)jo["memory"].get<double>();
+  }
+  if (jo["exitcode"].is<double>()) {
+    report.has_exitcode = true;
+    report.exitcode = (int)jo["exitcode"].get<double>();
+  }
+  if (jo["times"].is<j::array>()) {
+    j::array& times = jo["times"].get<j::array>();
+    for (size_t i = 0; i < times.size(); ++i) if (times[i].is<double>()) report.times.push_back(times[i].get<double>());
+  }
+  if (jo["termsig"].is<double>()) {
+    report.has_termsig = true;
+    report.termsig = (int)jo["termsig"].get<double>();
+  }
+  if (jo["stdout"].is<string>()) report.stdout_path = write_temp_output(ctx, "out", jo["stdout"].get<string>());
+  if (jo["stderr"].is<string>()) report.stderr_path = write_temp_output(ctx, "err", jo["stderr"].get<string>());
+  if (jo["checkerOutput"].is<string>()) report.checker_output_path = write_temp_output(ctx, "checker-out", jo["checkerOutput"].get<string>());
+  return report;
+}
+
+// write testcases which are done, in order. called with dj.mutex held
+static void emit_reports(DistributedJudge& dj) {
+  if (!dj.has_compilation || !dj.compiled) return;
+  int ncase = (int)dj.reports.size();
+  for (; dj.next_emit < ncase && dj.done[dj.next_emit]; ++dj.next_emit) {
+    TestcaseReport& report = dj.reports[dj.next_emit];
+    write_testcase_report(*dj.writer, report);
+    dj.writer->flush();
+    release_scratch_file(*dj.ctx, report.stdout_path);
+    release_scratch_file(*dj.ctx, report.stderr_path);
+    release_scratch_file(*dj.ctx, report.checker_output_path);
+    dj.reports[dj.next_emit] = TestcaseReport();
+  }
+}
+
+// called with dj.mutex held
+static void record_response(DistributedJudge& dj, int index, j::object& response) {
+  if (!dj.has_compilation && response["compilation"].is<j::object>()) {
+    CompileResult compile_result, checker_compile_result;
+    read_compile_result(response["compilation"].get<j::object>(), compile_result);
+    if (response["checkerCompilation"].is<j::object>()) read_compile_result(response["checkerCompilation"].get<j::object>(), checker_compile_result);
+    dj.compiled = compile_result.success && (dj.opts->checker_code_path.empty() || checker_compile_result.success);
+    dj.has_compilation = true;
+    begin_response(*dj.writer, *dj.opts, compile_result, checker_compile_result, dj.compiled);
+    // nothing else to run
+    if (!dj.compiled) dj.queue.clear();
+  }
+  if (response["testcases"].is<j::array>() && !response["testcases"].get<j::array>().empty()) {
+    j::value& jt = response["testcases"].get<j::array>()[0];
+    if (jt.is<j::object>()) dj.reports[index] = read_testcase_report(*dj.ctx, jt.get<j::object>());
+  }
+}
+
+// run one testcase on the node. return false if the node is dead
+static bool dispatch(DistributedJudge& dj, Connection& conn, NodeState& node, int index) {
+  if (!conn.write(dj.messages[index])) return false;
+  for (;;) {
+    j::object message;
+    string type;
+    if (!conn.read_message(message, type)) return false;
+    if (type == "fetch") {
+      string ref = get_json_string(message, "path");
+      if (!dj.blobs.count(ref)) {
+        j::object reply = make_message("error");
+        reply["error"] = j::value(format("unknown file %s", ref));
+        if (!conn.write_message(reply)) return false;
+        continue;
+      }
+      DataFile data(dj.blobs[ref]);
+      j::object header = make_message("blob");
+      header["size"] = j::value((double)data.size());
+      if (!conn.write_message(header) || !conn.write(data.data(), data.size())) return false;
+    } else if (type == "result" || type == "error") {
+      std::lock_guard<std::mutex> lock(dj.mutex);
+      ++node.runs;
+      if (message["cache"].is<j::object>()) {
+        j::object& jc = message["cache"].get<j::object>();
+        if (jc["hits"].is<double>()) node.cache.hits += (int)jc["hits"].get<double>();
+        if (jc["misses"].is<double>()) node.cache.misses += (int)jc["misses"].get<double>();
+      }
+      if (type == "result" && message["response"].is<j::object>()) {
+        record_response(dj, index, message["response"].get<j::object>());
+      } else {
+        string error = get_json_string(message, "error");
+        if (dj.error.empty()) dj.error = error;
+        dj.reports[index].result = TestcaseResult::INTERNAL_ERROR;
+        dj.reports[index].error = error;
+      }
+      dj.done[index] = true;
+      emit_reports(dj);
+      return true;
+    } else {
+      return false;
+    }
+  }
+}
+
+static void run_channel(DistributedJudge *dj, Connection *conn, NodeState *node) {
+  for (;;) {
+    int index;
+    {
+      std::unique_lock<std::mutex> lock(dj->mutex);
+      // a running testcase may come back if its node dies
+      dj->changed.wait(lock, [dj]() { return !dj->queue.empty() || dj->running == 0; });
+      if (dj->queue.empty()) break;
+      index = dj->queue.front();
+      dj->queue.pop_front();
+      ++dj->running;
+    }
+    bool ok = dispatch(*dj, *conn, *node, index);
+    std::lock_guard<std::mutex> lock(dj->mutex);
+    --dj->running;
+    if (!ok) {
+      log_warn("node %s is gone, re-dispatching testcase %d", node->address.c_str(), index);
+      if (!dj->has_compilation || dj->compiled) dj->queue.push_front(index);
+      dj->changed.notify_all();
+      break;
+    }
+    dj->changed.notify_all();
+  }
+  delete conn;
+  std::lock_guard<std::mutex> lock(dj->mutex);
+  --dj->live_channels;
+  dj->changed.notify_all();
+}
+
+static Connection *open_channel(const string& node, int timeout, j::object *hello) {
+  int fd = connect_node(node);
+  if (fd < 0) return NULL;
+  Connection *conn = new Connection(fd);
+  conn->set_timeout(timeout);
+  j::object reply;
+  string type;
+  if (!conn->write_message(make_message("hello")) || !conn->read_message(reply, type) || type != "hello") {
+    delete conn;
+    return NULL;
+  }
+  if (hello) *hello = reply;
+  return conn;
+}
+
+static unsigned int ring_hash(const string& str) {
+  return (unsigned int)strtoul(sha1(str).substr(0, 8).c_str(), NULL, 16);
+}
+
+// indexes of nodes, in the order met on the hash ring starting from key.
+// a problem keeps its nodes when nodes are added or removed elsewhere
+static vector<int> get_ring_order(const vector<NodeState>& nodes, const string& key) {
+  map<unsigned int, int> ring;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    for (int k = 0; k < RING_REPLICAS; ++k) ring[ring_hash(format("%s#%d", nodes[i].address, k))] = (int)i;
+  }
+  vector<int> order;
+  vector<bool> seen(nodes.size());
+  __typeof(ring.begin()) it = ring.lower_bound(ring_hash(key));
+  for (size_t k = 0; k < ring.size() && order.size() < nodes.size(); ++k, ++it) {
+    if (it == ring.end()) it = ring.begin();
+    if (seen[it->second]) continue;
+    seen[it->second] = true;
+    order.push_back(it->second);
+  }
+  return order;
+}
+
+// start channels to the node, at most its threads. called with dj.mutex held
+static void start_node(DistributedJudge& dj, vector<std::thread>& channels, NodeState& node, int count, int timeout) {
+  count = std::min(count, node.threads);
+  for (int k = 0; k < count; ++k) {
+    Connection *conn = node.conn;
+    node.conn = NULL;
+    if (!conn) conn = open_channel(node.address, timeout, NULL);
+    if (!conn) break;
+    ++dj.live_channels;
+    channels.push_back(std::thread(run_channel, &dj, conn, &node));
+  }
+  log_debug("node %s: %d channels, %d threads, %d running", node.address.c_str(), count, node.threads, node.load);
+}
+
+void judge_distributed(Context& ctx, const Options& opts, ResponseWriter& writer) {
+  DistributedJudge dj;
+  dj.ctx = &ctx;
+  dj.opts = &opts;
+  ctx.scratch_memory = opts.scratch_memory;
+  dj.writer = &writer;
+  prepare_messages(dj);
+
+  int ncase = (int)opts.cases.size();
+  dj.reports.resize(ncase);
+  dj.done.resize(ncase);
+  for (int i = 0; i < ncase; ++i) dj.queue.push_back(i);
+
+  // the slowest possible testcase, including a compilation
+  double max_time = opts.compiler_limit.real_time;
+  for (int i = 0; i < ncase; ++i) {
+    max_time = std::max(max_time, opts.compiler_limit.real_time + opts.cases[i].runtime_limit.real_time + opts.cases[i].checker_limit.real_time);
+  }
+  int timeout = (int)max_time + NODE_TIMEOUT;
+
+  // ask every node about its size and load
+  int total_threads = 0, total_load = 0;
+  dj.nodes.resize(opts.nodes.size());
+  for (size_t i = 0; i < opts.nodes.size(); ++i) {
+    NodeState& node = dj.nodes[i];
+    j::object hello;
+    node.address = opts.nodes[i];
+    node.conn = open_channel(node.address, timeout, &hello);
+    node.threads = hello["threads"].is<double>() ? std::max(1, (int)hello["threads"].get<double>()) : 1;
+    node.load = hello["running"].is<double>() ? (int)hello["running"].get<double>() : 0;
+    node.runs = 0;
+    node.cache.hits = node.cache.misses = 0;
+    if (!node.conn) {
+      log_warn("cannot connect to node %s", node.address.c_str());
+      continue;
+    }
+    total_threads += node.threads;
+    total_load += node.load;
+  }
+
+  // take nodes in ring order until they have a slot for every testcase. idle
+  // threads are always used, beyond that a node gets no busier than the
+  // bound and the problem spills over to the next one. the rest are spares
+  // if all chosen ones die
+  vector<std::thread> channels;
+  std::deque<int> spares;
+  if (total_threads > 0) {
+    double bound = (1 + LOAD_SLACK) * (total_load + ncase) / total_threads;
+    vector<int> order = get_ring_order(dj.nodes, dj.locality_key);
+    std::lock_guard<std::mutex> lock(dj.mutex);
+    int slots = 0;
+    for (size_t k = 0; k < order.size(); ++k) {
+      NodeState& node = dj.nodes[order[k]];
+      if (!node.conn) continue;
+      int capacity = std::max(node.threads, (int)(bound * node.threads)) - node.load;
+      if (slots >= ncase || (slots > 0 && capacity <= 0)) {
+        if (slots < ncase) log_debug("node %s is busy (%d running), skipped", node.address.c_str(), node.load);
+        spares.push_back(order[k]);
+        continue;
+      }
+      int count = std::min(std::max(capacity, 1), ncase - slots);
+      slots += count;
+      start_node(dj, channels, node, count, timeout);
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(dj.mutex);
+    for (;;) {
+      dj.changed.wait(lock, [&dj]() { return dj.live_channels == 0 || (dj.queue.empty() && dj.running == 0); });
+      if (dj.live_channels > 0 || dj.queue.empty() || spares.empty()) break;
+      // every chosen node is gone
+      NodeState& node = dj.nodes[spares.front()];
+      spares.pop_front();
+      start_node(dj, channels, node, (int)dj.queue.size(), timeout);
+    }
+  }
+  for (size_t i = 0; i < channels.size(); ++i) channels[i].join();
+
+  for (size_t i = 0; i < dj.nodes.size(); ++i) {
+    NodeState& node = dj.nodes[i];
+    delete node.conn;
+    int lookups = node.cache.hits + node.cache.misses;
+    if (node.runs == 0) continue;
+    log_info("node %s: %d testcases, cache hit rate %.0f%% (%d/%d)", node.address.c_str(), node.runs,
+             lookups ? 100.0 * node.cache.hits / lookups : 0.0, node.cache.hits, lookups);
+  }
+
+  if (!dj.has_compilation) {
+    if (channels.empty()) fatal("no worker node is available");
+    CompileResult compile_result, checker_compile_result;
+    compile_result.success = false;
+    compile_result.error = dj.error.empty() ? "no worker node is available" : dj.error;
+    begin_response(writer, opts, compile_result, checker_compile_result, false);
+  } else if (dj.compiled) {
+    // every node died
+    for (__typeof(dj.queue.begin()) it = dj.queue.begin(); it != dj.queue.end(); ++it) {
+      dj.reports[*it].result = TestcaseResult::INTERNAL_ERROR;
+      dj.reports[*it].error = "no worker node is available";
+      dj.done[*it] = true;
+    }
+    emit_reports(dj);
+    writer.end_array();
+  }
+  writer.end_object();
+}
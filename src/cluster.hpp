@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include "judge.hpp"
+#include "response.hpp"
+
+// Distributed judging. A coordinator splits the testcases of one submission
+// across worker nodes. They talk over TCP, one JSON message per line:
+//
+//   coordinator                                 worker
+//   {"type":"hello"}                        ->
+//                                           <-  {"type":"hello","threads":n,"running":n}
+//   {"type":"run","request":{...}}          ->
+//                                           <-  {"type":"fetch","path":"<sha1>/a.c"}
+//   {"type":"blob","size":n} + n raw bytes  ->
+//                                           <-  {"type":"result","cache":{...},"response":{...}}
+//
+// "request" is a request (see schema/request.json) with one testcase. Its
+// files are referred as "<sha1>/<basename>". Workers keep them in
+// cache_dir/blobs and only fetch missing ones. "response" is the response
+// of judge(). "cache" counts files and compiled checkers the worker already
+// had ("hits") or not ("misses").
+//
+// Workers are placed on a consistent hash ring. A problem (its checker and
+// test data, or --affinity) goes to the first nodes from its point on the
+// ring, so their caches stay warm. Nodes busier than the average by a bound
+// are skipped. The coordinator opens up to "threads" connections to a node.
+
+// Workers trust their coordinators, they do not authenticate them. Only
+// code and test data travel as files (blobs), paths in requests are refused.
+//
+// Serve coordinators on [host:]port (localhost if host is omitted). At most
+// nthread requests are judged at once, and 4 * nthread connections are
+// served, more wait to be accepted. Fetched blobs go to disk as they arrive.
+// Runs until the process is killed.
+void serve_worker(const string& address, int nthread, const Options& defaults, const Testcase& default_case);
+
+// Like judge(), but testcases run on opts.nodes. Testcases of a dead worker
+// are sent to the others. Results are written in testcase order. Cache hit
+// rates of nodes are logged (--debug).
+void judge_distributed(Context& ctx, const Options& opts, ResponseWriter& writer);
@@ -0,0 +1,176 @@
+#include <cstring>
+#include <dlfcn.h>
+#include <lzma.h>
+#include <mutex>
+#include <string>
+#include <zlib.h>
+#include "codec.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+extern "C" {
+#include "deps/log.h/log.h"
+}
+
+using std::string;
+
+// output chunk size. large chunks mean fewer writes to the stdin pipe
+static const size_t CHUNK_SIZE = 1 << 18;
+
+static const struct {
+  const char *ext;
+  Codec codec;
+} codec_exts[] = {
+  {".gz", CODEC_GZIP},
+  {".zst", CODEC_ZSTD},
+  {".xz", CODEC_XZ},
+};
+
+static bool has_suffix(const string& str, const char *suffix) {
+  size_t len = strlen(suffix);
+  return str.length() > len && str.compare(str.length() - len, len, suffix) == 0;
+}
+
+Codec get_codec(const string& path) {
+  for (size_t i = 0; i < sizeof(codec_exts) / sizeof(codec_exts[0]); ++i) {
+    if (has_suffix(path, codec_exts[i].ext)) return codec_exts[i].codec;
+  }
+  return CODEC_NONE;
+}
+
+string strip_codec_ext(const string& path) {
+  for (size_t i = 0; i < sizeof(codec_exts) / sizeof(codec_exts[0]); ++i) {
+    if (has_suffix(path, codec_exts[i].ext)) return path.substr(0, path.length() - strlen(codec_exts[i].ext));
+  }
+  return path;
+}
+
+// the stable streaming API of libzstd, see zstd.h
+struct ZstdInBuffer {
+  const void *src;
+  size_t size;
+  size_t pos;
+};
+
+struct ZstdOutBuffer {
+  void *dst;
+  size_t size;
+  size_t pos;
+};
+
+struct Zstd {
+  void *(*create_dstream)();
+  size_t (*free_dstream)(void *);
+  size_t (*decompress_stream)(void *, ZstdOutBuffer *, ZstdInBuffer *);
+  unsigned (*is_error)(size_t);
+};
+
+static const Zstd *load_zstd() {
+  static Zstd zstd;
+  static bool loaded = false;
+  static std::once_flag once;
+  std::call_once(once, []() {
+    void *lib = dlopen("libzstd.so.1", RTLD_NOW);
+    if (!lib) {
+      log_debug("cannot load libzstd: %s", dlerror());
+      return;
+    }
+    zstd.create_dstream = (void *(*)())dlsym(lib, "ZSTD_createDStream");
+    zstd.free_dstream = (size_t (*)(void *))dlsym(lib, "ZSTD_freeDStream");
+    zstd.decompress_stream = (size_t (*)(void *, ZstdOutBuffer *, ZstdInBuffer *))dlsym(lib, "ZSTD_decompressStream");
+    zstd.is_error = (unsigned (*)(size_t))dlsym(lib, "ZSTD_isError");
+    loaded = zstd.create_dstream && zstd.free_dstream && zstd.decompress_stream && zstd.is_error;
+  });
+  return loaded ? &zstd : NULL;
+}
+
+bool check_codec(Codec codec, string& error) {
+  if (codec == CODEC_ZSTD && !load_zstd()) {
+    error = "libzstd.so.1 is required to read .zst files";
+    return false;
+  }
+  return true;
+}
+
+static bool decode_zlib(bool gzip, const char *data, size_t size, const ChunkWriter& write) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, gzip ? 16 + MAX_WBITS : -MAX_WBITS) != Z_OK) return false;
+  string buf(CHUNK_SIZE, '\0');
+  stream.next_in = (Bytef *)data;
+  // avail_in is 32-bit
+  size_t left = size;
+  int ret = Z_OK;
+  while (true) {
+    if (stream.avail_in == 0 && left > 0) {
+      stream.avail_in = left > (1U << 30) ? (1U << 30) : left;
+      left -= stream.avail_in;
+    }
+    stream.next_out = (Bytef *)&buf[0];
+    stream.avail_out = buf.size();
+    ret = inflate(&stream, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END) break;
+    if (!write(buf.data(), buf.size() - stream.avail_out)) {
+      ret = Z_ERRNO;
+      break;
+    }
+    if (ret == Z_STREAM_END) {
+      // gzip members can be concatenated
+      if (!gzip || (stream.avail_in == 0 && left == 0)) break;
+      inflateReset(&stream);
+    }
+  }
+  inflateEnd(&stream);
+  return ret == Z_STREAM_END;
+}
+
+static bool decode_xz(const char *data, size_t size, const ChunkWriter& write) {
+  lzma_stream stream = LZMA_STREAM_INIT;
+  if (lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) return false;
+  string buf(CHUNK_SIZE, '\0');
+  stream.next_in = (const uint8_t *)data;
+  stream.avail_in = size;
+  lzma_ret ret = LZMA_OK;
+  while (ret == LZMA_OK) {
+    stream.next_out = (uint8_t *)&buf[0];
+    stream.avail_out = buf.size();
+    ret = lzma_code(&stream, stream.avail_in == 0 ? LZMA_FINISH : LZMA_RUN);
+    if ((ret == LZMA_OK || ret == LZMA_STREAM_END) && !write(buf.data(), buf.size() - stream.avail_out)) ret = LZMA_PROG_ERROR;
+  }
+  lzma_end(&stream);
+  return ret == LZMA_STREAM_END;
+}
+
+static bool decode_zstd(const char *data, size_t size, const ChunkWriter& write) {
+  const Zstd *zstd = load_zstd();
+  if (!zstd) return false;
+  void *stream = zstd->create_dstream();
+  if (!stream) return false;
+  string buf(CHUNK_SIZE, '\0');
+  ZstdInBuffer in = {data, size, 0};
+  bool ok = true;
+  // 0 means a frame is complete
+  size_t hint = 1;
+  while (ok && (in.pos < in.size || hint != 0)) {
+    ZstdOutBuffer out = {&buf[0], buf.size(), 0};
+    hint = zstd->decompress_stream(stream, &out, &in);
+    if (zstd->is_error(hint)) ok = false;
+    else if (!write(buf.data(), out.pos)) ok = false;
+    // truncated
+    else if (in.pos == in.size && out.pos == 0 && hint != 0) ok = false;
+  }
+  zstd->free_dstream(stream);
+  return ok;
+}
+
+bool decode_data(Codec codec, const char *data, size_t size, const ChunkWriter& write) {
+  switch (codec) {
+    case CODEC_NONE: return write(data, size);
+    case CODEC_DEFLATE: return decode_zlib(false, data, size, write);
+    case CODEC_GZIP: return decode_zlib(true, data, size, write);
+    case CODEC_ZSTD: return decode_zstd(data, size, write);
+    case CODEC_XZ: return decode_xz(data, size, write);
+  }
+  return false;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+// Compressed test data. Files ending with .gz, .zst or .xz are decompressed
+// while they are read (see archive.hpp). zstd is loaded at runtime
+// (libzstd.so.1), the others are linked.
+enum Codec {
+  CODEC_NONE,
+  CODEC_DEFLATE,  // raw, inside zip archives
+  CODEC_GZIP,
+  CODEC_ZSTD,
+  CODEC_XZ,
+};
+
+// by file extension
+Codec get_codec(const std::string& path);
+
+// path without the extension of its codec
+std::string strip_codec_ext(const std::string& path);
+
+// false (with error) if the codec can not be used here
+bool check_codec(Codec codec, std::string& error);
+
+// called with decompressed chunks, returns false to stop
+typedef std::function<bool(const char *data, size_t len)> ChunkWriter;
+
+// decompress data (concatenated streams are allowed). false if it is
+// corrupted, truncated, or write returns false
+bool decode_data(Codec codec, const char *data, size_t size, const ChunkWriter& write);
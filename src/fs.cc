@@ -1,12 +1,21 @@
 #include "fs.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
 #include <list>
 #include <mntent.h>
 #include <string>
 #include <unistd.h>
+#include <linux/fs.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 using std::string;
@@ -17,6 +26,14 @@ extern "C" {
 
 const char fs::PATH_SEPARATOR = '/';
 
+// hidden, so that directory scanners can skip it. unique among threads
+static string format_tmp_name(const string& name) {
+  static std::atomic<unsigned int> counter(0);
+  char buf[48];
+  snprintf(buf, sizeof(buf), ".%lu.%u.tmp", (unsigned long)getpid(), counter++);
+  return "." + name + buf;
+}
+
 int fs::rename (const string& from, const string& to) {
   return fs_rename(from.c_str(), to.c_str());
 }
@@ -297,10 +314,137 @@ cleanup:
   return result;
 }
 
-fs::ScopedFileLock::ScopedFileLock(const string& path) {
-  int fd = open(path.c_str(), O_RDONLY);
+int fs::atomic_write(const string& path, const char *buffer, size_t len) {
+  string tmp_path = join(dirname(path), format_tmp_name(basename(path)));
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return -1;
+  for (size_t written = 0; written < len; ) {
+    ssize_t ret = ::write(fd, buffer + written, len - written);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      close(fd);
+      unlink(tmp_path.c_str());
+      return -1;
+    }
+    written += ret;
+  }
+  if (fsync(fd) != 0 || close(fd) != 0 || ::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    unlink(tmp_path.c_str());
+    return -1;
+  }
+  // make the rename durable
+  int dir_fd = open(dirname(path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) return -1;
+  int ret = fsync(dir_fd);
+  close(dir_fd);
+  return ret;
+}
+
+// copy from the current offsets of in and out
+static int copy_fd(int in, int out) {
+  while (true) {
+    ssize_t ret = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+    if (ret == 0) return 0;
+    if (ret > 0) continue;
+    if (errno == EINTR) continue;
+    // old kernels, across filesystems, or special files
+    if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) return -1;
+    break;
+  }
+  char buf[65536];
+  while (true) {
+    ssize_t n = ::read(in, buf, sizeof(buf));
+    if (n == 0) return 0;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    for (ssize_t written = 0; written < n; ) {
+      ssize_t ret = ::write(out, buf + written, n - written);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      written += ret;
+    }
+  }
+}
+
+int fs::copy(const string& from, const string& to, mode_t mode) {
+  int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) return -1;
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  if (out < 0) {
+    close(in);
+    return -1;
+  }
+  int ret = ioctl(out, FICLONE, in) == 0 ? 0 : copy_fd(in, out);
+  if (close(out) != 0) ret = -1;
+  close(in);
+  if (ret != 0) unlink(to.c_str());
+  return ret;
+}
+
+fs::MappedFile::MappedFile(const string& path, unsigned long long offset, long long length, bool copy) : data_(""), size_(0), addr_(NULL), mapped_size_(0), mapped_(false), ok_(false) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  init(fd, offset, length, copy);
+  close(fd);
+}
+
+fs::MappedFile::MappedFile(int fd, unsigned long long offset, long long length, bool copy) : data_(""), size_(0), addr_(NULL), mapped_size_(0), mapped_(false), ok_(false) {
+  init(fd, offset, length, copy);
+}
+
+void fs::MappedFile::init(int fd, unsigned long long offset, long long length, bool copy) {
+  struct stat st;
+  bool sized = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+  if (sized && (offset > (unsigned long long)st.st_size || (length >= 0 && (unsigned long long)length > st.st_size - offset))) return;
+  if (!copy && sized) {
+    size_t size = length >= 0 ? length : st.st_size - offset;
+    // mmap offsets must be page aligned
+    unsigned long long start = offset - offset % sysconf(_SC_PAGESIZE);
+    size_t mapped_size = size + (offset - start);
+    void *addr = size == 0 ? MAP_FAILED : mmap(NULL, mapped_size, PROT_READ, MAP_PRIVATE, fd, start);
+    if (addr != MAP_FAILED) {
+      madvise(addr, mapped_size, MADV_SEQUENTIAL);
+      addr_ = addr;
+      mapped_size_ = mapped_size;
+      data_ = (const char *)addr + (offset - start);
+      size_ = size;
+      mapped_ = true;
+      ok_ = true;
+      return;
+    }
+  }
+  // procfs files have st_size 0
+  if (sized && length >= 0) buffer_.reserve(length);
+  char buf[65536];
+  unsigned long long pos = offset;
+  while (length < 0 || buffer_.size() < (size_t)length) {
+    size_t want = length < 0 ? sizeof(buf) : std::min(sizeof(buf), (size_t)length - buffer_.size());
+    ssize_t n = pread(fd, buf, want, pos);
+    if (n == 0) break;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    buffer_.append(buf, n);
+    pos += n;
+  }
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+  ok_ = length < 0 || size_ == (size_t)length;
+}
+
+fs::MappedFile::~MappedFile() {
+  if (mapped_) munmap(addr_, mapped_size_);
+}
+
+fs::ScopedFileLock::ScopedFileLock(const string& path, bool nonblock) : fd_(-1) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
   if (fd < 0) return;
-  if (flock(fd, LOCK_EX) == 0) {
+  if (flock(fd, nonblock ? (LOCK_EX | LOCK_NB) : LOCK_EX) == 0) {
     this->fd_ = fd;
   } else {
     close(fd);
@@ -44,14 +44,54 @@ namespace fs {
   bool is_mounted(const std::string& path);
   std::list<std::string> scandir(const std::string& path);
   std::string resolve(const std::string& path);
+  // write to a temp file, fsync, rename to path and fsync the directory.
+  // readers see either nothing or the complete content, even after a crash
+  int atomic_write(const std::string& path, const char *buffer, size_t len);
+  // copy a file. shares the extents (FICLONE) if the filesystem can, then
+  // tries copy_file_range, then read and write. 0 on success
+  int copy(const std::string& from, const std::string& to, mode_t mode = 0666);
 
   extern const char PATH_SEPARATOR;
 
+  // Read-only view of a whole file (or a range), without copying it into a
+  // string. It is mmap'ed (MADV_SEQUENTIAL) if it is a regular file,
+  // otherwise (procfs) read into memory. A missing file is empty, check ok().
+  // With copy, it is always read: a mapping faults (SIGBUS) once the file
+  // is truncated, which matters for views kept for long
+  class MappedFile {
+    public:
+      // length < 0: till the end of the file
+      MappedFile(const std::string& path, unsigned long long offset = 0, long long length = -1, bool copy = false);
+      // fd stays open, and its offset is not changed
+      MappedFile(int fd, unsigned long long offset = 0, long long length = -1, bool copy = false);
+      ~MappedFile();
+      bool ok() const { return ok_; }
+      const char *data() const { return data_; }
+      size_t size() const { return size_; }
+      std::string str() const { return std::string(data_, size_); }
+    private:
+      MappedFile(const MappedFile&);
+      MappedFile& operator=(const MappedFile&);
+      void init(int fd, unsigned long long offset, long long length, bool copy);
+      const char *data_;
+      size_t size_;
+      void *addr_;  // mmap, starts at a page boundary before data_
+      size_t mapped_size_;
+      bool mapped_;
+      bool ok_;
+      std::string buffer_;  // if not mapped
+  };
+
   class ScopedFileLock {
     public:
-      ScopedFileLock(const std::string& path);
+      // with nonblock, give up if the file is locked by others. check locked()
+      ScopedFileLock(const std::string& path, bool nonblock = false);
       ~ScopedFileLock();
+      bool locked() const { return fd_ >= 0; }
+      int fd() const { return fd_; }  // opened read-only
     private:
+      ScopedFileLock(const ScopedFileLock&);
+      ScopedFileLock& operator=(const ScopedFileLock&);
       int fd_;
   };
 }
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <mutex>
+#include <set>
+#include <signal.h>
+#include <spawn.h>
+#include <string>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "fs.hpp"
+#include "gc.hpp"
+#include "judge.hpp"
+#include "deps/tinyformat/tinyformat.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+extern "C" {
+#include "deps/log.h/log.h"
+}
+
+using std::string;
+using tfm::format;
+
+// in cache_dir/trash. held by the collector
+static const char TRASH_LOCK[] = ".lock";
+// in cache_dir/trash. its mtime is when garbage was last collected
+static const char COLLECT_STAMP[] = ".collected";
+// in compile cache entries, see pin_cache_entry
+static const char CACHE_PIN[] = ".pin";
+
+bool move_to_trash(const string& cache_dir, const string& path) {
+  static std::atomic<unsigned int> counter(0);
+  string trash_dir = fs::join(cache_dir, SUBDIR_TRASH);
+  if (fs::mkdir_p(trash_dir) < 0) return false;
+  // the same tmp dir name can come back after pid reuse
+  string dest = fs::join(trash_dir, format("%s.%lu.%u", fs::basename(path), (unsigned long)getpid(), counter++));
+  return rename(path.c_str(), dest.c_str()) == 0;
+}
+
+// pid of tmp/<pid>.*, 0 if the name is not like that
+static pid_t get_tmp_dir_pid(const string& name) {
+  char *end = NULL;
+  long pid = strtol(name.c_str(), &end, 10);
+  if (pid <= 0 || end == name.c_str() || *end != '.') return 0;
+  return (pid_t)pid;
+}
+
+static bool is_process_alive(pid_t pid) {
+  // EPERM: alive, owned by someone else
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// fd still refers to path, it was not moved away
+static bool is_same_file(int fd, const string& path) {
+  struct stat a, b;
+  return fstat(fd, &a) == 0 && stat(path.c_str(), &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+bool pin_cache_entry(const string& dir, int& fd) {
+  string path = fs::join(dir, CACHE_PIN);
+  // a few attempts, the entry can be evicted while we wait for the lock
+  for (int attempt = 0; attempt < 8; ++attempt) {
+    if (fs::mkdir_p(dir) < 0) return false;
+    int pin_fd = open(path.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (pin_fd < 0) {
+      if (errno == ENOENT) continue;
+      return false;
+    }
+    if (flock(pin_fd, LOCK_SH) == 0 && is_same_file(pin_fd, path)) {
+      // mtime is the last use. fails harmlessly if the entry belongs to another user
+      futimens(pin_fd, NULL);
+      fd = pin_fd;
+      return true;
+    }
+    close(pin_fd);
+  }
+  return false;
+}
+
+static long long get_disk_usage(const string& path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) return 0;
+  long long size = (long long)st.st_blocks * 512;
+  if (!S_ISDIR(st.st_mode)) return size;
+  std::list<string> names = fs::scandir(path);
+  for (__typeof(names.begin()) it = names.begin(); it != names.end(); ++it) size += get_disk_usage(fs::join(path, *it));
+  return size;
+}
+
+struct CacheEntry {
+  string path;
+  time_t used;
+  long long size;
+
+  bool operator<(const CacheEntry& other) const { return used < other.used; }
+};
+
+static void list_cache_entries(const string& root, std::vector<CacheEntry>& entries) {
+  std::list<string> prefixes = fs::scandir(root);
+  for (__typeof(prefixes.begin()) it = prefixes.begin(); it != prefixes.end(); ++it) {
+    string prefix_dir = fs::join(root, *it);
+    if (!fs::is_dir(prefix_dir)) continue;
+    std::list<string> names = fs::scandir(prefix_dir);
+    for (__typeof(names.begin()) jt = names.begin(); jt != names.end(); ++jt) {
+      CacheEntry entry;
+      entry.path = fs::join(prefix_dir, *jt);
+      struct stat st;
+      // entries compiled before pins existed count from their last change
+      if (stat(fs::join(entry.path, CACHE_PIN).c_str(), &st) != 0 && stat(entry.path.c_str(), &st) != 0) continue;
+      if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) continue;
+      entry.used = st.st_mtime;
+      entry.size = get_disk_usage(entry.path);
+      entries.push_back(entry);
+    }
+  }
+}
+
+// false if it is pinned
+static bool evict_cache_entry(const string& cache_dir, const string& dir) {
+  string path = fs::join(dir, CACHE_PIN);
+  fs::touch(path);
+  fs::ScopedFileLock lock(path, true /* nonblock */);
+  if (!lock.locked() || !is_same_file(lock.fd(), path)) return false;
+  return move_to_trash(cache_dir, dir);
+}
+
+// evict least recently used entries of compile caches until they fit in the budget
+static void evict_cache_entries(const string& cache_dir, const CacheBudget& budget, GarbageStats& stats) {
+  std::vector<CacheEntry> entries;
+  list_cache_entries(fs::join(cache_dir, SUBDIR_CHECKER), entries);
+  // compiled user code of running workers. the ones of dead workers are trashed as a whole
+  string tmp_dir = fs::join(cache_dir, SUBDIR_TEMP);
+  std::list<string> names = fs::scandir(tmp_dir);
+  for (__typeof(names.begin()) it = names.begin(); it != names.end(); ++it) {
+    const string& name = *it;
+    if (name.length() > 7 && name.compare(name.length() - 7, 7, ".worker") == 0) list_cache_entries(fs::join(tmp_dir, name), entries);
+  }
+
+  std::sort(entries.begin(), entries.end());
+  for (size_t i = 0; i < entries.size(); ++i) stats.size += entries[i].size;
+  stats.entries = (int)entries.size();
+  for (size_t i = 0; i < entries.size(); ++i) {
+    bool over_size = budget.size > 0 && stats.size > budget.size;
+    bool over_entries = budget.entries > 0 && stats.entries > budget.entries;
+    if (!over_size && !over_entries) break;
+    if (!evict_cache_entry(cache_dir, entries[i].path)) {
+      ++stats.busy;
+      continue;
+    }
+    log_debug("gc: evicted %s (%lld KB)", entries[i].path.c_str(), entries[i].size >> 10);
+    --stats.entries;
+    stats.size -= entries[i].size;
+    ++stats.evicted;
+    stats.evicted_size += entries[i].size;
+  }
+}
+
+// true if interval seconds passed since the last collection, which is then
+// recorded now. 0: always
+static bool is_collection_due(const string& trash_dir, int interval) {
+  string path = fs::join(trash_dir, COLLECT_STAMP);
+  struct stat st;
+  if (interval > 0 && stat(path.c_str(), &st) == 0 && time(NULL) - st.st_mtime < interval) return false;
+  fs::touch(path);
+  utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+  return true;
+}
+
+GarbageStats collect_garbage(const string& cache_dir, const CacheBudget& budget) {
+  GarbageStats stats = { 0, 0, 0, 0, 0, 0, 0 };
+  string trash_dir = fs::join(cache_dir, SUBDIR_TRASH);
+  if (fs::mkdir_p(trash_dir) < 0) return stats;
+  string lock_path = fs::join(trash_dir, TRASH_LOCK);
+  fs::touch(lock_path);
+  fs::ScopedFileLock lock(lock_path, true /* nonblock */);
+  if (!lock.locked()) return stats;
+
+  string tmp_dir = fs::join(cache_dir, SUBDIR_TEMP);
+  std::list<string> names = fs::scandir(tmp_dir);
+  for (__typeof(names.begin()) it = names.begin(); it != names.end(); ++it) {
+    pid_t pid = get_tmp_dir_pid(*it);
+    if (pid == 0 || pid == getpid() || is_process_alive(pid)) continue;
+    log_debug("gc: process %d is gone, trashing %s", (int)pid, it->c_str());
+    if (move_to_trash(cache_dir, fs::join(tmp_dir, *it))) ++stats.trashed;
+  }
+
+  is_collection_due(trash_dir, 0);
+  evict_cache_entries(cache_dir, budget, stats);
+
+  names = fs::scandir(trash_dir);
+  for (__typeof(names.begin()) it = names.begin(); it != names.end(); ++it) {
+    if (*it == TRASH_LOCK || *it == COLLECT_STAMP) continue;
+    if (fs::rm_rf(fs::join(trash_dir, *it)) == 0) ++stats.removed;
+  }
+  return stats;
+}
+
+void start_garbage_collector(const string& cache_dir, const CacheBudget& budget, int interval) {
+  static std::mutex mutex;
+  static std::set<string> started;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!started.insert(cache_dir).second) return;
+  }
+  std::thread([cache_dir, budget, interval]() {
+    while (true) {
+      GarbageStats stats = collect_garbage(cache_dir, budget);
+      if (stats.trashed || stats.removed) log_debug("gc: %d tmp dirs trashed, %d removed", stats.trashed, stats.removed);
+      if (stats.evicted || stats.busy) {
+        log_info("gc: compile caches: %d entries, %lld MB. evicted %d (%lld MB), %d pinned", stats.entries, stats.size >> 20, stats.evicted, stats.evicted_size >> 20, stats.busy);
+      }
+      sleep(interval);
+    }
+  }).detach();
+}
+
+void spawn_garbage_collector(const string& cache_dir, const CacheBudget& budget) {
+  // walking the compile caches costs more than a short judgment. the trash can wait
+  string trash_dir = fs::join(cache_dir, SUBDIR_TRASH);
+  if (fs::mkdir_p(trash_dir) < 0 || !is_collection_due(trash_dir, GC_INTERVAL)) return;
+
+  // a new ljudge --gc, not a fork: other threads may hold locks the child would need
+  string size = format("%lld", budget.size), entries = format("%d", budget.entries);
+  const char *argv[] = { "ljudge", "--cache-dir", cache_dir.c_str(), "--cache-size", size.c_str(), "--cache-entries", entries.c_str(), "--gc", NULL };
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_init(&actions);
+  // do not hold the pipes of whoever waits for the response
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, DEV_NULL, O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, DEV_NULL, O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, DEV_NULL, O_WRONLY, 0);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+  pid_t pid;
+  int ret = posix_spawn(&pid, "/proc/self/exe", &actions, &attr, (char * const *)argv, environ);
+  if (ret != 0) log_debug("cannot spawn a garbage collector: %s", strerror(ret));
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+}
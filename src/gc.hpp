@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+
+// sub-directory name in cache_dir. removed trees wait here for collect_garbage
+#define SUBDIR_TRASH "trash"
+
+// how often long-running modes (--batch, --spool, --worker) collect garbage
+#define GC_INTERVAL 60  // seconds
+
+// Compile caches (cache_dir/checker and the compiled user code of
+// workers) are kept within this budget, least recently used entries go first
+struct CacheBudget {
+  long long size;  // bytes. 0: no limit
+  int entries;  // 0: no limit
+};
+
+struct GarbageStats {
+  int trashed;  // tmp dirs of dead processes moved to the trash
+  int removed;  // trash entries removed
+  int entries;  // compile cache entries kept
+  long long size;  // bytes they use
+  int evicted;  // compile cache entries moved to the trash
+  long long evicted_size;
+  int busy;  // over the budget but pinned, kept
+};
+
+// rename path into cache_dir/trash, which is quick. false if it cannot be
+// renamed (ex. another filesystem), the caller should remove it then
+bool move_to_trash(const std::string& cache_dir, const std::string& path);
+
+// Entries of compile caches are directories (<root>/<xx>/<sha1 rest>). A
+// judgment holds a shared flock on <entry>/.pin while using one, whose
+// mtime is when it was last used. The collector only evicts an entry after
+// taking the exclusive lock without waiting. fd is closed to unpin
+bool pin_cache_entry(const std::string& dir, int& fd);
+
+// move cache_dir/tmp/<pid>.* of dead processes to the trash, evict compile
+// cache entries over the budget, then empty the trash. processes sharing
+// cache_dir must share the pid namespace. if another collector is running
+// on cache_dir, nothing is done
+GarbageStats collect_garbage(const std::string& cache_dir, const CacheBudget& budget);
+
+// collect_garbage in a background thread, now and every interval seconds.
+// a second call for the same cache_dir does nothing
+void start_garbage_collector(const std::string& cache_dir, const CacheBudget& budget, int interval = GC_INTERVAL);
+
+// run `ljudge --gc` in a new session, so that a short-lived ljudge can exit
+// without waiting for it. nothing is done if garbage was collected within
+// GC_INTERVAL
+void spawn_garbage_collector(const std::string& cache_dir, const CacheBudget& budget);
@@ -0,0 +1,2227 @@
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <atomic>
+#include <condition_variable>
+#include <fcntl.h>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#warning OpenMP support is not detected. Threading will not work
+#endif
+
+#include "sha1.hpp"
+#include "fs.hpp"
+#include "judge.hpp"
+#include "adaptive.hpp"
+#include "archive.hpp"
+#include "blob.hpp"
+#include "gc.hpp"
+#include "pin.hpp"
+#include "prefetch.hpp"
+#include "response.hpp"
+#include "slot.hpp"
+#include "utils.hpp"
+#include "deps/tinyformat/tinyformat.h"
+
+extern "C" {
+#include "deps/log.h/log.h"
+int debug_level;
+}
+
+using tfm::format;
+
+#define fatal(...) { throw JudgeError(format(__VA_ARGS__)); }
+
+struct LrunArgs : public vector<string> {
+  void append(const Limit& limit) {
+    /* [[[cog
+      import cog
+      opts = {'cpu_time': 'g', 'real_time': 'g', 'output': 'Ld', 'memory': 'Ld'}
+      for opt, flag in opts.items():
+        cog.out(
+          '''
+          if (%(opt)s > 0) {
+            push_back("--max-%(opt_m)s");
+            push_back(format("%%%(flag)s", %(opt)s));
+          }
+          ''' % {'opt': 'limit.' + opt,
+                 'opt_m': opt.replace('_', '-'),
+                 'flag': flag}, trimblanklines=True)
+    ]]] */
+    if (limit.real_time > 0) {
+      push_back("--max-real-time");
+      push_back(format("%g", limit.real_time));
+    }
+    if (limit.cpu_time > 0) {
+      push_back("--max-cpu-time");
+      push_back(format("%g", limit.cpu_time));
+    }
+    if (limit.memory > 0) {
+      push_back("--max-memory");
+      push_back(format("%Ld", limit.memory));
+    }
+    if (limit.output > 0) {
+      push_back("--max-output");
+      push_back(format("%Ld", limit.output));
+    }
+    if (limit.stack > 0) {
+      push_back("--max-stack");
+      push_back(format("%Ld", limit.stack));
+    }
+    /* [[[end]]] */
+  }
+
+  void append(const string& arg1) {
+    push_back(arg1);
+  }
+
+  void append(const string& arg1, const string& arg2) {
+    push_back(arg1);
+    push_back(arg2);
+  }
+
+  void append(const string& arg1, const string& arg2, const string& arg3) {
+    push_back(arg1);
+    push_back(arg2);
+    push_back(arg3);
+  }
+
+  void append(const vector<string>& args) {
+    insert(end(), args.begin(), args.end());
+  }
+
+  void append(const list<string>& args) {
+    insert(end(), args.begin(), args.end());
+  }
+
+  void append_default() {
+#ifndef NDEBUG
+    if (getenv("LJUDGE_DEBUG_LRUN")) push_back("--debug");
+#endif
+    append("--reset-env", "true");
+    append("--basic-devices", "true");
+    append("--remount-dev", "true");
+    if (maybe_create_lrun_empty_netns()) {
+      append("--netns", "lrun-empty");
+    } else {
+      append("--network", "false");
+    }
+    append("--chdir", "/tmp");
+    append("--env", "ONLINE_JUDGE", "1");
+    append("--env", "LANG", "en_US.UTF-8");
+    append("--env", "LC_ALL", "en_US.UTF-8");
+    append("--env", "HOME", "/tmp");
+    append("--env", "PATH", "/usr/bin:/bin:/etc/alternatives:/usr/local/bin");
+    // Pass as-is
+    static const char pass_envs[][16] = {"JAVA_HOME", "R_HOME"};
+    for (size_t i = 0; i < sizeof(pass_envs) / sizeof(pass_envs[0]); ++i) {
+      const char *env_val = getenv(pass_envs[i]);
+      if (env_val) append("--env", pass_envs[i], env_val);
+    }
+  }
+
+protected:
+
+  bool has_lrun_empty_netns() {
+    // Return true if lrun-empty netns exists
+    return fs::exists("/var/run/netns/lrun-empty");
+  }
+
+  bool maybe_create_lrun_empty_netns() {
+    // Return true if lrun-empty netns can be used
+    if (has_lrun_empty_netns()) return true;
+    if (!fs::exists("/dev/shm/ljudge-netns-attempted")) {
+      log_debug("running 'lrun-netns-empty create' to create empty netns");
+      system("lrun-netns-empty create 1>" DEV_NULL " 2>" DEV_NULL);
+      fs::touch("/dev/shm/ljudge-netns-attempted");
+      return has_lrun_empty_netns();
+    } else {
+      log_debug("lrun-empty netns does not exist");
+      return false;
+    }
+  }
+};
+
+struct LrunResult {
+  string error;
+  long long memory;
+  double cpu_time;
+  double real_time;
+  bool signaled;
+  int exit_code;
+  int term_sig;
+  string exceed;
+};
+
+#ifdef _OPENMP
+static std::map<string, omp_lock_t> omp_locks;
+static omp_lock_t omp_locks_lock = omp_lock_t();
+
+struct InitOmpLocksLock {
+  InitOmpLocksLock() {
+    omp_init_lock(&omp_locks_lock);
+  }
+} init_omp_locks_lock;
+
+struct ScopedOMPLock {
+  ScopedOMPLock(const string& name) {
+    omp_set_lock(&omp_locks_lock);
+    if (!omp_locks.count(name)) {
+      omp_locks[name] = omp_lock_t();
+      omp_init_lock(&omp_locks[name]);
+    }
+    plock_ = &omp_locks[name];
+    omp_unset_lock(&omp_locks_lock);
+    omp_set_lock(plock_);
+  }
+  ~ScopedOMPLock() {
+    omp_unset_lock(plock_);
+  }
+  omp_lock_t *plock_;
+};
+#endif
+
+void enforce_mkdir_p(const string& dir) {
+  if (fs::mkdir_p(dir) < 0) fatal("cannot mkdir: %s", dir.c_str());
+}
+
+/**
+ * Example:
+ *   get_config_path("/etc/ljudge", "/path.to/bla.clang.cc", "foo")
+ *
+ *   returns "/etc/ljudge/clang.cc/foo"  # if it exists
+ *   returns "/etc/ljudge/cc/foo"        # if it exists and the above one doesn't exist
+ *   returns "/etc/ljudge/_default/foo"  # if it exists and the above two don't exist, and strit is false
+ *   returns ""                          # if the above three don't exist
+ */
+static string find_config_path(const string& etc_dir, const string& basename, const string& config_name, bool strict) {
+  for (size_t pos = 0; (pos = basename.find('.', pos)) != string::npos; ) {
+    string ext = basename.substr(++pos);
+    string path = fs::join(etc_dir, ext, config_name);
+    if (fs::exists(path)) return path;
+  }
+  if (!strict) {
+    string path = fs::join(etc_dir, DEFAULT_CONF_DIR, config_name);
+    if (fs::exists(path)) return path;
+  }
+
+  return "";
+}
+
+static string get_config_path(const string& etc_dir, const string& code_path, const string& config_name, bool strict = false) {
+  string basename = fs::basename(code_path);
+  log_debug("get_config_path: %s %s", config_name.c_str(), basename.c_str());
+
+  // the result only depends on extensions. etc_dir is assumed to be unchanged
+  // while the process is running, so lookups are shared by all judgments
+  static std::mutex cache_mutex;
+  static map<string, string> cache;
+  size_t dot = basename.find('.');
+  string key = format("%s\n%s\n%s\n%d", etc_dir, dot == string::npos ? "" : basename.substr(dot), config_name, (int)strict);
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache.count(key)) return cache[key];
+  }
+  string path = find_config_path(etc_dir, basename, config_name, strict);
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  cache[key] = path;
+  return path;
+}
+
+/**
+ * Example:
+ *   cat /etc/ljudge/cc/cmd.compile
+ *   # comment line
+ *   g++
+ *   -Wall
+ *   $src
+ *   -o
+ *   $dest
+ *
+ *   get_config_list("/etc/ljudge", "/path.to/foo.cc", "cmd.compile")
+ *   returns {"g++", "-Wall", "$src", "-o", "$dest"}
+ *
+ *   get_config_list("/etc/ljudge", "/path.to/foo.cc", "notfound")
+ *   returns {}
+ */
+list<string> get_config_list(const string& etc_dir, const string& code_path, const string& name, bool strict) {
+  string path = get_config_path(etc_dir, code_path, name, strict);
+  log_debug("get_config_list: %s", path.c_str());
+  list<string> result;
+
+  char *line = NULL;
+  size_t line_size = 0;
+
+  if (!path.empty()) {
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp) fatal("can not open %s for reading", path.c_str());
+    for (ssize_t line_len = 0; line_len != -1; line_len = getline(&line, &line_size, fp)) {
+      if (!line || line_len <= 1 || line[0] == '#') continue;
+      if (line[line_len - 1] == '\n') line[line_len - 1] = 0;  // chomp
+      // ltrim
+      const char *p = line;
+      while (*p == ' ') ++p;
+      result.push_back(p);
+    }
+    fclose(fp);
+  }
+  if (line) free(line);
+  return result;
+}
+
+string get_config_content(const string& etc_dir, const string& code_path, const string& name, const string& fallback, bool strict) {
+  string result;
+  string config_path = get_config_path(etc_dir, code_path, name, strict);
+  log_debug("get_config_content: %s %s", name.c_str(), config_path.c_str());
+  if (!config_path.empty()) {
+    result = string_chomp(fs::read(config_path));
+  }
+  if (result.empty()) result = fallback;
+  return result;
+}
+
+static string get_src_name(const string& etc_dir, const string& code_path) {
+  string fallback = "a" + fs::extname(code_path);
+  return get_config_content(etc_dir, code_path, ENV_COMPILE EXT_SRC_NAME, fallback);
+}
+
+static string prepare_dummy_passwd(const string& cache_dir) {
+#ifdef _OPENMP
+  ScopedOMPLock("dummy_passwd_lock");
+#endif
+  string path = fs::join(cache_dir, format("tmp/etc/passwd-%d", (int)getuid()));
+  string content = format("nobody:%d:%d::/tmp:/bin/false\n", (int)getuid(), (int)getgid());
+  if (!fs::exists(path) || fs::read(path) != content) {
+    enforce_mkdir_p(fs::dirname(path));
+    fs::touch(path);
+    fs::ScopedFileLock lock(path);
+    fs::write(path, content.c_str());
+  }
+  return path;
+}
+
+static list<string> get_override_lrun_args(const string& etc_dir, const string& cache_dir, const string& code_path, const string& env, const string& chroot_path, const string& interpreter_name = "") {
+  list<string> result;
+  // Hide real /etc/passwd (required by Python) on demand
+  if (fs::exists(fs::join(chroot_path, ETC_PASSWD)) && get_config_content(etc_dir, code_path, format("%s%s", env, EXT_OPT_FAKE_PASSWD), OPTION_VALUE_TRUE) == OPTION_VALUE_TRUE) {
+    string passwd_path = prepare_dummy_passwd(cache_dir);
+    result.push_back("--bindfs-ro");
+    result.push_back(fs::join(chroot_path, ETC_PASSWD));
+    result.push_back(passwd_path);
+  }
+
+  // override_dir in config
+  string override_dir = get_config_path(etc_dir, code_path, format("%s%s", env, EXT_FS_OVERRIDE));
+  if (override_dir.empty()) return result;
+
+  list<string> files = fs::scandir(override_dir);
+  for (__typeof(files.begin()) it = files.begin(); it != files.end(); ++it) {
+    // treat "__" as "/"
+    string name = *it;
+    string path = name;
+    string_replacei(path, "__", "/");
+    if (fs::is_accessible(fs::join(chroot_path, path), R_OK)) {
+      result.push_back("--bindfs-ro");
+      result.push_back(fs::join(chroot_path, path));
+      result.push_back(fs::join(override_dir, name));
+    }
+  }
+  return result;
+}
+
+static bool is_fopen_filter_supported(const string& cache_dir) {
+  // annoying, but we have to do this check...
+  // otherwise we won't work on a Debian stock kernel if --fopen-filter is used in lrun args.
+  bool result = true;  // most distros enable it, Arch, Ubuntu, Fedora ... except for Debian
+  string release = uname_r();
+  // read result from cache first. If our detection is incorrect, the user is able to
+  // write the cache file to override it.
+  string cached_result_path = fs::join(cache_dir, SUBDIR_KERNEL_CONFIG_CACHE, "CONFIG_FANOTIFY_ACCESS_PERMISSIONS");
+  if (fs::is_accessible(cached_result_path)) {
+    result = ((fs::read(cached_result_path) + " ")[0] == 'y');
+  } else {
+    string kconfig_path = "/boot/config-" + release;  // only consider debian
+    if (fs::is_accessible(kconfig_path)) {
+      string kconfig_content = fs::read(kconfig_path);
+      if (kconfig_content.find("CONFIG_FANOTIFY_ACCESS_PERMISSIONS=y") == string::npos) {
+        result = false;
+      }
+    }
+    enforce_mkdir_p(fs::dirname(cached_result_path));
+    fs::write(cached_result_path, result ? "y" : "n");
+  }
+  return result;
+}
+
+// try to keep only lrun "safe" args
+template<typename L>
+static L filter_user_lrun_args(const L& items, const string& cache_dir) {
+  L result;
+  int next_safe = 0, next_ignored = 0;
+  for (__typeof(items.begin()) it = items.begin(); it != items.end(); ++it) {
+    string item = string(*it);
+    if (next_safe > 0) {
+      if (next_ignored == 0) {
+        result.push_back(item);
+      } else {
+        --next_ignored;
+      }
+      --next_safe;
+      continue;
+    }
+    if (item == "--syscalls" || item == "--domainname" || item == "--hostname" || item == "--ostype" \
+        || item == "--osrelease" || item == "--osversion") {
+      next_safe = 1;
+    } else if (item == "--fopen-filter" || item == "--tmpfs" || item == "--env") {
+      // tmpfs maybe unsafe, we only use it in R lang.
+      next_safe = 2;
+      if (!is_fopen_filter_supported(cache_dir)) {
+        next_ignored = next_safe;
+        static bool warned = false;
+        if (!warned) {
+          errno = 0;
+          log_warn("You system does not support --fopen-filter. The kernel must be compiled with %s", "CONFIG_FANOTIFY_ACCESS_PERMISSIONS");
+          continue;
+        }
+      }
+    } else {
+      log_info("lrun arg '%s' is unsafe, dropping it and following args", item.c_str());
+      break;
+    }
+    result.push_back(item);
+  }
+  return result;
+}
+
+template<typename L>
+static L escape_list(const L& items, const map<string, string>& mappings) {
+  L result;
+  for (__typeof(items.begin()) it = items.begin(); it != items.end(); ++it) {
+    string item = string(*it);
+    for (__typeof(mappings.begin()) it = mappings.begin(); it != mappings.end(); ++it) {
+      const string& k = it->first;
+      const string& v = it->second;
+      string_replacei(item, k, v);
+    }
+    result.push_back(item);
+  }
+  return result;
+}
+
+// seed is used by rand_r, it must not be shared by threads without locking
+static string get_random_hash(unsigned int& seed, int len = 40) {
+  static const char chars[] = "0123456789abcdef";
+  static const int MIN_LEN = 4;
+  if (len < MIN_LEN) len = MIN_LEN;
+
+  string result;
+  result.reserve(len);
+  for (int i = 0; i < len; ++i) result += chars[rand_r(&seed) % (sizeof(chars) - 1)];
+  return result;
+}
+
+
+static void ensure_system(const string& cmd) {
+  log_debug("running: %s", cmd.c_str());
+  int ret = system(cmd.c_str());
+  if (ret != 0) fatal("failed to run %s", cmd.c_str());
+}
+
+static string prepare_chroot(const string& etc_dir, const string& code_path, const string& env) {
+  string mirrorfs_config_path = get_config_path(etc_dir, code_path, format("%s%s", env, EXT_MIRRRORFS));
+  if (mirrorfs_config_path.empty()) fatal("cannot find mirrorfs config");
+
+  // mounted chroots stay until reboot, remember them to skip the lock below
+  static std::mutex mounted_mutex;
+  static map<string, string> mounted;  // mirrorfs_config_path -> dest
+  {
+    std::lock_guard<std::mutex> lock(mounted_mutex);
+    if (mounted.count(mirrorfs_config_path)) return mounted[mirrorfs_config_path];
+  }
+
+  string content = fs::read(mirrorfs_config_path);
+  string name = sha1(content);
+  string dest = fs::join(CHROOT_BASE_DIR, name);
+
+  log_debug("prepare_chroot: config = %s dest = %s", mirrorfs_config_path.c_str(), dest.c_str());
+
+  {
+    // lock both processes and threads
+#ifdef _OPENMP
+    ScopedOMPLock("chroot_lock");
+#endif
+    // enforce_mkdir_p(base_dir);
+    fs::ScopedFileLock chroot_dir_lock(mirrorfs_config_path);
+
+    if (fs::is_accessible(dest, F_OK)) {
+      log_debug("already mounted: %s", dest.c_str());
+      std::lock_guard<std::mutex> lock(mounted_mutex);
+      mounted[mirrorfs_config_path] = dest;
+      return dest;
+    }
+
+    string comment = fs::join(fs::basename(fs::dirname(mirrorfs_config_path)), env);
+    string cmd = format("lrun-mirrorfs --name %s --setup %s --comment %s 1>&2", name, shell_escape(mirrorfs_config_path), comment);
+    ensure_system(cmd);
+
+    // wait 5s until mount finishes
+    int is_mounted = 0;
+    for (int i = 0; i < 50; ++i) {
+      if (fs::is_accessible(dest, F_OK)) {
+        is_mounted = 1;
+        break;
+      }
+      usleep(100000); // 0.1s
+    }
+    if (!is_mounted) fatal("%s is not mounted correctly", dest.c_str());
+  }
+
+  std::lock_guard<std::mutex> lock(mounted_mutex);
+  mounted[mirrorfs_config_path] = dest;
+
+  return dest;
+}
+
+
+bool is_language_supported(const string& etc_dir, const string& code_path) {
+  // a supported language must have version command configured
+  if (get_config_path(etc_dir, code_path, ENV_VERSION EXT_CMD_LIST, true).empty()) {
+    return false;
+  } else {
+    return true;
+  }
+}
+
+static void check_path(std::vector<string>& errors, const string& path, bool is_dir, const string& name) {
+  if (path.empty()) {
+    errors.push_back(name + " is required");
+    return;
+  }
+
+  // entries of archives and file descriptors are checked by resolve_data_refs
+  int fd;
+  if (!is_dir && parse_fd_ref(path, fd)) return;
+  string file = get_data_file_path(path);
+  if (!(is_dir ? \
+          (fs::is_dir(path) && fs::is_accessible(path, R_OK | X_OK))
+        : (!fs::is_dir(file) && fs::is_accessible(file, R_OK)))) {
+    errors.push_back(name + " (" + path + ") is not accessible");
+  }
+}
+
+static void resolve_data_ref(const Options& options, string& path, vector<string>& errors) {
+  string error;
+  if (!resolve_blob_ref(fs::join(options.cache_dir, SUBDIR_BLOBS), path, error)) errors.push_back(error);
+}
+
+// test data can be inside archives, or compressed
+static void check_data_ref(const string& path, vector<string>& errors) {
+  string error;
+  if (!check_data_file(path, error)) errors.push_back(error);
+}
+
+void resolve_data_refs(Options& options, vector<string>& errors) {
+  resolve_data_ref(options, options.user_code_path, errors);
+  resolve_data_ref(options, options.checker_code_path, errors);
+  for (size_t i = 0; i < options.cases.size(); ++i) {
+    resolve_data_ref(options, options.cases[i].input_path, errors);
+    resolve_data_ref(options, options.cases[i].output_path, errors);
+    check_data_ref(options.cases[i].input_path, errors);
+    check_data_ref(options.cases[i].output_path, errors);
+  }
+}
+
+// --max-jitter. the controller is created by get_concurrency_controller
+static std::mutex concurrency_controller_mutex;
+static ConcurrencyController *concurrency_controller = NULL;
+// what the first validated judgment using it asked for
+static double concurrency_max_jitter = 0;
+static int concurrency_max_threads = 0;
+
+static int get_max_concurrency(const Options& opts) {
+  return opts.nthread > 0 ? opts.nthread : get_resources().cpus;
+}
+
+// judgments of a process (ex. requests of --batch) share the controller,
+// they can not ask for different settings. called last, the settings of an
+// invalid judgment are not recorded
+static void check_concurrency_options(const Options& options, vector<string>& errors) {
+  if (options.max_jitter <= 0) return;
+  std::lock_guard<std::mutex> lock(concurrency_controller_mutex);
+  if (concurrency_max_jitter > 0 && (concurrency_max_jitter != options.max_jitter || concurrency_max_threads != get_max_concurrency(options))) {
+    errors.push_back(format("with --max-jitter, all judgments of a process must use the same --max-jitter (%g) and threads (%d)", concurrency_max_jitter, concurrency_max_threads));
+  } else if (concurrency_max_jitter <= 0 && errors.empty()) {
+    concurrency_max_jitter = options.max_jitter;
+    concurrency_max_threads = get_max_concurrency(options);
+  }
+}
+
+void validate_options(const Options& options, vector<string>& errors) {
+  fs::mkdir_p(options.cache_dir);
+
+  check_path(errors, options.etc_dir, true, "--etc-dir");
+  check_path(errors, options.cache_dir, true, "--cache-dir");
+  check_path(errors, options.user_code_path, false, "--user-code");
+
+  for (int i = 0; i < (int)options.cases.size(); ++i) {
+    const Testcase& kase = options.cases[i];
+    if (!options.direct_mode || !kase.input_path.empty()) {
+      check_path(errors, kase.input_path, false /* is_dir */, format("--input of testcases[%d]", i));
+    }
+    if (options.skip_checker) {
+      if (!kase.output_path.empty()) errors.push_back("--output conflicts with --skip-checker");
+      if (!kase.output_sha1.empty()) errors.push_back("--output-sha1 conflicts with --skip-checker");
+    } else {
+      if (!kase.output_sha1.empty()) {
+        if (!is_sha1(kase.output_sha1)) errors.push_back("'" + kase.output_sha1 + "' is not a valid hex SHA1");
+        // allow output_pe_sha1 to be empty
+        if (!kase.output_pe_sha1.empty() && !is_sha1(kase.output_pe_sha1)) errors.push_back("'" + kase.output_pe_sha1 + "' is not a invalid hex SHA1");
+      } else {
+        check_path(errors, kase.output_path, false, format("--output of testcases[%d]", i));
+      }
+    }
+  }
+
+  if (options.cases.empty()) {
+    errors.push_back("At lease one testcase is required");
+  }
+
+  if (!options.nodes.empty()) {
+    for (int i = 0; i < (int)options.cases.size(); ++i) {
+      if (!options.cases[i].user_stdout_path.empty() || !options.cases[i].user_stderr_path.empty()) {
+        errors.push_back("--user-stdout and --user-stderr do not work with --nodes");
+        break;
+      }
+    }
+    // testcases are sent to the workers all at once, none of them is skipped
+    if (options.skip_on_first_failure) errors.push_back("--skip-on-first-failure does not work with --nodes");
+    // workers would not know what is left of them
+    if (options.max_total_cpu_time > 0 || options.max_total_real_time > 0) errors.push_back("--max-total-cpu-time and --max-total-real-time do not work with --nodes");
+  }
+
+  if (options.skip_checker && !options.checker_code_path.empty()) {
+    errors.push_back("--skip-checker conflicts with --checker-code");
+  }
+
+  if (options.format != FORMAT_JSON && options.format != FORMAT_CBOR) {
+    errors.push_back("--format must be " FORMAT_JSON " or " FORMAT_CBOR);
+  }
+
+  if (options.borderline_fraction < 0 || options.borderline_fraction >= 1 || options.borderline_reruns < 0) {
+    errors.push_back("--borderline-rerun needs a fraction in [0, 1) and a count >= 0");
+  }
+
+  if (options.borderline_stat != BORDERLINE_MIN && options.borderline_stat != BORDERLINE_MEDIAN) {
+    errors.push_back("--borderline-rerun decides by " BORDERLINE_MIN " or " BORDERLINE_MEDIAN);
+  }
+
+  if (options.max_total_cpu_time < 0 || options.max_total_real_time < 0) {
+    errors.push_back("--max-total-cpu-time and --max-total-real-time cannot < 0");
+  }
+
+  if (options.scratch_memory < 0) {
+    errors.push_back("--scratch-memory cannot < 0");
+  }
+
+  if (options.cache_size < 0 || options.cache_entries < 0) {
+    errors.push_back("--cache-size and --cache-entries cannot < 0");
+  }
+
+  if (options.prefetch < 0 || options.lock_test_data < 0 || options.test_data_cache < 0) {
+    errors.push_back("--prefetch, --lock-test-data and --test-data-cache cannot < 0");
+  }
+
+  if (options.max_jitter < 0) {
+    errors.push_back("--max-jitter cannot < 0");
+  }
+
+  if (!options.pin_cpus.empty() && options.pin_cpus != PIN_CPUS_CORES && options.pin_cpus != PIN_CPUS_THREADS) {
+    errors.push_back("--pin-cpus must be " PIN_CPUS_CORES " or " PIN_CPUS_THREADS);
+  }
+
+  if (getuid() == 0) {
+    errors.push_back("Running ljudge using root is forbidden");
+  }
+
+#ifdef _OPENMP
+  if (options.nthread < 0) {
+    errors.push_back("--threads cannot < 0");
+  }
+#endif
+
+  check_concurrency_options(options, errors);
+}
+
+static void setfd(int dst, int src) {
+  if (src == dst || src < 0) return;
+  dup2(src, dst);
+  close(src);
+}
+
+
+static LrunResult parse_lrun_output(const string& lrun_output) {
+  LrunResult result;
+  size_t pos = 0, start = 0;
+  for (;;) {
+    pos = lrun_output.find("\n", start);
+    int len = (pos == string::npos ? string::npos : pos - start);
+    string line = lrun_output.substr(start, len);
+    size_t space_pos = line.find(' ');
+    if (line.length() > 0 && space_pos > 0) {
+      string key = line.substr(0, space_pos);
+      string value = line.substr(9); // 9: lrun fixed field padding
+      if (key == "MEMORY") {
+        long long memory = 0;
+        if (sscanf(value.c_str(), "%Ld", &memory) != 1) result.error = "cannot read MEMORY";
+        else result.memory = memory;
+      } else if (key == "CPUTIME") {
+        double time = 0;
+        if (sscanf(value.c_str(), "%lf", &time) != 1) result.error = "cannot read CPUTIME";
+        else result.cpu_time = time;
+      } else if (key == "REALTIME") {
+        double time = 0;
+        if (sscanf(value.c_str(), "%lf", &time) != 1) result.error = "cannot read REALTIME";
+        else result.real_time = time;
+      } else if (key == "SIGNALED") {
+        if (value == "0") {
+          result.signaled = false;
+        } else if (value == "1") {
+          result.signaled = true;
+        } else result.error = "cannot read SIGNALED";
+      } else if (key == "EXITCODE") {
+        int code = 0;
+        if (sscanf(value.c_str(), "%d", &code) != 1) result.error = "cannot read EXITCODE";
+        else result.exit_code = code;
+      } else if (key == "TERMSIG") {
+        int code = 0;
+        if (sscanf(value.c_str(), "%d", &code) != 1) result.error = "cannot read TERMSIG";
+        else result.term_sig = code;
+      } else if (key == "EXCEED") {
+        if (value != "none") result.exceed = value;
+      }
+    }
+    start = pos + 1;
+    if (pos == string::npos) break;
+  }
+  return result;
+}
+
+#ifndef NDEBUG
+static unsigned int get_debug_seed() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned int)(ts.tv_nsec ^ getpid());
+}
+
+static void prepare_crash_report_path() {
+  unsigned int seed = get_debug_seed();
+  setenv("SEGFAULT_OUTPUT_NAME", format("/tmp/segv.%s.log", get_random_hash(seed, 6)).c_str(), 1 /* overwrite */);
+  setenv("SEGFAULT_USE_ALTSTACK", "1", 1 /* overwrite */);
+}
+#endif
+
+// the judgment whose testcase this thread runs. its lrun processes are killed when it runs out of time
+static thread_local Context *lrun_owner = NULL;
+// a lrun process of the testcase this thread runs was killed that way
+static thread_local bool lrun_cancelled = false;
+
+// kill running lrun processes of the judgment, its remaining testcases are
+// skipped. called with ctx.mutex held
+static void cancel_testcases(Context& ctx, const char *reason) {
+  if (ctx.out_of_time) return;
+  ctx.out_of_time = true;
+  log_info("%s, killing %d running testcases and skipping the rest", reason, (int)ctx.lrun_pids.size());
+  for (__typeof(ctx.lrun_pids.begin()) it = ctx.lrun_pids.begin(); it != ctx.lrun_pids.end(); ++it) {
+    kill(*it, SIGTERM);
+    ctx.cancelled_pids.insert(*it);
+  }
+}
+
+// lrun processes which printed their result but may still be exiting.
+// long-running modes (--batch, --spool, --worker, libljudge) would pile up
+// zombies otherwise. reaped by later runs, without waiting
+static std::mutex unreaped_mutex;
+static vector<pid_t> unreaped_pids;
+
+static void reap_lrun_processes(pid_t exiting_pid = 0) {
+  std::lock_guard<std::mutex> lock(unreaped_mutex);
+  if (exiting_pid) unreaped_pids.push_back(exiting_pid);
+  for (size_t i = 0; i < unreaped_pids.size(); ) {
+    int status;
+    pid_t ret = waitpid(unreaped_pids[i], &status, WNOHANG);
+    if (ret == 0 || (ret < 0 && errno == EINTR)) {
+      ++i;
+    } else {
+      unreaped_pids[i] = unreaped_pids.back();
+      unreaped_pids.pop_back();
+    }
+  }
+}
+
+struct ScopedLrunOwner {
+  ScopedLrunOwner(Context& ctx) {
+    lrun_owner = &ctx;
+    lrun_cancelled = false;
+  }
+  ~ScopedLrunOwner() { lrun_owner = NULL; }
+};
+
+static LrunResult lrun(
+#ifdef NDEBUG
+    const vector<string>& args, const string& stdin_path, const string& stdout_path, const string& stderr_path
+#else
+    vector<string> args, string stdin_path, string stdout_path, string stderr_path
+#endif
+    ) {
+  LrunResult result;
+  // opened here, archive entries need a thread to feed them
+  int stdin_fd = -1;
+  std::future<bool> stdin_fed;
+  if (!stdin_path.empty()) {
+    stdin_fd = open_data_file(stdin_path, &stdin_fed);
+    if (stdin_fd < 0) {
+      result.error = format("can not open %s for reading", stdin_path);
+      return result;
+    }
+  }
+  // close-on-exec, lrun processes of other judgments must not inherit it
+  int pipe_fd[2];
+  if (pipe2(pipe_fd, O_CLOEXEC) != 0) {
+    // the feeder of stdin_fd, if any, stops once nobody reads
+    if (stdin_fd >= 0) close(stdin_fd);
+    fatal("can not create pipe to run lrun");
+  }
+
+#ifndef NDEBUG
+  if (getenv("LJUDGE_SET_LRUN_SEGFAULT_PATH")) {
+    prepare_crash_report_path();
+  }
+  string debug_lrun_command = "lrun";
+  for (__typeof(args.begin()) it = args.begin(); it != args.end(); ++it) {
+      debug_lrun_command += " " + shell_escape(*it);
+  }
+  if (!stdin_path.empty()) debug_lrun_command += " <" + shell_escape(stdin_path);
+  if (!stdout_path.empty()) debug_lrun_command += " >" + shell_escape(stdout_path);
+  if (!stderr_path.empty()) {
+    if (stderr_path == stdout_path)
+      debug_lrun_command += " 2>&1";
+    else
+      debug_lrun_command += " 2>" + shell_escape(stderr_path);
+  }
+  log_debug("running: %s", debug_lrun_command.c_str());
+  fflush(stderr);
+  if (getenv("LJUDGE_KEEP_LRUN_STDERR") && stderr_path == DEV_NULL) {
+    unsigned int seed = get_debug_seed();
+    stderr_path = format("/tmp/ljudge_lrun.%s.log", get_random_hash(seed, 6));
+    log_debug("lrun stderr redirects to %s", stderr_path.c_str());
+  }
+#endif
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    log_debug("failed to fork\n");
+    result.error = "cannot fork to run lrun";
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    if (stdin_fd >= 0) close(stdin_fd);
+    return result;
+  }
+  if (pid) {
+    close(pipe_fd[1]);
+    if (stdin_fd >= 0) close(stdin_fd);
+    if (lrun_owner) {
+      std::lock_guard<std::mutex> lock(lrun_owner->mutex);
+      lrun_owner->lrun_pids.insert(pid);
+      // started while the judgment was being cancelled
+      if (lrun_owner->out_of_time) {
+        kill(pid, SIGTERM);
+        lrun_owner->cancelled_pids.insert(pid);
+      }
+    }
+
+    int status = 0;
+    string lrun_output = "";
+
+    while (true) {
+      char ch;
+      ssize_t read_size = read(pipe_fd[0], &ch, 1);
+      if (read_size == 1) {
+        lrun_output += ch;
+        if (ch == '\n' && lrun_output.find("EXCEED  ") != string::npos) {
+          // we receive enough content (EXCEED ... "\n" is the last line)
+          // lrun's exiting may take 0.03+ seconds (mostly the kernel
+          // cleaning up the pid and ipc namespace). do NOT wait for it.
+          //
+          // lrun ignores SIGPIPE so this won't hurt it.
+          //
+          // it is reaped by a later run (see reap_lrun_processes), or
+          // by init if we exit first.
+          //
+          // this reduces 0.03 to 0.04s per lrun run. when running
+          // examples/a-plus-b/run.sh, real time decreases from 14.27
+          // to 13.29, about 7%.
+          result = parse_lrun_output(lrun_output);
+          reap_lrun_processes(pid);
+          break;
+        }
+      } else {
+        // EOF or error. get lrun exit status
+        while (waitpid(pid, &status, 0) != pid) usleep(10000);
+        if (status && WIFSIGNALED(status)) {
+          result.error = format("lrun was signaled (%d)", WTERMSIG(status));
+        } else if (status && WEXITSTATUS(status) != 0) {
+          result.error = format("lrun exited with non-zero (%d)", WEXITSTATUS(status));
+        } else {
+          result.error = format("lrun did not generate expected output");
+        }
+        break;
+      }
+    }
+    close(pipe_fd[0]);
+    // a truncated archive entry or compressed file is only noticed while it
+    // is fed. the feeder is done soon after the program (and lrun) exits
+    if (stdin_fed.valid() && !stdin_fed.get() && result.error.empty()) result.error = format("%s is corrupted", stdin_path);
+    if (lrun_owner) {
+      std::lock_guard<std::mutex> lock(lrun_owner->mutex);
+      lrun_owner->lrun_pids.erase(pid);
+      if (lrun_owner->cancelled_pids.erase(pid)) lrun_cancelled = true;
+    }
+    log_debug("lrun output:\n%s", lrun_output.c_str());
+
+  } else {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    close(pipe_fd[0]);
+    // prepare fds. do not fclose stdio, that flushes buffered (partial) response in the child
+    // stdin first, stdin_fd can be 3
+    if (stdin_fd == STDIN_FILENO) {
+      fcntl(STDIN_FILENO, F_SETFD, 0);
+    } else {
+      setfd(STDIN_FILENO, stdin_fd);
+    }
+    // pass lrun's fd (3) output
+    static const int LRUN_FILENO = 3;
+    if (pipe_fd[1] == LRUN_FILENO) {
+      fcntl(LRUN_FILENO, F_SETFD, 0);
+    } else {
+      setfd(LRUN_FILENO, pipe_fd[1]);
+    }
+    if (!stderr_path.empty()) {
+      int ret = open(stderr_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0600);
+      if (ret < 0) { log_error("can not open %s for writing", stderr_path.c_str()); _exit(1); }
+      setfd(STDERR_FILENO, ret);
+    }
+    if (!stdout_path.empty()) {
+      if (stderr_path == stdout_path) {
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+      } else {
+        int ret = open(stdout_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0600);
+        if (ret < 0) { log_error("can not open %s for writing", stdout_path.c_str()); _exit(1); }
+        setfd(STDOUT_FILENO, ret);
+      }
+    }
+    // prepare args
+    const char **argv = (const char**)malloc(sizeof(char*) * (args.size() + 2));
+    argv[0] = "lrun";
+    for (int i = 0; i < (int)args.size(); ++i) {
+      argv[i + 1] = args[i].c_str();
+    }
+    argv[args.size() + 1] = 0;
+    // --pin-cpus. the sandbox inherits it
+    pin_current_process();
+    execvp("lrun", (char * const *) argv);
+    close(pipe_fd[1]);
+    log_error("can not start lrun");
+    // not throwing here because it is the child
+    _exit(1);
+  }
+
+  return result;
+}
+
+// output limits of live memfds of all judgments. pages written to them are
+// charged to the memory cgroup of ljudge
+static std::atomic<long long> scratch_reserved(0);
+
+static void close_scratch_file(const ScratchFile& file) {
+  close(file.fd);
+  scratch_reserved -= file.limit;
+}
+
+Context::Context(const string& cache_dir) : cache_dir(cache_dir), run_slot_wait(0), run_slot_waits(0), cpu_time_used(0), deadline(0), out_of_time(false), scratch_memory(0), prefetched(0) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  // time is not enough for contexts created at the same time, add some address randomness
+  seed = (unsigned int)(ts.tv_sec ^ (ts.tv_nsec << 4) ^ getpid() ^ (uintptr_t)this);
+}
+
+Context::~Context() {
+#ifndef NDEBUG
+  if (getenv("DEBUG") || getenv("NOCLEANUP")) {
+    log_debug("skip cleaning up");
+    return;
+  }
+#endif
+  for (__typeof(scratch_fds.begin()) it = scratch_fds.begin(); it != scratch_fds.end(); ++it) close_scratch_file(it->second);
+  for (size_t i = 0; i < cache_pins.size(); ++i) close(cache_pins[i]);
+  for (__typeof(cleanup_paths.begin()) it = cleanup_paths.begin(); it != cleanup_paths.end(); ++it) {
+    const string& path = *it;
+    if (!fs::exists(path)) continue;
+    // removing large trees takes a while, collect_garbage does it later
+    if (move_to_trash(cache_dir, path)) {
+      log_debug("cleaning: %s moved to %s", path.c_str(), SUBDIR_TRASH);
+      continue;
+    }
+    log_debug("cleaning: rm -rf %s", path.c_str());
+    fs::rm_rf(path);
+  }
+}
+
+static string get_process_tmp_dir(Context& ctx) {
+  std::lock_guard<std::mutex> lock(ctx.mutex);
+  if (ctx.tmp_dir.empty()) {
+    // <pid>.<random> so that judgments in one process do not share it
+    string base_dir = fs::join(ctx.cache_dir, SUBDIR_TEMP);
+    enforce_mkdir_p(base_dir);
+    string dir;
+    do {
+      dir = fs::join(base_dir, format("%lu.%s", (unsigned long)(getpid()), get_random_hash(ctx.seed, 8)));
+    } while (mkdir(dir.c_str(), 0755) != 0 && errno == EEXIST);
+    if (!fs::is_dir(dir)) fatal("cannot mkdir: %s", dir.c_str());
+    ctx.tmp_dir = dir;
+    ctx.cleanup_paths.push_back(dir);
+  }
+  return ctx.tmp_dir;
+}
+
+// user code is compiled here. it is private to the judgment unless code_base_dir is set
+static string get_user_code_base_dir(Context& ctx) {
+  return ctx.code_base_dir.empty() ? get_process_tmp_dir(ctx) : ctx.code_base_dir;
+}
+
+static string get_code_work_dir(Context& ctx, const string& base_dir, const string& code_path) {
+  // assume code file doesn't change
+  string key = code_path + "///" + base_dir;
+  {
+    std::lock_guard<std::mutex> lock(ctx.mutex);
+    if (ctx.code_work_dirs.count(key)) return ctx.code_work_dirs[key];
+  }
+  fs::MappedFile code(code_path);
+  string code_sha1 = sha1(code.data(), code.size());
+  string dest = fs::join(base_dir, format("%s/%s", code_sha1.substr(0, 2), code_sha1.substr(2)));
+  std::lock_guard<std::mutex> lock(ctx.mutex);
+  ctx.code_work_dirs[key] = dest;
+  return dest;
+}
+
+string get_temp_file_path(Context& ctx, const string& prefix, int len) {
+  string dir = get_process_tmp_dir(ctx);
+  while (true) {
+    string hash;
+    {
+      std::lock_guard<std::mutex> lock(ctx.mutex);
+      hash = get_random_hash(ctx.seed, len);
+    }
+    string dest = fs::join(dir, prefix.empty() ? hash : format("%s-%s", prefix, hash));
+    // no need to clean it up since it is inside the process tmp dir, which will be removed
+    int fd = open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd >= 0) {
+      close(fd);
+      return dest;
+    }
+    if (errno != EEXIST) fatal("can not prepare temp file %s", dest.c_str());
+  }
+}
+
+static bool reserve_scratch_memory(long long limit, long long budget) {
+  long long reserved = scratch_reserved;
+  do {
+    if (reserved + limit > budget) return false;
+  } while (!scratch_reserved.compare_exchange_weak(reserved, reserved + limit));
+  return true;
+}
+
+string get_scratch_file_path(Context& ctx, const string& prefix, long long limit) {
+  if (limit > 0 && reserve_scratch_memory(limit, ctx.scratch_memory)) {
+    // lrun opens it by path and hands the fd to the sandbox. MFD_CLOEXEC keeps it out of other children
+    int fd = memfd_create(prefix.c_str(), MFD_CLOEXEC);
+    if (fd >= 0) {
+      string path = format("/proc/%d/fd/%d", (int)getpid(), fd);
+      ScratchFile file = { fd, limit };
+      std::lock_guard<std::mutex> lock(ctx.mutex);
+      ctx.scratch_fds[path] = file;
+      return path;
+    }
+    scratch_reserved -= limit;
+    log_debug("memfd_create failed: %s. using %s", strerror(errno), SUBDIR_TEMP);
+  }
+  return get_temp_file_path(ctx, prefix);
+}
+
+void release_scratch_file(Context& ctx, const string& path) {
+  std::lock_guard<std::mutex> lock(ctx.mutex);
+  map<string, ScratchFile>::iterator it = ctx.scratch_fds.find(path);
+  if (it != ctx.scratch_fds.end()) {
+    close_scratch_file(it->second);
+    ctx.scratch_fds.erase(it);
+  } else if (!ctx.tmp_dir.empty() && path.compare(0, ctx.tmp_dir.length() + 1, ctx.tmp_dir + "/") == 0) {
+    unlink(path.c_str());
+  }
+}
+
+static map<string, string> get_mappings(const string& src_name, const string& exe_name, const string& dest) {
+  map<string, string> mappings;
+  mappings["$src"] = src_name;  // basename
+  mappings["$exe"] = exe_name;  // basename
+  mappings["$dir"] = dest;      // unsandboxed, workdir full path
+
+  return mappings;
+}
+
+// the smaller of configured and how many compilers fit in memory. 0: no limit.
+// processes sharing the slots must agree on their number, so it comes from
+// the total (or cgroup) memory, not from what is free at the moment
+static int get_compile_slots(int configured, const Limit& limit) {
+  long long memory = get_resources().memory;
+  if (memory <= 0 || limit.memory <= 0) return configured;
+  int by_memory = (int)std::max(1LL, memory / limit.memory);
+  return (configured > 0 && configured < by_memory) ? configured : by_memory;
+}
+
+static CompileResult compile_code(const string& etc_dir, const string& cache_dir, const string& dest /* work dir */, const string& code_path, const Limit& limit, int compile_slots) {
+  log_debug("compile_code: %s %s", code_path.c_str(), dest.c_str());
+
+  CompileResult result;
+  result.success = false;
+
+  if (!is_language_supported(etc_dir, code_path)) {
+    result.error = format("Compiling `%s` is not supported. No appropriate config found.", fs::basename(code_path));
+    return result;
+  }
+
+  enforce_mkdir_p(dest);
+
+  do {
+    // compile_code is not running in 2 threads. locking processes is enough.
+    fs::ScopedFileLock lock(dest);
+
+    string src_name = get_src_name(etc_dir, code_path);
+    string dest_code_path = fs::join(dest, src_name);
+    if (!fs::exists(dest_code_path)) {
+      log_debug("copying code from %s to %s", code_path.c_str(), dest_code_path.c_str());
+      if (fs::copy(code_path, dest_code_path) != 0) fatal("fail to copy code file to %s", dest_code_path.c_str());
+    }
+
+    std::list<string> compile_cmd = get_config_list(etc_dir, code_path, ENV_COMPILE EXT_CMD_LIST);
+    if (compile_cmd.empty()) {
+      result.success = true;
+      result.skipped = true;
+      log_debug("skip compilation because get_config_list() returns nothing");
+      break;
+    }
+
+    string dest_compile_log_path = fs::join(dest, "compile.log");
+    string exe_name = get_config_content(etc_dir, code_path, ENV_COMPILE EXT_EXE_NAME, DEFAULT_EXE_NAME);
+    string dest_exe_path = fs::join(dest, exe_name);
+    if (fs::exists(dest_exe_path)) {
+      result.success = true;
+      result.cached = true;
+      log_debug("skip compilation because binary exists: %s", dest_exe_path.c_str());
+      result.log = fs::nread(dest_compile_log_path, TRUNC_LOG);
+      break;
+    }
+
+    string chroot_path = prepare_chroot(etc_dir, code_path, ENV_COMPILE);
+
+    LrunArgs lrun_args;
+    lrun_args.append_default();
+    lrun_args.append("--chroot", chroot_path);
+    lrun_args.append("--bindfs", fs::join(chroot_path, "/tmp"), dest);
+    lrun_args.append(limit);
+
+    map<string, string> mappings = get_mappings(src_name, exe_name, dest);
+    lrun_args.append(filter_user_lrun_args(escape_list(get_config_list(etc_dir, code_path, ENV_COMPILE EXT_LRUN_ARGS), mappings), cache_dir));
+    lrun_args.append(filter_user_lrun_args(escape_list(get_config_list(etc_dir, code_path, ENV_EXTRA EXT_LRUN_ARGS), mappings), cache_dir));
+    // Override (hide) files using user provided options
+    lrun_args.append(get_override_lrun_args(etc_dir, cache_dir, code_path, ENV_COMPILE, chroot_path));
+    lrun_args.append("--");
+    lrun_args.append(escape_list(compile_cmd, mappings));
+
+    // compilers can be memory hungry. running too many of them at once swaps
+    int nslot = get_compile_slots(compile_slots, limit);
+    ScopedSlot slot(fs::join(cache_dir, SUBDIR_SLOTS, "compile"), nslot);
+    if (slot.waited() > 0) {
+      log_info("compiling %s waited %.3fs for a compile slot (%d slots)", fs::basename(code_path).c_str(), slot.waited(), nslot);
+    } else {
+      log_debug("compile slots: %d", nslot);
+    }
+
+    LrunResult lrun_result = lrun(lrun_args, DEV_NULL, dest_compile_log_path, dest_compile_log_path);
+
+    string log = string_chomp(fs::nread(dest_compile_log_path, TRUNC_LOG));
+
+    // check internal error (mostly lrun can not exec the compiler)
+    if (!lrun_result.error.empty()) {
+      result.error = lrun_result.error + "\n" + log;
+      break;
+    }
+
+    // compiler did run. check its status and outputs
+    result.log = log;
+    if (!lrun_result.exceed.empty()) {
+      result.log += format("%sCompiler exceeded %s limit", (log.empty() ? "" : "\n\n"), lrun_result.exceed);
+    } else if (lrun_result.signaled) {
+      result.log += format("%sCompiler was killed by signal %d\n\n", (log.empty() ? "" : "\n\n"), lrun_result.term_sig);
+    } else if (lrun_result.exit_code != 0) {
+      // the message is too common. only write to "log" if log is empty
+      if (result.log.empty()) result.log = format("Compiler exited with code %d", lrun_result.exit_code);
+    } else if (!fs::exists(dest_exe_path)) {
+      if (result.log.empty()) result.log = "Compiler did not create the expected binary";
+    } else {
+      result.success = true;
+    }
+  } while (false);
+
+  if (!result.success) {
+#ifndef NDEBUG
+    if (!getenv("DEBUG") && !getenv("NOCLEANUP")) {
+#endif
+      log_debug("cleaning: rm -rf %s", dest.c_str());
+      fs::rm_rf(dest);
+#ifndef NDEBUG
+    }
+#endif
+  }
+  return result;
+}
+
+static LrunResult run_code(
+    const string& etc_dir,
+    const string& cache_dir,
+    const string& dest,
+    const string& code_path,
+    const Limit& limit,
+    const string& stdin_path,
+    const string& stdout_path,
+    const string& stderr_path = DEV_NULL,
+    const vector<string>& extra_lrun_args = vector<string>(),
+    const string& env = ENV_RUN,
+    const vector<string>& extra_argv = vector<string>()
+) {
+  log_debug("run_code: %s", code_path.c_str());
+
+  string chroot_path = prepare_chroot(etc_dir, code_path, env);
+  string exe_name = get_config_content(etc_dir, code_path, ENV_COMPILE EXT_EXE_NAME, DEFAULT_EXE_NAME);
+
+  // assume it is precompiled
+  {
+    // not locking here because the directory is read-only
+    // fs::ScopedFileLock lock(dest);
+    std::list<string> run_cmd = get_config_list(etc_dir, code_path, ENV_RUN EXT_CMD_LIST);
+    if (run_cmd.empty()) {
+      // use exe name as fallback
+      run_cmd.push_back("./" + exe_name);
+    }
+
+    string src_name = get_src_name(etc_dir, code_path);
+    map<string, string> mappings = get_mappings(src_name, exe_name, dest);
+    mappings["$chroot"] = chroot_path;
+
+    LrunArgs lrun_args;
+    lrun_args.append_default();
+    lrun_args.append("--chroot", chroot_path);
+    lrun_args.append("--bindfs-ro", fs::join(chroot_path, "/tmp"), dest);
+    lrun_args.append(get_override_lrun_args(etc_dir, cache_dir, code_path, ENV_RUN, chroot_path, run_cmd.size() >= 2 ? (*run_cmd.begin()) : "" ));
+    lrun_args.append(limit);
+    lrun_args.append(escape_list(extra_lrun_args, mappings));
+    lrun_args.append(filter_user_lrun_args(escape_list(get_config_list(etc_dir, code_path, format("%s%s", env, EXT_LRUN_ARGS)), mappings), cache_dir));
+    lrun_args.append(filter_user_lrun_args(escape_list(get_config_list(etc_dir, code_path, ENV_EXTRA EXT_LRUN_ARGS), mappings), cache_dir));
+    lrun_args.append("--");
+    lrun_args.append(escape_list(run_cmd, mappings));
+    lrun_args.append(escape_list(extra_argv, mappings));
+
+    LrunResult run_result = lrun(lrun_args, stdin_path, stdout_path, stderr_path);
+
+    return run_result;
+  }
+}
+
+static string remove_space(const string& str) {
+  string result;
+  result.reserve(str.length());
+  for (size_t i = 0, l = str.length(); i < l; ++i) {
+    if (isspace(str[i])) continue;
+    result += str[i];
+  }
+  return result;
+}
+
+// length without the ending "\n", like string_chomp
+static size_t get_chomped_size(const fs::MappedFile& file) {
+  size_t n = file.size();
+  return (n > 0 && file.data()[n - 1] == '\n') ? n - 1 : n;
+}
+
+// remove_space(a) == remove_space(b), without copying
+static bool is_equal_without_space(const char *a, size_t a_len, const char *b, size_t b_len) {
+  size_t i = 0, j = 0;
+  while (true) {
+    while (i < a_len && isspace(a[i])) ++i;
+    while (j < b_len && isspace(b[j])) ++j;
+    if (i == a_len || j == b_len) return i == a_len && j == b_len;
+    if (a[i++] != b[j++]) return false;
+  }
+}
+
+static void run_standard_checker(TestcaseReport& result, const Testcase& testcase, const string& user_output_path) {
+  log_debug("run_standard_checker: %s %s", testcase.output_path.c_str(), user_output_path.c_str());
+  bool use_sha1 = !testcase.output_sha1.empty();
+  // outputs can be large, compare them in place
+  fs::MappedFile usr_file(user_output_path);
+  const char *usr = usr_file.data();
+  size_t usr_len = get_chomped_size(usr_file);
+
+  if (use_sha1) {
+    if (sha1(usr, usr_len) == testcase.output_sha1) {
+      result.result = TestcaseResult::ACCEPTED;
+    } else if (!testcase.output_pe_sha1.empty() && sha1(remove_space(string(usr, usr_len))) == testcase.output_pe_sha1) {
+      result.result = TestcaseResult::PRESENTATION_ERROR;
+    } else {
+      result.result = TestcaseResult::WRONG_ANSWER;
+    }
+  } else {
+    DataFile out_file(testcase.output_path);
+    if (!out_file.ok()) {
+      result.result = TestcaseResult::INTERNAL_ERROR;
+      result.error = format("cannot read %s", testcase.output_path);
+      return;
+    }
+    const char *out = out_file.data();
+    size_t out_len = out_file.chomped_size();
+    if (usr_len == out_len && memcmp(usr, out, usr_len) == 0) {
+      result.result = TestcaseResult::ACCEPTED;
+    } else if (is_equal_without_space(usr, usr_len, out, out_len)) {
+      result.result = TestcaseResult::PRESENTATION_ERROR;
+    } else {
+      result.result = TestcaseResult::WRONG_ANSWER;
+    }
+  }
+}
+
+static string get_full_path(const string& path) {
+  if (fs::is_absolute(path)) return path;
+  return fs::join(get_current_dir_name(), path);
+}
+
+// false if the data can not be extracted (ex. corrupted)
+static bool get_checker_data_path(Context& ctx, const string& path, const char *prefix, string& result) {
+  if (is_plain_data_file(path)) {
+    result = path;
+    return true;
+  }
+  result = get_temp_file_path(ctx, prefix);
+  if (extract_data_file(path, result)) return true;
+  unlink(result.c_str());
+  return false;
+}
+
+static void prepare_checker_mount_bind_files(const string& dest) {
+  // prepare files used for mount bind in checker work dir:
+  // - input: standard input
+  // - output: standard output
+  // - user_output: user output
+  // - user_code: user code
+
+  // lrun requires non-root users to use full path
+  fs::touch(fs::join(dest, "input"));
+  fs::touch(fs::join(dest, "output"));
+  fs::touch(fs::join(dest, "user_output"));
+  fs::touch(fs::join(dest, "user_code"));
+}
+
+static void run_custom_checker(Context& ctx, TestcaseReport& result, const string& etc_dir, const string& cache_dir, const string& code_path, const string& checker_code_path, const map<string, string>& envs, const Testcase& testcase, const string& user_output_path) {
+  log_debug("run_custom_checker: %s %s", testcase.output_path.c_str(), user_output_path.c_str());
+
+  // prepare check environment
+  // to be compatible with legacy checkers:
+  // - a file named "output" is standard output
+  // - a file named argv[1] is user output file path
+  // - stdin is standard input
+
+
+  // extra lrun args
+  LrunArgs lrun_args;
+
+  // bind mounts need plain files, archive entries and compressed files are extracted
+  string input_path, output_path;
+  const string *bad_path = NULL;
+  if (!get_checker_data_path(ctx, testcase.input_path, "input", input_path)) {
+    bad_path = &testcase.input_path;
+  } else if (!get_checker_data_path(ctx, testcase.output_path, "output", output_path)) {
+    if (input_path != testcase.input_path) unlink(input_path.c_str());
+    bad_path = &testcase.output_path;
+  }
+  if (bad_path) {
+    result.result = TestcaseResult::INTERNAL_ERROR;
+    result.error = format("cannot read %s", *bad_path);
+    return;
+  }
+  lrun_args.append("--bindfs-ro", "$chroot/tmp/input", get_full_path(input_path));
+  lrun_args.append("--bindfs-ro", "$chroot/tmp/output", get_full_path(output_path));
+  lrun_args.append("--bindfs-ro", "$chroot/tmp/user_output", get_full_path(user_output_path));
+  lrun_args.append("--bindfs-ro", "$chroot/tmp/user_code", get_full_path(code_path));
+
+  for (__typeof(envs.begin()) it = envs.begin(); it != envs.end(); ++it) {
+      lrun_args.append("--env", it->first, it->second);
+  }
+
+  // run checker
+  LrunResult lrun_result;
+  {
+    // the checker output is read back when the report gets written
+    string checker_output_path = get_scratch_file_path(ctx, "checker-out", testcase.checker_limit.output);
+    // should flock checker_output_path, but since we use different tmp path, and it is scoped in pid dir. no more necessary
+    // the checker needs argv[1], which is "user_output"
+    vector<string> checker_argv;
+    checker_argv.push_back("user_output");
+
+    // dest must be the same as the dest used for compile_code
+    string dest = get_code_work_dir(ctx, fs::join(cache_dir, SUBDIR_CHECKER), checker_code_path);
+    lrun_result = run_code(etc_dir, cache_dir, dest, checker_code_path, testcase.checker_limit, input_path, checker_output_path, DEV_NULL /* stderr */, lrun_args, ENV_CHECK, checker_argv);
+    result.checker_output_path = checker_output_path;
+  }
+  if (input_path != testcase.input_path) unlink(input_path.c_str());
+  if (output_path != testcase.output_path) unlink(output_path.c_str());
+
+  string status = TestcaseResult::INTERNAL_ERROR;
+  string error_message;
+  static const int CHECKER_EXITCODE_ACCEPTED = 0;
+  static const int CHECKER_EXITCODE_WRONG_ANSWER = 1;
+  static const int CHECKER_EXITCODE_PRESENTATION_ERROR = 2;
+  // In most unix systems exit code is limited to 8 bits, -1 becomes 255
+  static const int LEGACY_CHECKER_EXITCODE_WRONG_ANSWER = 255;
+
+  if (!lrun_result.error.empty()) {
+    error_message = "lrun internal error: " + lrun_result.error;
+  } else if (!lrun_result.exceed.empty()) {
+    error_message = "checker exceeded " + lrun_result.exceed + " limit";
+  } else if (lrun_result.signaled) {
+    error_message = format("checker was killed by signal %d", lrun_result.term_sig);
+  } else if (lrun_result.exit_code == CHECKER_EXITCODE_ACCEPTED) {
+    status = TestcaseResult::ACCEPTED;
+  } else if (lrun_result.exit_code == CHECKER_EXITCODE_WRONG_ANSWER || lrun_result.exit_code == LEGACY_CHECKER_EXITCODE_WRONG_ANSWER) {
+    status = TestcaseResult::WRONG_ANSWER;
+  } else if (lrun_result.exit_code == CHECKER_EXITCODE_PRESENTATION_ERROR) {
+    status = TestcaseResult::PRESENTATION_ERROR;
+  } else {
+    error_message = format("unknown checker exit code %d", lrun_result.exit_code);
+  }
+
+  result.error = error_message;
+  result.result = status;
+}
+
+static TestcaseReport run_testcase(Context& ctx, const string& etc_dir, const string& cache_dir, const string& code_path, const string& checker_code_path, const map<string, string>& envs, const Testcase& testcase, bool skip_checker = false, bool keep_stdout = false, bool keep_stderr = false) {
+  log_debug("run_testcase: %s", testcase.input_path.c_str());
+
+  // assume user code and checker code are pre-compiled
+  TestcaseReport result;
+
+  // prepare output file path
+  // a custom checker gets the output with lrun --bindfs-ro, which needs a real file
+  long long stdout_limit = checker_code_path.empty() || skip_checker ? testcase.runtime_limit.output : 0;
+  string stdout_path = testcase.user_stdout_path.empty() ? get_scratch_file_path(ctx, "out", stdout_limit) : testcase.user_stdout_path;
+  string stderr_path = testcase.user_stderr_path.empty() ? (keep_stderr ? get_scratch_file_path(ctx, "err", testcase.runtime_limit.output) : DEV_NULL) : testcase.user_stderr_path;
+  LrunResult run_result;
+  do {
+    // should flock stdout_path, but since we use different tmp path, and it is scoped in pid dir. no more necessary
+    // dest must be the same with dest used in compile_code
+    string dest = get_code_work_dir(ctx, get_user_code_base_dir(ctx), code_path);
+    run_result = run_code(etc_dir, cache_dir, dest, code_path, testcase.runtime_limit, testcase.input_path, stdout_path, stderr_path, vector<string>() /* extra_lrun_args */, ENV_RUN /* env */);
+
+    // stdout, stderr are read later, when the report gets written
+    if (keep_stdout) result.stdout_path = stdout_path;
+    if (keep_stderr) result.stderr_path = stderr_path;
+
+    // check lrun internal error
+    if (!run_result.error.empty()) {
+      result.result = TestcaseResult::INTERNAL_ERROR;
+      result.error = run_result.error;
+      break;
+    }
+
+    // not written unless has_usage, but charged to --max-total-cpu-time
+    result.time = run_result.cpu_time;
+    result.real_time = run_result.real_time;
+
+    // check limits
+    if (!run_result.exceed.empty()) {
+      const string& exceed = run_result.exceed;
+      if (exceed == "CPU_TIME" || exceed == "REAL_TIME") {
+        result.result = TestcaseResult::TIME_LIMIT_EXCEEDED;
+      } else if (exceed == "MEMORY") {
+        result.result = TestcaseResult::MEMORY_LIMIT_EXCEEDED;
+      } else if (exceed == "OUTPUT") {
+        result.result = TestcaseResult::OUTPUT_LIMIT_EXCEEDED;
+      }
+      result.exceed = exceed;
+      break;
+    }
+
+    // write memory, cpu_time
+    result.has_usage = true;
+    result.memory = run_result.memory;
+
+    // check signaled and exit code
+    if (run_result.signaled) {
+      // check known signals
+      int termsig = run_result.term_sig;
+      result.has_termsig = true;
+      result.termsig = termsig;
+      if (termsig == SIGFPE) {
+        result.result = TestcaseResult::FLOAT_POINT_EXCEPTION;
+      } else if (termsig == SIGSEGV) {
+        result.result = TestcaseResult::SEGMENTATION_FAULT;
+      } else {
+        result.result = TestcaseResult::RUNTIME_ERROR;
+      }
+      break;
+    } else if (run_result.exit_code != 0) {
+      int exitcode = run_result.exit_code;
+      result.has_exitcode = true;
+      result.exitcode = exitcode;
+      result.result = TestcaseResult::NON_ZERO_EXIT_CODE;
+      break;
+    }
+
+    if (skip_checker) {
+      // just accept it
+      result.result = TestcaseResult::ACCEPTED;
+    } else {
+      // run checker
+      if (checker_code_path.empty()) {
+        run_standard_checker(result, testcase, stdout_path);
+      } else {
+        run_custom_checker(ctx, result, etc_dir, cache_dir, code_path, checker_code_path, envs, testcase, stdout_path);
+      }
+    }
+  } while (false);
+
+  // the checker is done with it
+  if (!keep_stdout) release_scratch_file(ctx, stdout_path);
+
+  return result;
+}
+
+// Memory limits of running testcases are kept within the memory of the
+// host (or cgroup). Shared by all judgments in the process
+struct MemoryBudget {
+  std::mutex mutex;
+  std::condition_variable released;
+  long long budget;  // bytes, 0 if unknown
+  long long committed;  // sum of memory limits of running testcases
+  int running;
+  bool initialized;
+};
+static MemoryBudget memory_budget;
+
+// called with memory_budget.mutex held
+static long long get_memory_budget() {
+  MemoryBudget& mb = memory_budget;
+  if (!mb.initialized) {
+    mb.budget = get_resources().memory;
+    mb.initialized = true;
+    log_debug("memory budget for testcases: %lld MB", mb.budget >> 20);
+  }
+  return mb.budget;
+}
+
+// the checker starts after the program exits, they do not use memory at the same time
+static long long get_testcase_memory(const Options& opts, const Testcase& testcase) {
+  bool has_checker = !opts.checker_code_path.empty() && !opts.skip_checker;
+  return std::max(testcase.runtime_limit.memory, has_checker ? testcase.checker_limit.memory : 0);
+}
+
+// wait until the memory limit fits in the budget. one testcase always runs, even if it does not fit
+struct ScopedMemoryCommit {
+  ScopedMemoryCommit(long long bytes, int i) : bytes_(bytes) {
+    MemoryBudget& mb = memory_budget;
+    std::unique_lock<std::mutex> lock(mb.mutex);
+    long long budget = get_memory_budget();
+    auto fits = [&mb, budget, bytes]() { return budget <= 0 || mb.running == 0 || mb.committed + bytes <= budget; };
+    if (!fits()) {
+      log_debug("testcase %d waits for memory, %d running, %lld MB committed", i, mb.running, mb.committed >> 20);
+      mb.released.wait(lock, fits);
+    }
+    mb.committed += bytes;
+    ++mb.running;
+  }
+  ~ScopedMemoryCommit() {
+    MemoryBudget& mb = memory_budget;
+    std::lock_guard<std::mutex> lock(mb.mutex);
+    mb.committed -= bytes_;
+    --mb.running;
+    mb.released.notify_all();
+  }
+  long long bytes_;
+};
+
+// testcases running at once: threads, unless the memory budget allows fewer
+static void log_effective_parallelism(const Options& opts, int nthread) {
+  long long memory = 0;
+  for (size_t i = 0; i < opts.cases.size(); ++i) memory = std::max(memory, get_testcase_memory(opts, opts.cases[i]));
+  long long budget;
+  {
+    std::lock_guard<std::mutex> lock(memory_budget.mutex);
+    budget = get_memory_budget();
+  }
+  int parallelism = nthread;
+  if (budget > 0 && memory > 0) parallelism = (int)std::max(1LL, std::min((long long)nthread, budget / memory));
+  log_debug("effective parallelism: %d (%d threads, %lld MB per testcase, %lld MB budget)", parallelism, nthread, memory >> 20, budget >> 20);
+}
+
+// --borderline-rerun. the cpu time limit is raised by the fraction so that a
+// run near the limit is measured rather than killed. a run within the
+// fraction of the limit is repeated, the min or median time decides
+// killed at the cpu time limit
+static bool is_cpu_time_exceeded(const TestcaseReport& report) {
+  return report.result == TestcaseResult::TIME_LIMIT_EXCEEDED && report.exceed == "CPU_TIME";
+}
+
+// --borderline-rerun. a testcase runs with its limit first, so others pay
+// nothing. an accepted run close to the limit, or a run killed at it, runs
+// again with the raised limit. a run killed at the limit first gets one
+// probe, only if the probe finishes it is rerun further, so a program
+// which never finishes runs twice
+static TestcaseReport run_testcase_with_reruns(Context& ctx, const Options& opts, const Testcase& testcase, int i) {
+  double limit = testcase.runtime_limit.cpu_time;
+  double fraction = opts.borderline_fraction;
+  Testcase raised = testcase;
+  raised.runtime_limit.cpu_time = limit * (1 + fraction);
+  if (raised.runtime_limit.real_time > 0) raised.runtime_limit.real_time = std::max(raised.runtime_limit.real_time, raised.runtime_limit.cpu_time);
+
+  vector<TestcaseReport> reports;
+  reports.push_back(run_testcase(ctx, opts.etc_dir, opts.cache_dir, opts.user_code_path, opts.checker_code_path, opts.envs, testcase, opts.skip_checker, opts.keep_stdout, opts.keep_stderr));
+  const TestcaseReport& first = reports[0];
+  bool near_limit = first.result == TestcaseResult::ACCEPTED && first.has_usage && first.time >= limit * (1 - fraction);
+  if (!near_limit && !is_cpu_time_exceeded(first)) return first;
+
+  log_debug("testcase %d: %.3fs is close to the %.3fs limit, running it up to %d more times", i, first.time, limit, opts.borderline_reruns);
+  for (int k = 0; k < opts.borderline_reruns; ++k) {
+    reports.push_back(run_testcase(ctx, opts.etc_dir, opts.cache_dir, opts.user_code_path, opts.checker_code_path, opts.envs, raised, opts.skip_checker, opts.keep_stdout, opts.keep_stderr));
+    // needs more than the raised limit too, it is not borderline
+    if (k == 0 && !near_limit && is_cpu_time_exceeded(reports.back())) break;
+  }
+
+  // (time, run). killed runs count as over the raised limit
+  vector<std::pair<double, int> > ranked;
+  vector<double> times;
+  for (size_t k = 0; k < reports.size(); ++k) {
+    times.push_back(reports[k].time);
+    ranked.push_back(std::make_pair(is_cpu_time_exceeded(reports[k]) ? raised.runtime_limit.cpu_time * 2 : reports[k].time, (int)k));
+  }
+  std::sort(ranked.begin(), ranked.end());
+  const std::pair<double, int>& decided = opts.borderline_stat == BORDERLINE_MIN ? ranked[0] : ranked[(ranked.size() - 1) / 2];
+
+  // a run killed at a limit is a TLE report as it is. a run which finished
+  // over the limit is not, it gets a plain one
+  int kept = (decided.first <= limit || is_cpu_time_exceeded(reports[decided.second])) ? decided.second : -1;
+  for (size_t k = 0; k < reports.size(); ++k) {
+    if ((int)k == kept) continue;
+    release_scratch_file(ctx, reports[k].stdout_path);
+    release_scratch_file(ctx, reports[k].stderr_path);
+    release_scratch_file(ctx, reports[k].checker_output_path);
+  }
+  TestcaseReport result;
+  if (kept >= 0) {
+    result = reports[kept];
+  } else {
+    result.result = TestcaseResult::TIME_LIMIT_EXCEEDED;
+    result.exceed = "CPU_TIME";
+  }
+  result.times = times;
+  return result;
+}
+
+// a fixed cpu bound workload for ConcurrencyController, outside any chroot
+static bool run_calibration(double& cpu_time, double& real_time) {
+  LrunArgs lrun_args;
+  lrun_args.append_default();
+  lrun_args.append("--max-cpu-time", "10");
+  lrun_args.append("--max-real-time", "30");
+  lrun_args.append("--");
+  lrun_args.append("/bin/sh", "-c", "i=0; while [ $i -lt 200000 ]; do i=$((i+1)); done");
+  LrunResult result = lrun(lrun_args, DEV_NULL, DEV_NULL, DEV_NULL);
+  if (!result.error.empty() || !result.exceed.empty() || result.signaled || result.exit_code != 0) return false;
+  cpu_time = result.cpu_time;
+  real_time = result.real_time;
+  return true;
+}
+
+// shared by all judgments in the process. created by the first one using
+// --max-jitter, see check_concurrency_options for the others
+static ConcurrencyController *get_concurrency_controller(const Options& opts) {
+  if (opts.max_jitter <= 0) return NULL;
+  std::lock_guard<std::mutex> lock(concurrency_controller_mutex);
+  if (!concurrency_controller) concurrency_controller = new ConcurrencyController(get_max_concurrency(opts), opts.max_jitter, run_calibration);
+  return concurrency_controller;
+}
+
+struct ScopedConcurrency {
+  ScopedConcurrency(ConcurrencyController *controller) : controller_(controller), report_(NULL) {
+    if (controller_) controller_->acquire();
+  }
+  ~ScopedConcurrency() {
+    if (controller_) controller_->release(report_ ? report_->time : 0, report_ ? report_->real_time : 0);
+  }
+  ConcurrencyController *controller_;
+  const TestcaseReport *report_;  // set when the testcase finished
+};
+
+static double monotonic_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --max-total-cpu-time, --max-total-real-time. cut the limits down to what is
+// left of the budgets. false if nothing is left
+static bool fit_total_budget(Context& ctx, const Options& opts, Limit& limit, bool& cut) {
+  std::lock_guard<std::mutex> lock(ctx.mutex);
+  cut = false;
+  if (ctx.out_of_time) return false;
+  if (opts.max_total_cpu_time > 0) {
+    double left = opts.max_total_cpu_time - ctx.cpu_time_used;
+    if (left <= 0) {
+      cancel_testcases(ctx, "out of total cpu time");
+      return false;
+    }
+    if (limit.cpu_time <= 0 || left < limit.cpu_time) {
+      limit.cpu_time = left;
+      cut = true;
+    }
+  }
+  if (ctx.deadline > 0) {
+    double left = ctx.deadline - monotonic_now();
+    if (left <= 0) {
+      cancel_testcases(ctx, "out of total real time");
+      return false;
+    }
+    if (limit.real_time <= 0 || left < limit.real_time) {
+      limit.real_time = left;
+      cut = true;
+    }
+  }
+  return true;
+}
+
+// charge the finished testcase. a run killed at a cut limit, or by
+// cancel_testcases, becomes SKIPPED
+static void charge_total_budget(Context& ctx, const Options& opts, TestcaseReport& report, bool cut) {
+  if (opts.max_total_cpu_time <= 0 && opts.max_total_real_time <= 0) return;
+  std::lock_guard<std::mutex> lock(ctx.mutex);
+  double time = report.times.empty() ? report.time : 0;
+  for (size_t k = 0; k < report.times.size(); ++k) time += report.times[k];
+  ctx.cpu_time_used += time;
+  bool timed_out = report.exceed == "CPU_TIME" || report.exceed == "REAL_TIME";
+  // killed by cancel_testcases, its verdict means nothing. testcases which
+  // finished on their own keep theirs
+  if (lrun_cancelled) {
+    report = TestcaseReport();
+    report.result = TestcaseResult::SKIPPED;
+  } else if (cut && timed_out) {
+    report = TestcaseReport();
+    report.result = TestcaseResult::SKIPPED;
+    cancel_testcases(ctx, "out of total time");
+  } else if (opts.max_total_cpu_time > 0 && ctx.cpu_time_used >= opts.max_total_cpu_time) {
+    cancel_testcases(ctx, "out of total cpu time");
+  }
+}
+
+// the output the standard checker or a custom checker reads, if any
+static string get_checked_output_path(const Options& opts, const Testcase& testcase) {
+  return opts.skip_checker || !testcase.output_sha1.empty() ? "" : testcase.output_path;
+}
+
+// read test data of testcases before last into the page cache, once (--prefetch)
+static void prefetch_testcases(Context& ctx, const Options& opts, int last) {
+  if (opts.prefetch <= 0) return;
+  last = std::min(last, (int)opts.cases.size());
+  int first;
+  {
+    std::lock_guard<std::mutex> lock(ctx.mutex);
+    first = ctx.prefetched;
+    if (first >= last) return;
+    ctx.prefetched = last;
+  }
+  for (int i = first; i < last; ++i) {
+    string output_path = get_checked_output_path(opts, opts.cases[i]);
+    prefetch_data_file(opts.cases[i].input_path);
+    if (!output_path.empty()) prefetch_data_file(output_path);
+  }
+}
+
+// run_testcase, within the memory budget, holding a host-wide run slot and maybe a cpu
+static TestcaseReport run_testcase_in_slot(Context& ctx, const Options& opts, int i) {
+  // while this one waits and runs
+  prefetch_testcases(ctx, opts, i + 1 + opts.prefetch);
+  ScopedConcurrency concurrency(get_concurrency_controller(opts));
+  ScopedMemoryCommit commit(get_testcase_memory(opts, opts.cases[i]), i);
+  ScopedSlot slot(fs::join(opts.cache_dir, SUBDIR_SLOTS, "run"), opts.run_slots);
+  if (slot.waited() > 0) {
+    log_debug("testcase %d waited %.3fs for a run slot", i, slot.waited());
+    std::lock_guard<std::mutex> lock(ctx.mutex);
+    ctx.run_slot_wait += slot.waited();
+    ++ctx.run_slot_waits;
+  }
+  // near the memory holding the test data, if it is cached
+  ScopedCpu cpu(fs::join(opts.cache_dir, SUBDIR_SLOTS, "cpu"), opts.pin_cpus, opts.pin_cpus.empty() ? -1 : get_page_cache_node(get_data_file_path(opts.cases[i].input_path)));
+  TestcaseReport report;
+  // checked after waiting, the wait counts against --max-total-real-time
+  Testcase testcase = opts.cases[i];
+  bool cut;
+  if (!fit_total_budget(ctx, opts, testcase.runtime_limit, cut)) {
+    report.result = TestcaseResult::SKIPPED;
+    return report;
+  }
+  ScopedLrunOwner owner(ctx);
+  count_prefetch_hit(testcase.input_path, get_checked_output_path(opts, testcase));
+  if (opts.borderline_fraction > 0 && opts.borderline_reruns > 0 && testcase.runtime_limit.cpu_time > 0) {
+    // reruns run on the same (pinned) cpu
+    report = run_testcase_with_reruns(ctx, opts, testcase, i);
+  } else {
+    report = run_testcase(ctx, opts.etc_dir, opts.cache_dir, opts.user_code_path, opts.checker_code_path, opts.envs, testcase, opts.skip_checker, opts.keep_stdout, opts.keep_stderr);
+  }
+  charge_total_budget(ctx, opts, report, cut);
+  concurrency.report_ = &report;
+  return report;
+}
+
+// hits and misses of compile caches in this process
+static std::atomic<int> compile_cache_hits(0);
+static std::atomic<int> compile_cache_misses(0);
+
+static void count_compile_cache(const CompileResult& result) {
+  if (!result.success || result.skipped) return;
+  if (result.cached) {
+    ++compile_cache_hits;
+  } else {
+    ++compile_cache_misses;
+  }
+}
+
+static void log_slot_stats(Context& ctx, const Options& opts) {
+  ConcurrencyController *controller = get_concurrency_controller(opts);
+  if (controller) log_info("concurrency: %d, jitter: %.1f%%", controller->concurrency(), controller->jitter() * 100);
+  int hits = compile_cache_hits, misses = compile_cache_misses;
+  if (hits + misses > 0) log_info("compile cache: %d hits, %d misses (%.0f%%)", hits, misses, 100.0 * hits / (hits + misses));
+  DataCacheStats data_cache = get_data_cache_stats();
+  if (data_cache.hits + data_cache.misses > 0) {
+    log_info("test data cache: %ld hits, %ld misses (%.0f%%), %ld files, %.1f MB", data_cache.hits, data_cache.misses,
+        100.0 * data_cache.hits / (data_cache.hits + data_cache.misses), data_cache.entries, data_cache.size / 1e6);
+  }
+  PrefetchStats prefetch = get_prefetch_stats();
+  if (prefetch.hits + prefetch.misses > 0) {
+    log_info("test data in page cache: %ld hits, %ld misses (%.0f%%). prefetched %ld files, %.1f MB in %.3fs, %.1f MB locked",
+        prefetch.hits, prefetch.misses, 100.0 * prefetch.hits / (prefetch.hits + prefetch.misses),
+        prefetch.files, prefetch.bytes / 1e6, prefetch.seconds, prefetch.locked_bytes / 1e6);
+  }
+  std::lock_guard<std::mutex> lock(ctx.mutex);
+  if (ctx.run_slot_waits > 0) log_info("%d testcases waited %.3fs in total for run slots", ctx.run_slot_waits, ctx.run_slot_wait);
+}
+
+void run_testcases(Context& ctx, const Options& opts, const std::function<void(int, const TestcaseReport&)>& emit) {
+  log_debug("nthread = %u", opts.nthread);
+#ifdef _OPENMP
+  // omp does not know about cgroup cpu quotas
+  omp_set_num_threads(opts.nthread > 0 ? opts.nthread : get_resources().cpus);
+#endif
+
+  int ncase = (int)opts.cases.size();
+  int nthread = opts.skip_on_first_failure ? 1 : opts.nthread;
+#ifdef _OPENMP
+  if (nthread <= 0) nthread = get_resources().cpus;
+#endif
+  log_effective_parallelism(opts, std::max(1, std::min(nthread, ncase)));
+  if (opts.skip_on_first_failure) {
+    for (int i = 0; i < ncase; ++i) {
+      TestcaseReport report = run_testcase_in_slot(ctx, opts, i);
+      emit(i, report);
+      if (report.result != TestcaseResult::ACCEPTED) {
+        TestcaseReport skipped_report;
+        skipped_report.result = TestcaseResult::SKIPPED;
+        for (int j = i + 1; j < ncase; ++j) emit(j, skipped_report);
+        break;
+      }
+    }
+  } else {
+    vector<TestcaseReport> reports(ncase);
+    vector<bool> done(ncase);
+    int next_emit = 0;
+    // exceptions cannot leave an OpenMP region. remember the first one and
+    // rethrow it later. guarded by emit_mutex, like the emitting it stops
+    string error;
+#ifdef _OPENMP
+    // dynamic schedule so that results are finished (and emitted) roughly in order
+    #pragma omp parallel for schedule(dynamic, 1) if (opts.nthread != 1 && ncase > 1)
+#endif
+    for (int i = 0; i < ncase; ++i) {
+      {
+        // the judgment fails anyway, do not start more testcases
+        std::lock_guard<std::mutex> lock(ctx.emit_mutex);
+        if (!error.empty()) continue;
+      }
+      TestcaseReport report;
+      try {
+        report = run_testcase_in_slot(ctx, opts, i);
+      } catch (const std::exception& ex) {
+        std::lock_guard<std::mutex> lock(ctx.emit_mutex);
+        if (error.empty()) error = ex.what();
+        continue;
+      }
+      {
+        std::lock_guard<std::mutex> lock(ctx.emit_mutex);
+        reports[i] = report;
+        done[i] = true;
+        for (; next_emit < ncase && done[next_emit] && error.empty(); ++next_emit) {
+          emit(next_emit, reports[next_emit]);
+          reports[next_emit] = TestcaseReport();
+        }
+      }
+    }
+    if (!error.empty()) throw JudgeError(error);
+  }
+}
+
+void init_options(Options& options, Testcase& default_case) {
+  string home = getenv("HOME") ? getenv("HOME") : "/tmp";
+  string etc_dir_candidates[] = { "/etc/ljudge", fs::join(home, ".config/ljudge"), fs::join(home, "ljudge/etc/ljudge"), "./etc/ljudge", "../etc/ljudge" };
+  for (size_t i = 0; i < sizeof(etc_dir_candidates) / sizeof(etc_dir_candidates[0]); ++i) {
+    if (fs::is_dir(etc_dir_candidates[i])) {
+      options.etc_dir = etc_dir_candidates[i];
+      break;
+    }
+  }
+  options.cache_dir = fs::join(home, ".cache/ljudge");
+  options.compiler_limit = { 5, 10, 1 << 29 /* 512M mem */, 1 << 27 /* 128M out */ };
+  options.pretty_print = false;
+  options.format = FORMAT_JSON;
+  options.skip_checker = false;
+  options.keep_stdout = false;
+  options.keep_stderr = false;
+  options.direct_mode = false;
+  options.batch_mode = false;
+  options.nthread = 0;
+  options.run_slots = 0;
+  options.compile_slots = 0;
+  options.borderline_fraction = 0;
+  options.borderline_reruns = 0;
+  options.borderline_stat = BORDERLINE_MEDIAN;
+  options.max_jitter = 0;
+  options.max_total_cpu_time = 0;
+  options.max_total_real_time = 0;
+  options.scratch_memory = 0;
+  options.cache_size = 0;
+  options.cache_entries = 0;
+  options.prefetch = 4;
+  options.lock_test_data = 0;
+  options.test_data_cache = 0;
+  options.skip_on_first_failure = false;
+  default_case.checker_limit = { 5, 10, 1 << 30, 1 << 30, 1 << 30 };
+  default_case.runtime_limit = { 1, 3, 1 << 26 /* 64M mem */, 1 << 25 /* 32M output */, 1 << 23 /* 8M stack limit */ };
+}
+
+// the garbage collector does not evict it while the judgment runs
+static void pin_compile_cache(Context& ctx, const string& dest) {
+  int fd;
+  if (!pin_cache_entry(dest, fd)) {
+    log_warn("cannot pin %s, it may be evicted while in use", dest.c_str());
+    return;
+  }
+  std::lock_guard<std::mutex> lock(ctx.mutex);
+  ctx.cache_pins.push_back(fd);
+}
+
+bool precompile(Context& ctx, const Options& opts, CompileResult& compile_result, CompileResult& checker_compile_result) {
+  // compiling counts against --max-total-real-time
+  if (opts.max_total_real_time > 0) ctx.deadline = monotonic_now() + opts.max_total_real_time;
+  ctx.scratch_memory = opts.scratch_memory;
+  // read while compiling
+  prefetch_testcases(ctx, opts, opts.prefetch);
+
+  { // precompile user code
+    string dest = get_code_work_dir(ctx, get_user_code_base_dir(ctx), opts.user_code_path);
+    // shared with other judgments only on workers
+    if (!ctx.code_base_dir.empty()) pin_compile_cache(ctx, dest);
+    compile_result = compile_code(opts.etc_dir, opts.cache_dir, dest, opts.user_code_path, opts.compiler_limit, opts.compile_slots);
+    if (!ctx.code_base_dir.empty()) count_compile_cache(compile_result);
+    if (!compile_result.success) return false;
+  }
+
+  if (!opts.checker_code_path.empty()) { // precompile checker code
+    string dest = get_code_work_dir(ctx, fs::join(opts.cache_dir, SUBDIR_CHECKER), opts.checker_code_path);
+    pin_compile_cache(ctx, dest);
+    checker_compile_result = compile_code(opts.etc_dir, opts.cache_dir, dest, opts.checker_code_path, opts.compiler_limit, opts.compile_slots);
+    count_compile_cache(checker_compile_result);
+    if (!checker_compile_result.success) return false;
+    prepare_checker_mount_bind_files(dest);
+  }
+
+  return true;
+}
+
+bool begin_response(ResponseWriter& writer, const Options& opts, const CompileResult& compile_result, const CompileResult& checker_compile_result, bool compiled) {
+  // keys are in picojson order
+  writer.begin_object(1 /* compilation */ + (!opts.checker_code_path.empty() && compile_result.success) + compiled /* testcases */);
+  if (!opts.checker_code_path.empty() && compile_result.success) {
+    writer.write_key("checkerCompilation");
+    write_compile_result(writer, checker_compile_result);
+  }
+  writer.write_key("compilation");
+  write_compile_result(writer, compile_result);
+  if (compiled) {
+    writer.write_key("testcases");
+    writer.begin_array();
+  }
+  return compiled;
+}
+
+void judge(Context& ctx, const Options& opts, ResponseWriter& writer) {
+  CompileResult compile_result, checker_compile_result;
+  bool compiled = precompile(ctx, opts, compile_result, checker_compile_result);
+
+  // testcase results are written as soon as they are ready
+  string error;
+  if (begin_response(writer, opts, compile_result, checker_compile_result, compiled)) {
+    size_t emitted = 0;
+    try {
+      run_testcases(ctx, opts, [&ctx, &writer, &emitted](int, const TestcaseReport& report) {
+        write_testcase_report(writer, report);
+        writer.flush();
+        ++emitted;
+        // captured outputs are read, free them early
+        release_scratch_file(ctx, report.stdout_path);
+        release_scratch_file(ctx, report.stderr_path);
+        release_scratch_file(ctx, report.checker_output_path);
+      });
+    } catch (const JudgeError& ex) {
+      // a part of the response is out. complete it, the rest are internal errors
+      error = ex.what();
+      TestcaseReport report;
+      report.result = TestcaseResult::INTERNAL_ERROR;
+      report.error = error;
+      for (; emitted < opts.cases.size(); ++emitted) write_testcase_report(writer, report);
+    }
+    writer.end_array();
+    log_slot_stats(ctx, opts);
+  }
+  writer.end_object();
+  writer.flush();
+  if (!error.empty()) throw JudgeError(error);
+}
+
+struct BatchSubmission {
+  long seq;
+  Options opts;
+  string error;  // invalid request, or internal error
+  Context *ctx;
+  CompileResult compile_result;
+  CompileResult checker_compile_result;
+  bool compiled;
+  vector<TestcaseReport> reports;
+  std::atomic<int> remaining;  // testcases not finished
+
+  BatchSubmission() : seq(0), ctx(NULL), compiled(false), remaining(0) {}
+  ~BatchSubmission() { delete ctx; }
+};
+
+struct Batch {
+  std::function<void(long, const string&)> respond;
+  bool ordered;
+  std::mutex mutex;
+  std::condition_variable finished;
+  map<long, string> responses;  // finished but not responded, because earlier ones are running (ordered)
+  long next_respond;
+  int running;
+  int nthread;  // size of the testcase pool
+
+  Batch() : ordered(true), next_respond(0), running(0), nthread(1) {}
+};
+
+static string serialize_batch_response(const BatchSubmission& sub) {
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *fp = open_memstream(&buf, &size);
+  if (!fp) fatal("cannot create response buffer");
+  {
+    JsonWriter json_writer(fp);
+    CborWriter cbor_writer(fp);
+    ResponseWriter& writer = (sub.opts.format == FORMAT_CBOR) ? (ResponseWriter&)cbor_writer : (ResponseWriter&)json_writer;
+    if (!sub.error.empty()) {
+      writer.begin_object(1);
+      writer.write_key("error");
+      writer.write_string(sub.error);
+      writer.end_object();
+    } else {
+      if (begin_response(writer, sub.opts, sub.compile_result, sub.checker_compile_result, sub.compiled)) {
+        for (size_t i = 0; i < sub.reports.size(); ++i) write_testcase_report(writer, sub.reports[i]);
+        writer.end_array();
+      }
+      writer.end_object();
+    }
+  }
+  fclose(fp);
+  string result(buf, size);
+  free(buf);
+  // CBOR items are self-delimiting
+  if (sub.opts.format != FORMAT_CBOR) result += "\n";
+  return result;
+}
+
+static void finish_batch_submission(Batch *batch, BatchSubmission *sub) {
+  log_debug("batch: submission %ld finished", sub->seq);
+  if (sub->ctx) log_slot_stats(*sub->ctx, sub->opts);
+  string response;
+  try {
+    response = serialize_batch_response(*sub);
+  } catch (const std::exception& ex) {
+    sub->error = ex.what();
+    response = serialize_batch_response(*sub);
+  }
+  long seq = sub->seq;
+  delete sub;  // removes temp files
+
+  if (!batch->ordered) batch->respond(seq, response);
+
+  std::lock_guard<std::mutex> lock(batch->mutex);
+  if (batch->ordered) {
+    batch->responses[seq] = response;
+    while (batch->responses.count(batch->next_respond)) {
+      batch->respond(batch->next_respond, batch->responses[batch->next_respond]);
+      batch->responses.erase(batch->next_respond++);
+    }
+  }
+  --batch->running;
+  batch->finished.notify_one();
+}
+
+static void run_batch_submission(Batch *batch, BatchSubmission *sub) {
+  const Options& opts = sub->opts;
+  if (sub->error.empty()) {
+    try {
+      sub->ctx = new Context(opts.cache_dir);
+      sub->compiled = precompile(*sub->ctx, opts, sub->compile_result, sub->checker_compile_result);
+      if (sub->compiled && opts.skip_on_first_failure) {
+        // sequential by nature, do not spread it over the pool
+        sub->reports.resize(opts.cases.size());
+        run_testcases(*sub->ctx, opts, [sub](int i, const TestcaseReport& report) {
+          sub->reports[i] = report;
+        });
+      }
+    } catch (const std::exception& ex) {
+      sub->error = ex.what();
+    }
+  }
+
+  int ncase = (int)opts.cases.size();
+  if (!sub->error.empty() || !sub->compiled || opts.skip_on_first_failure || ncase == 0) {
+    finish_batch_submission(batch, sub);
+    return;
+  }
+
+  // every testcase is a task in the shared pool. the last one finishing writes the response
+  log_effective_parallelism(opts, std::min(batch->nthread, ncase));
+  sub->reports.resize(ncase);
+  sub->remaining = ncase;
+  for (int i = 0; i < ncase; ++i) {
+#ifdef _OPENMP
+    #pragma omp task firstprivate(batch, sub, i)
+#endif
+    {
+      // not using opts from outside, a reference would be copied into the task
+      const Options& o = sub->opts;
+      try {
+        sub->reports[i] = run_testcase_in_slot(*sub->ctx, o, i);
+      } catch (const std::exception& ex) {
+        std::lock_guard<std::mutex> lock(sub->ctx->mutex);
+        if (sub->error.empty()) sub->error = ex.what();
+      }
+      if (--sub->remaining == 0) finish_batch_submission(batch, sub);
+    }
+  }
+}
+
+void judge_batch(int nthread, bool ordered, const std::function<bool(long, Options&, string&)>& next_request, const std::function<void(long, const string&)>& respond) {
+  Batch batch;
+  batch.respond = respond;
+  batch.ordered = ordered;
+#ifdef _OPENMP
+  if (nthread <= 0) nthread = get_resources().cpus;
+#endif
+  if (nthread <= 0) nthread = 1;
+  batch.nthread = nthread;
+  // keep the pool busy while a submission is compiling, without reading all requests into memory
+  int max_running = nthread * 2;
+  log_debug("batch: nthread = %d", nthread);
+
+  // one more thread reads requests, it blocks on input
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(nthread + 1)
+  #pragma omp single
+#endif
+  {
+    for (long seq = 0; ; ++seq) {
+      BatchSubmission *sub = new BatchSubmission();
+      sub->seq = seq;
+      if (!next_request(seq, sub->opts, sub->error)) {
+        delete sub;
+        break;
+      }
+      {
+        std::unique_lock<std::mutex> lock(batch.mutex);
+        bool alone = true;
+#ifdef _OPENMP
+        alone = (omp_get_num_threads() == 1);
+#endif
+        if (alone) {
+          // nobody else runs the tasks
+          lock.unlock();
+#ifdef _OPENMP
+          #pragma omp taskwait
+#endif
+          lock.lock();
+        } else {
+          batch.finished.wait(lock, [&batch, max_running]() { return batch.running < max_running; });
+        }
+        ++batch.running;
+      }
+      Batch *pbatch = &batch;
+#ifdef _OPENMP
+      #pragma omp task firstprivate(pbatch, sub)
+#endif
+      run_batch_submission(pbatch, sub);
+    }
+  }
+}
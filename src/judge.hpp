@@ -0,0 +1,225 @@
+#pragma once
+
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include "response.hpp"
+
+#define LJUDGE_VERSION "v0.6.1"
+
+// lrun-mirrorfs chroot path (lrun-mirrorfs --show-root)
+#define CHROOT_BASE_DIR "/run/lrun/mirrorfs"
+
+// sub-directory names in cache_dir
+#define SUBDIR_USER_CODE "code"
+#define SUBDIR_CHECKER "checker"
+#define SUBDIR_TEMP "tmp"
+#define SUBDIR_KERNEL_CONFIG_CACHE "kconfig"
+
+// envs (config file name prefixes)
+#define ENV_CHECK "check"
+#define ENV_COMPILE "compile"
+#define ENV_EXTRA "extra"
+#define ENV_RUN "run"
+#define ENV_VERSION "version"
+
+// config file extensions
+#define EXT_CMD_LIST ".cmd_list"
+#define EXT_EXE_NAME ".exe_name"
+#define EXT_MIRRRORFS ".mirrorfs"
+#define EXT_LRUN_ARGS ".lrun_args"
+#define EXT_NAME ".name"
+#define EXT_OPT_FAKE_PASSWD "fake_passwd"
+#define EXT_FS_OVERRIDE ".fs_override"
+#define EXT_SRC_NAME ".src_name"
+
+// config file names which are options
+#define OPTION_VALUE_TRUE "true"
+#define OPTION_VALUE_FALSE "false"
+
+// default values
+#define DEFAULT_EXE_NAME "a.out"
+#define DEFAULT_CONF_DIR "_default"
+
+// --borderline-rerun
+#define BORDERLINE_MIN "min"
+#define BORDERLINE_MEDIAN "median"
+
+// response formats
+#define FORMAT_JSON "json"
+#define FORMAT_CBOR "cbor"
+
+#define DEV_NULL "/dev/null"
+#define ETC_PASSWD "/etc/passwd"
+#define PROC_CGROUP "/proc/cgroups"
+
+using std::list;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace TestcaseResult {
+  /* [[[cog
+    import cog
+    for name in ['INTERNAL_ERROR', 'NON_ZERO_EXIT_CODE', 'MEMORY_LIMIT_EXCEEDED', 'TIME_LIMIT_EXCEEDED', 'OUTPUT_LIMIT_EXCEEDED', 'PRESENTATION_ERROR', 'ACCEPTED', 'RUNTIME_ERROR', 'FLOAT_POINT_EXCEPTION', 'SEGMENTATION_FAULT', 'WRONG_ANSWER', 'SKIPPED']:
+      cog.outl('const string %(name)s = "%(name)s";' % {'name': name})
+  ]]] */
+  const string INTERNAL_ERROR = "INTERNAL_ERROR";
+  const string NON_ZERO_EXIT_CODE = "NON_ZERO_EXIT_CODE";
+  const string MEMORY_LIMIT_EXCEEDED = "MEMORY_LIMIT_EXCEEDED";
+  const string TIME_LIMIT_EXCEEDED = "TIME_LIMIT_EXCEEDED";
+  const string OUTPUT_LIMIT_EXCEEDED = "OUTPUT_LIMIT_EXCEEDED";
+  const string PRESENTATION_ERROR = "PRESENTATION_ERROR";
+  const string ACCEPTED = "ACCEPTED";
+  const string RUNTIME_ERROR = "RUNTIME_ERROR";
+  const string FLOAT_POINT_EXCEPTION = "FLOAT_POINT_EXCEPTION";
+  const string SEGMENTATION_FAULT = "SEGMENTATION_FAULT";
+  const string WRONG_ANSWER = "WRONG_ANSWER";
+  const string SKIPPED = "SKIPPED";
+  /* [[[end]]] */
+};
+
+struct Limit {
+  double cpu_time;   // seconds
+  double real_time;  // seconds
+  long long memory;  // bytes
+  long long output;  // bytes
+  long long stack;   // bytes
+};
+
+struct Testcase {
+  string input_path;
+  string output_path;
+  string output_sha1;
+  string output_pe_sha1;
+  string user_stdout_path;
+  string user_stderr_path;
+  Limit runtime_limit;
+  Limit checker_limit;
+};
+
+struct Options {
+  string etc_dir;
+  string cache_dir;
+  string user_code_path;
+  string checker_code_path;
+  Limit compiler_limit;
+  vector<Testcase> cases;
+  map<string, string> envs;
+  bool pretty_print;
+  string format;  // response format, FORMAT_JSON or FORMAT_CBOR
+  bool skip_checker;  // if true, do not run can checker, but capture user program's output
+  bool keep_stdout;
+  bool keep_stderr;
+  bool direct_mode;  // if true, just run the program and prints the result
+  bool batch_mode;  // if true, read requests from stdin, one per line
+  string spool_dir;  // if not empty, judge requests dropped into this directory
+  string worker_address;  // if not empty, serve coordinators on [host:]port
+  vector<string> nodes;  // if not empty, split testcases across these workers (host:port)
+  string affinity;  // nodes are chosen by this key, checker and test data if empty
+  int nthread;  // how many testcases can run in parallel. default is get_resources().cpus (cpu cores within cgroup limits)
+  int run_slots;  // how many testcases can run at once on the host, by all processes sharing cache_dir. 0: no limit
+  int compile_slots;  // like run_slots, for compilers. also limited by available memory / compiler memory limit
+  double borderline_fraction;  // rerun testcases this close to the cpu time limit. 0: never
+  int borderline_reruns;  // how many times
+  string borderline_stat;  // BORDERLINE_MIN or BORDERLINE_MEDIAN of the times decides the verdict
+  double max_jitter;  // lower concurrency to keep timing jitter under this fraction. 0: fixed nthread
+  string pin_cpus;  // PIN_CPUS_CORES or PIN_CPUS_THREADS to pin testcases to cpus. empty: no pinning
+  double max_total_cpu_time;  // seconds of cpu time all testcases of a submission may use. 0: no limit
+  double max_total_real_time;  // seconds from the start of a judgment until the rest of testcases are skipped. 0: no limit
+  long long scratch_memory;  // captured outputs are kept in memory (memfd) while their output limits add up to this in the process. 0: always on disk
+  long long cache_size;  // bytes compiled checkers (and user code of workers) may use. 0: no limit
+  int cache_entries;  // how many of them are kept. 0: no limit
+  int prefetch;  // testcases whose test data is read into the page cache ahead. 0: off
+  long long lock_test_data;  // bytes of prefetched test data which may be locked in memory, see set_lock_budget
+  long long test_data_cache;  // bytes of test data contents kept by the process, see DataFile
+  bool skip_on_first_failure;  // skip test cases after first failure occured
+};
+
+// Thrown instead of exiting the process. The judgment is aborted, the
+// message is meant for the caller (not end-users).
+struct JudgeError : public std::runtime_error {
+  JudgeError(const string& message) : std::runtime_error(message) {}
+};
+
+// a captured output kept in memory, see get_scratch_file_path
+struct ScratchFile {
+  int fd;
+  long long limit;  // reserved from the scratch memory of the process
+};
+
+// State of one judgment. Nothing is shared between judgments except files
+// in cache_dir, so several judgments can run in one process at once.
+struct Context {
+  string cache_dir;
+  string tmp_dir;  // cache_dir/tmp/<pid>.<random>, created on demand
+  string code_base_dir;  // where user code is compiled, tmp_dir if empty. not removed
+  list<string> cleanup_paths;
+  map<string, string> code_work_dirs;  // cache of get_code_work_dir
+  unsigned int seed;  // for rand_r
+  std::mutex mutex;
+  std::mutex emit_mutex;  // testcase results are emitted one at a time, in order
+  double run_slot_wait;  // seconds testcases spent waiting for run slots
+  int run_slot_waits;  // testcases which had to wait
+  // --max-total-cpu-time, --max-total-real-time
+  double cpu_time_used;  // by finished testcases
+  double deadline;  // CLOCK_MONOTONIC seconds, 0 if none
+  bool out_of_time;  // running testcases are killed, the rest are skipped
+  std::set<pid_t> lrun_pids;  // lrun processes of running testcases
+  std::set<pid_t> cancelled_pids;  // those of them killed by running out of time
+  long long scratch_memory;  // --scratch-memory
+  map<string, ScratchFile> scratch_fds;  // memfds of get_scratch_file_path paths
+  vector<int> cache_pins;  // see pin_cache_entry
+  int prefetched;  // test data of testcases before this is prefetched
+
+  Context(const string& cache_dir);
+  ~Context();  // moves cleanup_paths to the trash (see gc.hpp), closes scratch_fds and cache_pins
+
+  private:
+    Context(const Context&);
+    Context& operator=(const Context&);
+};
+
+// fill default options. default_case is the template of --testcase
+void init_options(Options& options, Testcase& default_case);
+// replace references to stored test data and code (see blob.hpp) with local paths
+void resolve_data_refs(Options& options, vector<string>& errors);
+// collect human readable errors of invalid options
+void validate_options(const Options& options, vector<string>& errors);
+
+bool is_language_supported(const string& etc_dir, const string& code_path);
+list<string> get_config_list(const string& etc_dir, const string& code_path, const string& name, bool strict = false);
+string get_config_content(const string& etc_dir, const string& code_path, const string& name, const string& fallback = "", bool strict = false);
+
+// create an empty file in the tmp dir of the judgment
+string get_temp_file_path(Context& ctx, const string& prefix = "", int len = 10);
+// a file for captured output of at most limit bytes. it is a memfd, opened
+// as /proc/<pid>/fd/<n>, if limits of all memfds of the process (of all
+// judgments) stay within ctx.scratch_memory with it. otherwise (or if there
+// are no fds left) it is a file in the tmp dir
+string get_scratch_file_path(Context& ctx, const string& prefix, long long limit);
+// free a file from get_scratch_file_path. other paths are left alone
+void release_scratch_file(Context& ctx, const string& path);
+
+// compile user code and checker code. return true if both are compiled
+bool precompile(Context& ctx, const Options& opts, CompileResult& compile_result, CompileResult& checker_compile_result);
+// emit is called in testcase index order, as soon as a prefix of testcases is done
+void run_testcases(Context& ctx, const Options& opts, const std::function<void(int, const TestcaseReport&)>& emit);
+// write the response up to the "testcases" array. return true if the array is opened
+bool begin_response(ResponseWriter& writer, const Options& opts, const CompileResult& compile_result, const CompileResult& checker_compile_result, bool compiled);
+// precompile, run testcases and write the response. if a testcase throws,
+// the response is still completed (testcases not written yet get the error
+// as INTERNAL_ERROR), then the error is rethrown
+void judge(Context& ctx, const Options& opts, ResponseWriter& writer);
+// judge requests from next_request until it returns false. it sets error for
+// an invalid request. testcases of all submissions share one pool of nthread
+// workers. respond is called with serialized responses and the sequence
+// numbers given to next_request, in request order if ordered
+void judge_batch(int nthread, bool ordered, const std::function<bool(long, Options&, string&)>& next_request, const std::function<void(long, const string&)>& respond);
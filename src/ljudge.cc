@@ -9,16 +9,12 @@
 #include <cstring>
 #include <cctype>
 #include <dlfcn.h>
-#include <fcntl.h>
 #include <list>
 #include <map>
-#include <mutex>
 #include <string>
 #include <sys/prctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/utsname.h>
-#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <vector>
@@ -28,673 +24,35 @@
 #warning OpenMP support is not detected. Threading will not work
 #endif
 
-#include "sha1.hpp"
+#include "cluster.hpp"
+#include "archive.hpp"
+#include "blob.hpp"
 #include "fs.hpp"
+#include "gc.hpp"
+#include "judge.hpp"
+#include "prefetch.hpp"
+#include "request.hpp"
+#include "response.hpp"
+#include "spool.hpp"
 #include "term.hpp"
+#include "utils.hpp"
 #include "deps/picojson/picojson.h"
 #include "deps/tinyformat/tinyformat.h"
 
 extern "C" {
 #include "deps/log.h/log.h"
-int debug_level;
 }
 
-using std::list;
-using std::map;
-using std::string;
-using std::vector;
 using tfm::format;
 namespace j = picojson;
 
-#define fatal(...) { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); cleanup_exit(1); }
-
-#define LJUDGE_VERSION "v0.6.1"
-
-// lrun-mirrorfs chroot path (lrun-mirrorfs --show-root)
-#define CHROOT_BASE_DIR "/run/lrun/mirrorfs"
-
-// truncate log size, ex. compiler log, stdout, stderr, etc.
-#define TRUNC_LOG 65535
-
-// sub-directory names in cache_dir
-#define SUBDIR_USER_CODE "code"
-#define SUBDIR_CHECKER "checker"
-#define SUBDIR_TEMP "tmp"
-#define SUBDIR_KERNEL_CONFIG_CACHE "kconfig"
-
-// envs (config file name prefixes)
-#define ENV_CHECK "check"
-#define ENV_COMPILE "compile"
-#define ENV_EXTRA "extra"
-#define ENV_RUN "run"
-#define ENV_VERSION "version"
-
-// config file extensions
-#define EXT_CMD_LIST ".cmd_list"
-#define EXT_EXE_NAME ".exe_name"
-#define EXT_MIRRRORFS ".mirrorfs"
-#define EXT_LRUN_ARGS ".lrun_args"
-#define EXT_NAME ".name"
-#define EXT_OPT_FAKE_PASSWD "fake_passwd"
-#define EXT_FS_OVERRIDE ".fs_override"
-#define EXT_SRC_NAME ".src_name"
-
-// config file names which are options
-#define OPTION_VALUE_TRUE "true"
-#define OPTION_VALUE_FALSE "false"
-
-// default values
-#define DEFAULT_EXE_NAME "a.out"
-#define DEFAULT_CONF_DIR "_default"
-
-#define DEV_NULL "/dev/null"
-#define ETC_PASSWD "/etc/passwd"
-#define PROC_CGROUP "/proc/cgroups"
-
-namespace TestcaseResult {
-  /* [[[cog
-    import cog
-    for name in ['INTERNAL_ERROR', 'NON_ZERO_EXIT_CODE', 'MEMORY_LIMIT_EXCEEDED', 'TIME_LIMIT_EXCEEDED', 'OUTPUT_LIMIT_EXCEEDED', 'PRESENTATION_ERROR', 'ACCEPTED', 'RUNTIME_ERROR', 'FLOAT_POINT_EXCEPTION', 'SEGMENTATION_FAULT', 'WRONG_ANSWER', 'SKIPPED']:
-      cog.outl('const string %(name)s = "%(name)s";' % {'name': name})
-  ]]] */
-  const string INTERNAL_ERROR = "INTERNAL_ERROR";
-  const string NON_ZERO_EXIT_CODE = "NON_ZERO_EXIT_CODE";
-  const string MEMORY_LIMIT_EXCEEDED = "MEMORY_LIMIT_EXCEEDED";
-  const string TIME_LIMIT_EXCEEDED = "TIME_LIMIT_EXCEEDED";
-  const string OUTPUT_LIMIT_EXCEEDED = "OUTPUT_LIMIT_EXCEEDED";
-  const string PRESENTATION_ERROR = "PRESENTATION_ERROR";
-  const string ACCEPTED = "ACCEPTED";
-  const string RUNTIME_ERROR = "RUNTIME_ERROR";
-  const string FLOAT_POINT_EXCEPTION = "FLOAT_POINT_EXCEPTION";
-  const string SEGMENTATION_FAULT = "SEGMENTATION_FAULT";
-  const string WRONG_ANSWER = "WRONG_ANSWER";
-  const string SKIPPED = "SKIPPED";
-  /* [[[end]]] */
-};
-
-struct Limit {
-  double cpu_time;   // seconds
-  double real_time;  // seconds
-  long long memory;  // bytes
-  long long output;  // bytes
-  long long stack;   // bytes
-};
-
-struct Testcase {
-  string input_path;
-  string output_path;
-  string output_sha1;
-  string output_pe_sha1;
-  string user_stdout_path;
-  string user_stderr_path;
-  Limit runtime_limit;
-  Limit checker_limit;
-};
-
-struct Options {
-  string etc_dir;
-  string cache_dir;
-  string user_code_path;
-  string checker_code_path;
-  Limit compiler_limit;
-  vector<Testcase> cases;
-  map<string, string> envs;
-  bool pretty_print;
-  bool skip_checker;  // if true, do not run can checker, but capture user program's output
-  bool keep_stdout;
-  bool keep_stderr;
-  bool direct_mode;  // if true, just run the program and prints the result
-  int nthread;  // how many testcases can run in parallel. default is decided by omp (cpu cores
-  bool skip_on_first_failure;  // skip test cases after first failure occured
-};
-
-struct LrunArgs : public vector<string> {
-  void append(const Limit& limit) {
-    /* [[[cog
-      import cog
-      opts = {'cpu_time': 'g', 'real_time': 'g', 'output': 'Ld', 'memory': 'Ld'}
-      for opt, flag in opts.items():
-        cog.out(
-          '''
-          if (%(opt)s > 0) {
-            push_back("--max-%(opt_m)s");
-            push_back(format("%%%(flag)s", %(opt)s));
-          }
-          ''' % {'opt': 'limit.' + opt,
-                 'opt_m': opt.replace('_', '-'),
-                 'flag': flag}, trimblanklines=True)
-    ]]] */
-    if (limit.real_time > 0) {
-      push_back("--max-real-time");
-      push_back(format("%g", limit.real_time));
-    }
-    if (limit.cpu_time > 0) {
-      push_back("--max-cpu-time");
-      push_back(format("%g", limit.cpu_time));
-    }
-    if (limit.memory > 0) {
-      push_back("--max-memory");
-      push_back(format("%Ld", limit.memory));
-    }
-    if (limit.output > 0) {
-      push_back("--max-output");
-      push_back(format("%Ld", limit.output));
-    }
-    if (limit.stack > 0) {
-      push_back("--max-stack");
-      push_back(format("%Ld", limit.stack));
-    }
-    /* [[[end]]] */
-  }
-
-  void append(const string& arg1) {
-    push_back(arg1);
-  }
-
-  void append(const string& arg1, const string& arg2) {
-    push_back(arg1);
-    push_back(arg2);
-  }
-
-  void append(const string& arg1, const string& arg2, const string& arg3) {
-    push_back(arg1);
-    push_back(arg2);
-    push_back(arg3);
-  }
-
-  void append(const vector<string>& args) {
-    insert(end(), args.begin(), args.end());
-  }
-
-  void append(const list<string>& args) {
-    insert(end(), args.begin(), args.end());
-  }
-
-  void append_default() {
-#ifndef NDEBUG
-    if (getenv("LJUDGE_DEBUG_LRUN")) push_back("--debug");
-#endif
-    append("--reset-env", "true");
-    append("--basic-devices", "true");
-    append("--remount-dev", "true");
-    if (maybe_create_lrun_empty_netns()) {
-      append("--netns", "lrun-empty");
-    } else {
-      append("--network", "false");
-    }
-    append("--chdir", "/tmp");
-    append("--env", "ONLINE_JUDGE", "1");
-    append("--env", "LANG", "en_US.UTF-8");
-    append("--env", "LC_ALL", "en_US.UTF-8");
-    append("--env", "HOME", "/tmp");
-    append("--env", "PATH", "/usr/bin:/bin:/etc/alternatives:/usr/local/bin");
-    // Pass as-is
-    static const char pass_envs[][16] = {"JAVA_HOME", "R_HOME"};
-    for (size_t i = 0; i < sizeof(pass_envs) / sizeof(pass_envs[0]); ++i) {
-      const char *env_val = getenv(pass_envs[i]);
-      if (env_val) append("--env", pass_envs[i], env_val);
-    }
-  }
-
-protected:
-
-  bool has_lrun_empty_netns() {
-    // Return true if lrun-empty netns exists
-    return fs::exists("/var/run/netns/lrun-empty");
-  }
-
-  bool maybe_create_lrun_empty_netns() {
-    // Return true if lrun-empty netns can be used
-    if (has_lrun_empty_netns()) return true;
-    if (!fs::exists("/dev/shm/ljudge-netns-attempted")) {
-      log_debug("running 'lrun-netns-empty create' to create empty netns");
-      system("lrun-netns-empty create 1>" DEV_NULL " 2>" DEV_NULL);
-      fs::touch("/dev/shm/ljudge-netns-attempted");
-      return has_lrun_empty_netns();
-    } else {
-      log_debug("lrun-empty netns does not exist");
-      return false;
-    }
-  }
-};
-
-struct LrunResult {
-  string error;
-  long long memory;
-  double cpu_time;
-  double real_time;
-  bool signaled;
-  int exit_code;
-  int term_sig;
-  string exceed;
-};
-
-struct CompileResult {
-  string log;
-  string error;
-  bool success;
-};
-
-#ifdef _OPENMP
-static std::map<string, omp_lock_t> omp_locks;
-static omp_lock_t omp_locks_lock = omp_lock_t();
-
-struct InitOmpLocksLock {
-  InitOmpLocksLock() {
-    omp_init_lock(&omp_locks_lock);
-  }
-} init_omp_locks_lock;
-
-struct ScopedOMPLock {
-  ScopedOMPLock(const string& name) {
-    omp_set_lock(&omp_locks_lock);
-    if (!omp_locks.count(name)) {
-      omp_locks[name] = omp_lock_t();
-      omp_init_lock(&omp_locks[name]);
-    }
-    plock_ = &omp_locks[name];
-    omp_unset_lock(&omp_locks_lock);
-    omp_set_lock(plock_);
-  }
-  ~ScopedOMPLock() {
-    omp_unset_lock(plock_);
-  }
-  omp_lock_t *plock_;
-};
-#endif
-
-string string_chomp(const string& str) {
-  if (str.empty() || str[str.length() - 1] != '\n') return str;
-  return str.substr(0, str.length() - 1);
-}
-
-vector<string> string_split(const string& str, const string& delim) {
-  vector<string> result;
-  if (delim.empty()) {
-    result.push_back(str);
-  } else {
-    size_t pos = 0, start = 0;
-    for (int running = 1; running;) {
-      pos = str.find(delim, start);
-      size_t len;
-      if (pos == string::npos) {
-        len = string::npos;
-        running = 0;
-      } else {
-        len = pos - start;
-      }
-      result.push_back(str.substr(start, len));
-      start = pos + delim.length();
-    }
-  }
-  return result;
-}
-
-void string_replacei(string& str, const string& from, const string& to) {
-  size_t pos = 0;
-  while ((pos = str.find(from, pos)) != string::npos) {
-    str.replace(pos, from.length(), to);
-    pos += to.length();
-  }
-}
-
-string which(const string& name, int access = R_OK | X_OK) {
-  string result;
-  char * path_env = getenv("PATH");
-  if (path_env) {
-    vector<string> dirs = string_split(path_env, ":");
-    for (int i = 0; i < (int)dirs.size(); ++i) {
-       string path = fs::join(dirs[i], name);
-       if (fs::is_accessible(path, access)) {
-         result = path;
-         break;
-       }
-    }
-  }
-  return result;
-}
-
-
-static list<string> cleanup_paths;
-
-void register_cleanup_path(const string& path) {
-  if (path.empty()) return;
-  cleanup_paths.push_back(path);
-}
-
-int cleanup_exit(int code) {
-#ifndef NDEBUG
-  if (!getenv("DEBUG") && !getenv("NOCLEANUP")) {
-#endif
-    for (__typeof(cleanup_paths.begin()) it = cleanup_paths.begin(); it != cleanup_paths.end(); ++it) {
-      string path = *it;
-      if (!fs::exists(path)) continue;
-      log_debug("cleaning: rm -rf %s", path.c_str());
-      fs::rm_rf(path);
-    }
-#ifndef NDEBUG
-  } else {
-    log_debug("skip cleaning up");
-  }
-#endif
-  exit(code);
-}
-
-void enforce_mkdir_p(const string& dir) {
-  if (fs::mkdir_p(dir) < 0) fatal("cannot mkdir: %s", dir.c_str());
-}
+#define fatal(...) { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
 
 void load_libsegfault() {
   void *libSegFault = dlopen("libSegFault.so", RTLD_NOW);
   (void)libSegFault;
 }
 
-
-/**
- * Example:
- *   get_config_path("/etc/ljudge", "/path.to/bla.clang.cc", "foo")
- *
- *   returns "/etc/ljudge/clang.cc/foo"  # if it exists
- *   returns "/etc/ljudge/cc/foo"        # if it exists and the above one doesn't exist
- *   returns "/etc/ljudge/_default/foo"  # if it exists and the above two don't exist, and strit is false
- *   returns ""                          # if the above three don't exist
- */
-static string get_config_path(const string& etc_dir, const string& code_path, const string& config_name, bool strict = false) {
-  string basename = fs::basename(code_path);
-  log_debug("get_config_path: %s %s", config_name.c_str(), basename.c_str());
-
-  for (size_t pos = 0; (pos = basename.find('.', pos)) != string::npos; ) {
-    string ext = basename.substr(++pos);
-    string path = fs::join(etc_dir, ext, config_name);
-    if (fs::exists(path)) return path;
-  }
-  if (!strict) {
-    string path = fs::join(etc_dir, DEFAULT_CONF_DIR, config_name);
-    if (fs::exists(path)) return path;
-  }
-
-  return "";
-}
-
-/**
- * Example:
- *   cat /etc/ljudge/cc/cmd.compile
- *   # comment line
- *   g++
- *   -Wall
- *   $src
- *   -o
- *   $dest
- *
- *   get_config_list("/etc/ljudge", "/path.to/foo.cc", "cmd.compile")
- *   returns {"g++", "-Wall", "$src", "-o", "$dest"}
- *
- *   get_config_list("/etc/ljudge", "/path.to/foo.cc", "notfound")
- *   returns {}
- */
-static list<string> get_config_list(const string& etc_dir, const string& code_path, const string& name, bool strict = false) {
-  string path = get_config_path(etc_dir, code_path, name, strict);
-  log_debug("get_config_list: %s", path.c_str());
-  list<string> result;
-
-  char *line = NULL;
-  size_t line_size = 0;
-
-  if (!path.empty()) {
-    FILE *fp = fopen(path.c_str(), "r");
-    if (!fp) fatal("can not open %s for reading", path.c_str());
-    for (ssize_t line_len = 0; line_len != -1; line_len = getline(&line, &line_size, fp)) {
-      if (!line || line_len <= 1 || line[0] == '#') continue;
-      if (line[line_len - 1] == '\n') line[line_len - 1] = 0;  // chomp
-      // ltrim
-      const char *p = line;
-      while (*p == ' ') ++p;
-      result.push_back(p);
-    }
-    fclose(fp);
-  }
-  if (line) free(line);
-  return result;
-}
-
-static string get_config_content(const string& etc_dir, const string& code_path, const string& name, const string& fallback = "", bool strict = false) {
-  string result;
-  string config_path = get_config_path(etc_dir, code_path, name, strict);
-  log_debug("get_config_content: %s %s", name.c_str(), config_path.c_str());
-  if (!config_path.empty()) {
-    result = string_chomp(fs::read(config_path));
-  }
-  if (result.empty()) result = fallback;
-  return result;
-}
-
-static string get_src_name(const string& etc_dir, const string& code_path) {
-  string fallback = "a" + fs::extname(code_path);
-  return get_config_content(etc_dir, code_path, ENV_COMPILE EXT_SRC_NAME, fallback);
-}
-
-static string prepare_dummy_passwd(const string& cache_dir) {
-#ifdef _OPENMP
-  ScopedOMPLock("dummy_passwd_lock");
-#endif
-  string path = fs::join(cache_dir, format("tmp/etc/passwd-%d", (int)getuid()));
-  string content = format("nobody:%d:%d::/tmp:/bin/false\n", (int)getuid(), (int)getgid());
-  if (!fs::exists(path) || fs::read(path) != content) {
-    enforce_mkdir_p(fs::dirname(path));
-    fs::touch(path);
-    fs::ScopedFileLock lock(path);
-    fs::write(path, content.c_str());
-  }
-  return path;
-}
-
-static list<string> get_override_lrun_args(const string& etc_dir, const string& cache_dir, const string& code_path, const string& env, const string& chroot_path, const string& interpreter_name = "") {
-  list<string> result;
-  // Hide real /etc/passwd (required by Python) on demand
-  if (fs::exists(fs::join(chroot_path, ETC_PASSWD)) && get_config_content(etc_dir, code_path, format("%s%s", env, EXT_OPT_FAKE_PASSWD), OPTION_VALUE_TRUE) == OPTION_VALUE_TRUE) {
-    string passwd_path = prepare_dummy_passwd(cache_dir);
-    result.push_back("--bindfs-ro");
-    result.push_back(fs::join(chroot_path, ETC_PASSWD));
-    result.push_back(passwd_path);
-  }
-
-  // override_dir in config
-  string override_dir = get_config_path(etc_dir, code_path, format("%s%s", env, EXT_FS_OVERRIDE));
-  if (override_dir.empty()) return result;
-
-  list<string> files = fs::scandir(override_dir);
-  for (__typeof(files.begin()) it = files.begin(); it != files.end(); ++it) {
-    // treat "__" as "/"
-    string name = *it;
-    string path = name;
-    string_replacei(path, "__", "/");
-    if (fs::is_accessible(fs::join(chroot_path, path), R_OK)) {
-      result.push_back("--bindfs-ro");
-      result.push_back(fs::join(chroot_path, path));
-      result.push_back(fs::join(override_dir, name));
-    }
-  }
-  return result;
-}
-
-static string uname_r() {
-  struct utsname buf;
-  uname(&buf);
-  return buf.release;
-}
-
-static bool is_fopen_filter_supported(const string& cache_dir) {
-  // annoying, but we have to do this check...
-  // otherwise we won't work on a Debian stock kernel if --fopen-filter is used in lrun args.
-  bool result = true;  // most distros enable it, Arch, Ubuntu, Fedora ... except for Debian
-  string release = uname_r();
-  // read result from cache first. If our detection is incorrect, the user is able to
-  // write the cache file to override it.
-  string cached_result_path = fs::join(cache_dir, SUBDIR_KERNEL_CONFIG_CACHE, "CONFIG_FANOTIFY_ACCESS_PERMISSIONS");
-  if (fs::is_accessible(cached_result_path)) {
-    result = ((fs::read(cached_result_path) + " ")[0] == 'y');
-  } else {
-    string kconfig_path = "/boot/config-" + release;  // only consider debian
-    if (fs::is_accessible(kconfig_path)) {
-      string kconfig_content = fs::read(kconfig_path);
-      if (kconfig_content.find("CONFIG_FANOTIFY_ACCESS_PERMISSIONS=y") == string::npos) {
-        result = false;
-      }
-    }
-    enforce_mkdir_p(fs::dirname(cached_result_path));
-    fs::write(cached_result_path, result ? "y" : "n");
-  }
-  return result;
-}
-
-// try to keep only lrun "safe" args
-template<typename L>
-static L filter_user_lrun_args(const L& items, const string& cache_dir) {
-  L result;
-  int next_safe = 0, next_ignored = 0;
-  for (__typeof(items.begin()) it = items.begin(); it != items.end(); ++it) {
-    string item = string(*it);
-    if (next_safe > 0) {
-      if (next_ignored == 0) {
-        result.push_back(item);
-      } else {
-        --next_ignored;
-      }
-      --next_safe;
-      continue;
-    }
-    if (item == "--syscalls" || item == "--domainname" || item == "--hostname" || item == "--ostype" \
-        || item == "--osrelease" || item == "--osversion") {
-      next_safe = 1;
-    } else if (item == "--fopen-filter" || item == "--tmpfs" || item == "--env") {
-      // tmpfs maybe unsafe, we only use it in R lang.
-      next_safe = 2;
-      if (!is_fopen_filter_supported(cache_dir)) {
-        next_ignored = next_safe;
-        static bool warned = false;
-        if (!warned) {
-          errno = 0;
-          log_warn("You system does not support --fopen-filter. The kernel must be compiled with %s", "CONFIG_FANOTIFY_ACCESS_PERMISSIONS");
-          continue;
-        }
-      }
-    } else {
-      log_info("lrun arg '%s' is unsafe, dropping it and following args", item.c_str());
-      break;
-    }
-    result.push_back(item);
-  }
-  return result;
-}
-
-template<typename L>
-static L escape_list(const L& items, const map<string, string>& mappings) {
-  L result;
-  for (__typeof(items.begin()) it = items.begin(); it != items.end(); ++it) {
-    string item = string(*it);
-    for (__typeof(mappings.begin()) it = mappings.begin(); it != mappings.end(); ++it) {
-      const string& k = it->first;
-      const string& v = it->second;
-      string_replacei(item, k, v);
-    }
-    result.push_back(item);
-  }
-  return result;
-}
-
-static string shell_escape(const string& str) {
-  bool should_escape = false;
-  static const char safe_chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-+=./$:";
-  for (size_t i = 0; i < str.length(); ++i) {
-    if (strchr(safe_chars, str[i]) == NULL) {
-      should_escape = true;
-      break;
-    }
-  }
-
-  if (!should_escape) return str;
-
-  string result = "'";
-  for (size_t i = 0; i < str.length(); ++i) {
-    char c = str[i];
-    if (c == '\'') {
-      result += "'\"'\"'";
-    } else {
-      result += c;
-    }
-  }
-  return result + "'";
-}
-
-static string shell_escape(const list<string>& items) {
-  string result = "";
-  for (__typeof(items.begin()) it = items.begin(); it != items.end(); ++it) {
-    if (!result.empty()) result += " ";
-    result += shell_escape(*it);
-  }
-  return result;
-}
-
-static string get_random_hash(int len = 40) {
-  static const char chars[] = "0123456789abcdef";
-  static const int MIN_LEN = 4;
-  if (len < MIN_LEN) len = MIN_LEN;
-
-  string result;
-  result.reserve(len);
-  for (int i = 0; i < len; ++i) result += chars[rand() % (sizeof(chars) - 1)];
-  return result;
-}
-
-
-static void ensure_system(const string& cmd) {
-  log_debug("running: %s", cmd.c_str());
-  int ret = system(cmd.c_str());
-  if (ret != 0) fatal("failed to run %s", cmd.c_str());
-}
-
-static string prepare_chroot(const string& etc_dir, const string& code_path, const string& env) {
-  string mirrorfs_config_path = get_config_path(etc_dir, code_path, format("%s%s", env, EXT_MIRRRORFS));
-  if (mirrorfs_config_path.empty()) fatal("cannot find mirrorfs config");
-
-  string content = fs::read(mirrorfs_config_path);
-  string name = sha1(content);
-  string dest = fs::join(CHROOT_BASE_DIR, name);
-
-  log_debug("prepare_chroot: config = %s dest = %s", mirrorfs_config_path.c_str(), dest.c_str());
-
-  {
-    // lock both processes and threads
-#ifdef _OPENMP
-    ScopedOMPLock("chroot_lock");
-#endif
-    // enforce_mkdir_p(base_dir);
-    fs::ScopedFileLock chroot_dir_lock(mirrorfs_config_path);
-
-    if (fs::is_accessible(dest, F_OK)) {
-      log_debug("already mounted: %s", dest.c_str());
-      return dest;
-    }
-
-    string comment = fs::join(fs::basename(fs::dirname(mirrorfs_config_path)), env);
-    string cmd = format("lrun-mirrorfs --name %s --setup %s --comment %s 1>&2", name, shell_escape(mirrorfs_config_path), comment);
-    ensure_system(cmd);
-
-    // wait 5s until mount finishes
-    int mounted = 0;
-    for (int i = 0; i < 50; ++i) {
-      if (fs::is_accessible(dest, F_OK)) {
-        mounted = 1;
-        break;
-      }
-      usleep(100000); // 0.1s
-    }
-    if (!mounted) fatal("%s is not mounted correctly", dest.c_str());
-  }
-
-  return dest;
-}
-
 static void print_usage() {
   fprintf(stderr,
       "Compile, run, judge and print response JSON:\n"
@@ -704,6 +62,8 @@ static void print_usage() {
       "         (or: --input input-path --output-sha1 ac-chomp-sha1,pe-sha1)\n"
       "         [--user-stdout path] [--user-stderr path]\n"
       "         [[--testcase] --input path --output path (or --output-sha1 sha1)] ...\n"
+      "         (--input-fd n and --output-fd n take test data from inherited\n"
+      "          file descriptors instead of paths, ex. --input-fd 3 3<1.in)\n"
       "\n"
       "Compile, run and print response JSON:\n"
       "  ljudge --skip-checker (implies --keep-stdout)\n"
@@ -713,12 +73,51 @@ static void print_usage() {
       "Compile, run, print output instead of JSON response (the \"direct mode\"):\n"
       "  ljudge user-code-path\n"
       "\n"
+      "Judge requests (see schema/request.json) from stdin, one per line:\n"
+      "  ljudge --batch\n"
+      "         (options below are defaults of requests)\n"
+      "\n"
+      "Judge requests dropped into spool-dir/incoming, write responses to spool-dir/done:\n"
+      "  ljudge --spool spool-dir\n"
+      "         (options below are defaults of requests)\n"
+      "\n"
+      "Run testcases for coordinators, or split testcases across such workers:\n"
+      "  ljudge --worker [host:]port  (localhost unless host is given, ex. 0.0.0.0)\n"
+      "  ljudge --nodes host:port[,host:port...] [--affinity key] --user-code ... --testcase ...\n"
+      "         (testcases of a problem go to the same nodes, by default the\n"
+      "          problem is identified by its checker and test data)\n"
+      "\n"
       "Available options: (put these before the first `--input`)\n"
       "  ljudge [--etc-dir path] [--cache-dir path]\n"
       "         [--keep-stdout] [--keep-stderr]\n"
+      "         [--format json|cbor] [--pretty-print]\n"
 #ifdef _OPENMP
       "         [--threads n]\n"
 #endif
+      "         [--run-slots n]  (testcases running at once by all ljudge\n"
+      "                           processes sharing the cache-dir)\n"
+      "         [--compile-slots n]  (compilers running at once, at most\n"
+      "                               available memory / compiler memory)\n"
+      "         [--borderline-rerun fraction,count[,min|median]]\n"
+      "                 (run again if cpu time is this close to the limit)\n"
+      "         [--max-jitter fraction]  (run fewer testcases at once while\n"
+      "                                   timing is noisier than this, ex. 0.05)\n"
+      "         [--pin-cpus cores|threads]  (pin each testcase to a physical core\n"
+      "                                      or a logical cpu)\n"
+      "         [--max-total-cpu-time seconds] [--max-total-real-time seconds]\n"
+      "                 (kill running testcases and skip the rest when all\n"
+      "                  testcases together used this much)\n"
+      "         [--cache-size bytes] [--cache-entries n]  (compiled checkers\n"
+      "                 kept, least recently used ones are removed)\n"
+      "         [--scratch-memory bytes]  (keep outputs in memory instead of\n"
+      "                 cache-dir/tmp while their limits add up to this)\n"
+      "         [--prefetch n]  (read test data of the next n testcases into\n"
+      "                         the page cache while others run, default 4)\n"
+      "         [--lock-test-data bytes]  (also mlock up to this much of it,\n"
+      "                                    for --batch, --spool and --worker)\n"
+      "         [--test-data-cache bytes]  (keep expected outputs in memory\n"
+      "                 for the next submissions, for --batch, --spool and\n"
+      "                 --worker)\n"
       "         [--skip-on-first-failure]\n"
       "         [--max-cpu-time seconds] [--max-real-time seconds]\n"
       "         [--max-memory bytes] [--max-output bytes] [--max-stack bytes]\n"
@@ -731,6 +130,15 @@ static void print_usage() {
       "Check environment:\n"
       "  ljudge --check\n"
       "\n"
+      "Store test data (or code) by content, print blob:<sha1>/<name> references\n"
+      "usable as --input, --output, --user-code and --checker-code:\n"
+      "  ljudge [--cache-dir path] --import file [file ...]\n"
+      "  ljudge [--cache-dir path] --verify-blobs  (hash stored files again)\n"
+      "\n"
+      "Remove the trash, tmp dirs of dead processes and least recently used\n"
+      "compiled checkers over the budget in the cache-dir:\n"
+      "  ljudge [--cache-dir path] [--cache-size bytes] [--cache-entries n] --gc\n"
+      "\n"
       "Print compiler / interpreter versions:\n"
       "  ljudge --compiler-versions      (only list compilers installed)\n"
       "  ljudge --all-compiler-versions  (including configured but not installed ones)\n"
@@ -744,7 +152,7 @@ static void print_usage() {
       "  ljudge will truncate any output (compiler log, stdout, stderr, etc.)\n"
       "  longer than %u bytes.\n"
       "\n", (unsigned) TRUNC_LOG);
-  cleanup_exit(0);
+  exit(0);
 }
 
 static void print_json_schema() {
@@ -815,6 +223,13 @@ static void print_json_schema() {
   "          \"type\": \"number\",\n"
   "          \"description\": \"CPU time used by the program, in seconds. Present only when \\\"exceed\\\" is missing, and \\\"result\\\" is not \\\"SKIPPED\\\" or \\\"INTERNAL_ERROR\\\"\"\n"
   "        },\n"
+  "        \"times\": {\n"
+  "          \"type\": \"array\",\n"
+  "          \"items\": {\n"
+  "            \"type\": \"number\"\n"
+  "          },\n"
+  "          \"description\": \"CPU time of every run, in seconds, in the order they ran. Present only when the command line option \\\"--borderline-rerun\\\" is set and the test case was run again because its time was close to the limit. A run killed at the (raised) limit counts as that limit\"\n"
+  "        },\n"
   "        \"memory\": {\n"
   "          \"type\": \"number\",\n"
   "          \"description\": \"Peak memory used by the program, in bytes. Present only when \\\"exceed\\\" is missing, and \\\"result\\\" is not \\\"SKIPPED\\\" or \\\"INTERNAL_ERROR\\\"\"\n"
@@ -861,14 +276,28 @@ static void print_json_schema() {
   "      \"type\": \"array\",\n"
   "      \"description\": \"Test case results. Present only when compilation has successed\",\n"
   "      \"items\": {\"$ref\": \"#/definitions/testcaseResult\"}\n"
+  "    },\n"
+  "    \"error\": {\n"
+  "      \"type\": \"string\",\n"
+  "      \"description\": \"Why the request was not judged. Present only in \\\"--batch\\\" mode, when the request is invalid or an internal error happens. No other properties are present then\"\n"
   "    }\n"
   "  },\n"
   "  \"additionalProperties\": false,\n"
-  "  \"required\": [\"compilation\"]\n"
+  "  \"anyOf\": [{\"required\": [\"compilation\"]}, {\"required\": [\"error\"]}]\n"
   "}\n"
   /* [[[end]]] */
   );
-  cleanup_exit(0);
+  exit(0);
+}
+
+// cpus and memory, as limited by cgroups
+static string format_resources() {
+  const Resources& res = get_resources();
+  string quota = res.cpu_quota > 0 ? format("%.2f", res.cpu_quota) : "unlimited";
+  string memory_limit = res.memory_limit > 0 ? format("%lld MB", res.memory_limit >> 20) : "unlimited";
+  return format("cpus: %d (online: %d, cpuset: %d, cgroup quota: %s)\n"
+                "memory: %lld MB (total: %lld MB, cgroup limit: %s)",
+                res.cpus, res.online_cpus, res.cpuset_cpus, quota, res.memory >> 20, res.memory_total >> 20, memory_limit);
 }
 
 static void print_version() {
@@ -880,7 +309,8 @@ static void print_version() {
     "no"
 #endif
   );
-  cleanup_exit(0);
+  printf("%s\n", format_resources().c_str());
+  exit(0);
 }
 
 // like Python's subprocess.check_output but without the check part
@@ -924,7 +354,7 @@ static void print_checkpoint(const string& name, bool passed, const string& solu
 }
 
 static void print_checkfail(const string& name, const string& message, char symbol = '!') {
-  term::set(term::attr::BOLD, term::fg::WHITE, symbol == 'S' || symbol == 'W' ? term::bg::YELLOW : term::bg::RED);
+  term::set(term::attr::BOLD, term::fg::WHITE, symbol == 'I' ? term::bg::BLUE : (symbol == 'S' || symbol == 'W' ? term::bg::YELLOW : term::bg::RED));
   printf(" %c ", symbol);
   term::set();
   term::set(term::attr::BOLD);
@@ -951,6 +381,35 @@ static bool is_cgroup_enabled(const string& subsystem) {
   return enabled_bit;
 }
 
+static void do_gc(const Options& options) {
+  CacheBudget budget = { options.cache_size, options.cache_entries };
+  GarbageStats stats = collect_garbage(options.cache_dir, budget);
+  printf("%d tmp dirs of dead processes trashed, %d trash entries removed\n", stats.trashed, stats.removed);
+  printf("compile caches: %d entries, %lld KB. %d evicted (%lld KB), %d pinned\n", stats.entries, stats.size >> 10, stats.evicted, stats.evicted_size >> 10, stats.busy);
+  exit(0);
+}
+
+static void do_import(const Options& options, int nfile, char const *files[]) {
+  string blobs_dir = fs::join(options.cache_dir, SUBDIR_BLOBS);
+  int exit_code = 0;
+  for (int i = 0; i < nfile; ++i) {
+    string ref, error;
+    if (import_blob(blobs_dir, files[i], ref, error)) {
+      printf(BLOB_REF_PREFIX "%s\t%s\n", ref.c_str(), files[i]);
+    } else {
+      fprintf(stderr, "%s\n", error.c_str());
+      exit_code = 1;
+    }
+  }
+  exit(exit_code);
+}
+
+static void do_verify_blobs(const Options& options) {
+  BlobCheck check = verify_blobs(options.cache_dir);
+  printf("%d blobs ok, %d corrupted (removed)\n", check.ok, check.corrupted);
+  exit(check.corrupted > 0 ? 1 : 0);
+}
+
 static void do_check() {
   if (getuid() == 0) {
     fprintf(stderr,
@@ -1105,7 +564,11 @@ static void do_check() {
     }
   }
 
-  cleanup_exit(0);
+  { // resources. default --threads and testcase memory admission follow them
+    print_checkfail("resources", format_resources(), 'I');
+  }
+
+  exit(0);
 }
 
 // find something like a.b.c from a long string
@@ -1186,14 +649,6 @@ static void print_compiler_versions(const Options& opts, bool only_present = tru
   exit(0);
 }
 
-static bool is_language_supported(const string& etc_dir, const string& code_path) {
-  // a supported language must have version command configured
-  if (get_config_path(etc_dir, code_path, ENV_VERSION EXT_CMD_LIST, true).empty()) {
-    return false;
-  } else {
-    return true;
-  }
-}
 
 static double to_number(const string& str) {
   double v = 0;
@@ -1201,34 +656,6 @@ static double to_number(const string& str) {
   return v;
 }
 
-long long parse_bytes(const string& str) {
-    long long result = 1;
-    // accept str which ends with 'k', 'kb', 'm', 'M', etc.
-    int pos = str.length() - 1;
-    if (pos > 0 && (str[pos] == 'b' || str[pos] == 'B')) --pos;
-    if (pos > 0) {
-        switch (str[pos]) {
-            case 'g': case 'G':
-                result *= 1024;
-            case 'm': case 'M':
-                result *= 1024;
-            case 'k': case 'K':
-                result *= 1024;
-        }
-    }
-    if (result == 1) {
-        // read as long long
-        sscanf(str.c_str(), "%lld", &result);
-    } else {
-        // read as double so that the user can use things like 0.5mb
-        double v = 0;
-        sscanf(str.c_str(), "%lf", &v);
-        result *= v;
-    }
-    return result;
-}
-
-
 /**
  * --user-code path-to-user-code
  * --testcase
@@ -1242,31 +669,14 @@ long long parse_bytes(const string& str) {
  * --input /var/cache/bar/3.in
  * --output /var/cache/bar/3.out
  */
-static Options parse_cli_options(int argc, const char *argv[]) {
+// current_case is the template of testcases, after options are parsed
+static Options parse_cli_options(int argc, const char *argv[], Testcase& current_case) {
   Options options;
-  Testcase current_case;
 
   // default options
   {
-    string home = getenv("HOME") ? getenv("HOME") : "/tmp";
-    string etc_dir_candidates[] = { "/etc/ljudge", fs::join(home, ".config/ljudge"), fs::join(home, "ljudge/etc/ljudge"), "./etc/ljudge", "../etc/ljudge" };
-    for (size_t i = 0; i < sizeof(etc_dir_candidates) / sizeof(etc_dir_candidates[0]); ++i) {
-      if (fs::is_dir(etc_dir_candidates[i])) {
-        options.etc_dir = etc_dir_candidates[i];
-        break;
-      }
-    }
-    options.cache_dir = fs::join(home, ".cache/ljudge");
-    options.compiler_limit = { 5, 10, 1 << 29 /* 512M mem */, 1 << 27 /* 128M out */ };
+    init_options(options, current_case);
     options.pretty_print = isatty(STDOUT_FILENO);
-    options.skip_checker = false;
-    options.keep_stdout = false;
-    options.keep_stderr = false;
-    options.direct_mode = false;
-    options.nthread = 0;
-    options.skip_on_first_failure = false;
-    current_case.checker_limit = { 5, 10, 1 << 30, 1 << 30, 1 << 30 };
-    current_case.runtime_limit = { 1, 3, 1 << 26 /* 64M mem */, 1 << 25 /* 32M output */, 1 << 23 /* 8M stack limit */ };
     debug_level = getenv("DEBUG") ? 10 : 0;
   }
 
@@ -1320,6 +730,17 @@ static Options parse_cli_options(int argc, const char *argv[]) {
     } else if (option == "output" || option == "o") {
       REQUIRE_NARGV(1);
       current_case.output_path = NEXT_STRING_ARG;
+    } else if (option == "input-fd") {
+      APPEND_TEST_CASE;
+      REQUIRE_NARGV(1);
+      string error;
+      current_case.input_path = adopt_data_fd((int)NEXT_NUMBER_ARG, error);
+      if (!error.empty()) fatal("--input-fd: %s", error.c_str());
+    } else if (option == "output-fd") {
+      REQUIRE_NARGV(1);
+      string error;
+      current_case.output_path = adopt_data_fd((int)NEXT_NUMBER_ARG, error);
+      if (!error.empty()) fatal("--output-fd: %s", error.c_str());
     } else if (option == "user-stdout") {
       REQUIRE_NARGV(1);
       current_case.user_stdout_path = NEXT_STRING_ARG;
@@ -1415,8 +836,32 @@ static Options parse_cli_options(int argc, const char *argv[]) {
       options.keep_stderr = true;
     } else if (option == "check") {
       do_check();
+    } else if (option == "gc") {
+      do_gc(options);
+    } else if (option == "import") {
+      // the rest are files
+      do_import(options, argc - i - 1, argv + i + 1);
+    } else if (option == "verify-blobs") {
+      do_verify_blobs(options);
     } else if (option == "pretty-print" || option == "pp") {
       options.pretty_print = 1;
+    } else if (option == "format") {
+      REQUIRE_NARGV(1);
+      options.format = NEXT_STRING_ARG;
+    } else if (option == "batch") {
+      options.batch_mode = true;
+    } else if (option == "spool") {
+      REQUIRE_NARGV(1);
+      options.spool_dir = NEXT_STRING_ARG;
+    } else if (option == "worker") {
+      REQUIRE_NARGV(1);
+      options.worker_address = NEXT_STRING_ARG;
+    } else if (option == "nodes") {
+      REQUIRE_NARGV(1);
+      options.nodes = string_split(NEXT_STRING_ARG, ",");
+    } else if (option == "affinity") {
+      REQUIRE_NARGV(1);
+      options.affinity = NEXT_STRING_ARG;
     } else if (option == "skip-checker") {
       options.skip_checker = true;
       options.keep_stdout = true;
@@ -1429,6 +874,49 @@ static Options parse_cli_options(int argc, const char *argv[]) {
       REQUIRE_NARGV(1);
       options.nthread = NEXT_NUMBER_ARG;
 #endif
+    } else if (option == "run-slots") {
+      REQUIRE_NARGV(1);
+      options.run_slots = NEXT_NUMBER_ARG;
+    } else if (option == "borderline-rerun") {
+      REQUIRE_NARGV(1);
+      // fraction,count[,min|median]
+      vector<string> fields = string_split(NEXT_STRING_ARG, ",");
+      options.borderline_fraction = to_number(fields[0]);
+      options.borderline_reruns = fields.size() > 1 ? (int)to_number(fields[1]) : 0;
+      if (fields.size() > 2) options.borderline_stat = fields[2];
+    } else if (option == "max-jitter") {
+      REQUIRE_NARGV(1);
+      options.max_jitter = NEXT_NUMBER_ARG;
+    } else if (option == "max-total-cpu-time") {
+      REQUIRE_NARGV(1);
+      options.max_total_cpu_time = NEXT_NUMBER_ARG;
+    } else if (option == "max-total-real-time") {
+      REQUIRE_NARGV(1);
+      options.max_total_real_time = NEXT_NUMBER_ARG;
+    } else if (option == "cache-size") {
+      REQUIRE_NARGV(1);
+      options.cache_size = parse_bytes(NEXT_STRING_ARG);
+    } else if (option == "cache-entries") {
+      REQUIRE_NARGV(1);
+      options.cache_entries = NEXT_NUMBER_ARG;
+    } else if (option == "prefetch") {
+      REQUIRE_NARGV(1);
+      options.prefetch = NEXT_NUMBER_ARG;
+    } else if (option == "lock-test-data") {
+      REQUIRE_NARGV(1);
+      options.lock_test_data = parse_bytes(NEXT_STRING_ARG);
+    } else if (option == "test-data-cache") {
+      REQUIRE_NARGV(1);
+      options.test_data_cache = parse_bytes(NEXT_STRING_ARG);
+    } else if (option == "scratch-memory") {
+      REQUIRE_NARGV(1);
+      options.scratch_memory = parse_bytes(NEXT_STRING_ARG);
+    } else if (option == "pin-cpus") {
+      REQUIRE_NARGV(1);
+      options.pin_cpus = NEXT_STRING_ARG;
+    } else if (option == "compile-slots") {
+      REQUIRE_NARGV(1);
+      options.compile_slots = NEXT_NUMBER_ARG;
     } else if (option == "skip-on-first-failure") {
       if (options.nthread > 1) {
         fatal("'skip-on-first-faiulure' does not work with threads")
@@ -1442,11 +930,17 @@ static Options parse_cli_options(int argc, const char *argv[]) {
   APPEND_TEST_CASE;
 
   // if the user has decided to skip checker and did not provide a testcase, add a dummy one
-  if (options.cases.empty() && options.skip_checker) {
-    string input_path = isatty(STDIN_FILENO) ?
-        (options.direct_mode ? "" /* pass through */ : DEV_NULL)
-      : fs::resolve(format("/proc/self/fd/%d", STDIN_FILENO) /* the file is passed using '<' */);
-    if (!fs::is_accessible(input_path, R_OK)) input_path = DEV_NULL;
+  if (options.cases.empty() && options.skip_checker && !options.batch_mode && options.spool_dir.empty() && options.worker_address.empty()) {
+    string input_path = options.direct_mode ? "" /* pass through */ : DEV_NULL;
+    if (!isatty(STDIN_FILENO)) {
+      // the file is passed using '<' or a pipe
+      string error;
+      input_path = adopt_data_fd(STDIN_FILENO, error);
+      if (input_path.empty()) {
+        log_debug("cannot use stdin: %s", error.c_str());
+        input_path = DEV_NULL;
+      }
+    }
     current_case.input_path = input_path;
     if (options.direct_mode && input_path != DEV_NULL && !input_path.empty() /* not using a real file */) {
       current_case.runtime_limit.real_time = 0;  // unlimited
@@ -1466,770 +960,122 @@ static Options parse_cli_options(int argc, const char *argv[]) {
   return options;
 }
 
-static void check_path(std::vector<string>& errors, const string& path, bool is_dir, const string& name) {
-  if (path.empty()) {
-    errors.push_back(name + " is required");
-    return;
-  }
-
-  if (!(is_dir ? \
-          (fs::is_dir(path) && fs::is_accessible(path, R_OK | X_OK))
-        : (!fs::is_dir(path) && fs::is_accessible(path, R_OK)))) {
-    errors.push_back(name + " (" + path + ") is not accessible");
-  }
-}
-
-static bool is_sha1(const string& str) {
-  if (str.length() != 40) return false;
-  for (int i = 0; i < 40; ++i) {
-    if (str[i] < '0' || str[i] > 'f') return false;
-  }
-  return true;
-}
-
-static void check_options(const Options& options) {
+static void check_options(Options& options) {
   std::vector<string> errors;
-
-  enforce_mkdir_p(options.cache_dir);
-
-  check_path(errors, options.etc_dir, true, "--etc-dir");
-  check_path(errors, options.cache_dir, true, "--cache-dir");
-  check_path(errors, options.user_code_path, false, "--user-code");
-
-  for (int i = 0; i < (int)options.cases.size(); ++i) {
-    const Testcase& kase = options.cases[i];
-    if (!options.direct_mode || !kase.input_path.empty()) {
-      check_path(errors, kase.input_path, false /* is_dir */, format("--input of testcases[%d]", i));
-    }
-    if (options.skip_checker) {
-      if (!kase.output_path.empty()) errors.push_back("--output conflicts with --skip-checker");
-      if (!kase.output_sha1.empty()) errors.push_back("--output-sha1 conflicts with --skip-checker");
-    } else {
-      if (!kase.output_sha1.empty()) {
-        if (!is_sha1(kase.output_sha1)) errors.push_back("'" + kase.output_sha1 + "' is not a valid hex SHA1");
-        // allow output_pe_sha1 to be empty
-        if (!kase.output_pe_sha1.empty() && !is_sha1(kase.output_pe_sha1)) errors.push_back("'" + kase.output_pe_sha1 + "' is not a invalid hex SHA1");
-      } else {
-        check_path(errors, kase.output_path, false, format("--output of testcases[%d]", i));
-      }
-    }
-  }
-
-  if (options.cases.empty()) {
-    errors.push_back("At lease one testcase is required");
-  }
-
-  if (options.skip_checker && !options.checker_code_path.empty()) {
-    errors.push_back("--skip-checker conflicts with --checker-code");
-  }
-
-  if (getuid() == 0) {
-    errors.push_back("Running ljudge using root is forbidden");
-  }
-
-#ifdef _OPENMP
-  if (options.nthread < 0) {
-    errors.push_back("--threads cannot < 0");
-  }
-#endif
+  resolve_data_refs(options, errors);
+  if (errors.empty()) validate_options(options, errors);
 
   if (errors.size() > 0) {
     for (int i = 0; i < (int)errors.size(); ++i) {
       fprintf(stderr, "%s\n", errors[i].c_str());
     }
     fprintf(stderr, "--help will show valid options\n");
-    cleanup_exit(1);
-  }
-}
-
-static void setfd(int dst, int src) {
-  if (src == dst || src < 0) return;
-  dup2(src, dst);
-  close(src);
-}
-
-
-static LrunResult parse_lrun_output(const string& lrun_output) {
-  LrunResult result;
-  size_t pos = 0, start = 0;
-  for (;;) {
-    pos = lrun_output.find("\n", start);
-    int len = (pos == string::npos ? string::npos : pos - start);
-    string line = lrun_output.substr(start, len);
-    size_t space_pos = line.find(' ');
-    if (line.length() > 0 && space_pos > 0) {
-      string key = line.substr(0, space_pos);
-      string value = line.substr(9); // 9: lrun fixed field padding
-      if (key == "MEMORY") {
-        long long memory = 0;
-        if (sscanf(value.c_str(), "%Ld", &memory) != 1) result.error = "cannot read MEMORY";
-        else result.memory = memory;
-      } else if (key == "CPUTIME") {
-        double time = 0;
-        if (sscanf(value.c_str(), "%lf", &time) != 1) result.error = "cannot read CPUTIME";
-        else result.cpu_time = time;
-      } else if (key == "REALTIME") {
-        double time = 0;
-        if (sscanf(value.c_str(), "%lf", &time) != 1) result.error = "cannot read REALTIME";
-        else result.real_time = time;
-      } else if (key == "SIGNALED") {
-        if (value == "0") {
-          result.signaled = false;
-        } else if (value == "1") {
-          result.signaled = true;
-        } else result.error = "cannot read SIGNALED";
-      } else if (key == "EXITCODE") {
-        int code = 0;
-        if (sscanf(value.c_str(), "%d", &code) != 1) result.error = "cannot read EXITCODE";
-        else result.exit_code = code;
-      } else if (key == "TERMSIG") {
-        int code = 0;
-        if (sscanf(value.c_str(), "%d", &code) != 1) result.error = "cannot read TERMSIG";
-        else result.term_sig = code;
-      } else if (key == "EXCEED") {
-        if (value != "none") result.exceed = value;
-      }
-    }
-    start = pos + 1;
-    if (pos == string::npos) break;
-  }
-  return result;
-}
-
-#ifndef NDEBUG
-static void prepare_crash_report_path() {
-  setenv("SEGFAULT_OUTPUT_NAME", format("/tmp/segv.%s.log", get_random_hash(6)).c_str(), 1 /* overwrite */);
-  setenv("SEGFAULT_USE_ALTSTACK", "1", 1 /* overwrite */);
-}
-#endif
-
-static LrunResult lrun(
-#ifdef NDEBUG
-    const vector<string>& args, const string& stdin_path, const string& stdout_path, const string& stderr_path
-#else
-    vector<string> args, string stdin_path, string stdout_path, string stderr_path
-#endif
-    ) {
-  LrunResult result;
-  int pipe_fd[2];
-  int ret = pipe(pipe_fd);
-  if (ret != 0) fatal("can not create pipe to run lrun");
-
-#ifndef NDEBUG
-  if (getenv("LJUDGE_SET_LRUN_SEGFAULT_PATH")) {
-    prepare_crash_report_path();
-  }
-  string debug_lrun_command = "lrun";
-  for (__typeof(args.begin()) it = args.begin(); it != args.end(); ++it) {
-      debug_lrun_command += " " + shell_escape(*it);
-  }
-  if (!stdin_path.empty()) debug_lrun_command += " <" + shell_escape(stdin_path);
-  if (!stdout_path.empty()) debug_lrun_command += " >" + shell_escape(stdout_path);
-  if (!stderr_path.empty()) {
-    if (stderr_path == stdout_path)
-      debug_lrun_command += " 2>&1";
-    else
-      debug_lrun_command += " 2>" + shell_escape(stderr_path);
-  }
-  log_debug("running: %s", debug_lrun_command.c_str());
-  fflush(stderr);
-  if (getenv("LJUDGE_KEEP_LRUN_STDERR") && stderr_path == DEV_NULL) {
-    stderr_path = format("/tmp/ljudge_lrun.%s.log", get_random_hash(6));
-    log_debug("lrun stderr redirects to %s", stderr_path.c_str());
-  }
-#endif
-
-  pid_t pid = fork();
-  if (pid == -1) {
-    log_debug("failed to fork\n");
-    result.error = "cannot fork to run lrun";
-    return result;
-  }
-  if (pid) {
-    close(pipe_fd[1]);
-
-    int status = 0;
-    string lrun_output = "";
-
-    while (true) {
-      char ch;
-      ssize_t read_size = read(pipe_fd[0], &ch, 1);
-      if (read_size == 1) {
-        lrun_output += ch;
-        if (ch == '\n' && lrun_output.find("EXCEED  ") != string::npos) {
-          // we receive enough content (EXCEED ... "\n" is the last line)
-          // lrun's exiting may take 0.03+ seconds (mostly the kernel
-          // cleaning up the pid and ipc namespace). do NOT wait for it.
-          //
-          // lrun ignores SIGPIPE so this won't hurt it.
-          //
-          // we will soon exit (after all testcases) so zombies will be
-          // killed by init.
-          //
-          // this reduces 0.03 to 0.04s per lrun run. when running
-          // examples/a-plus-b/run.sh, real time decreases from 14.27
-          // to 13.29, about 7%.
-          result = parse_lrun_output(lrun_output);
-          break;
-        }
-      } else {
-        // EOF or error. get lrun exit status
-        while (waitpid(pid, &status, 0) != pid) usleep(10000);
-        if (status && WIFSIGNALED(status)) {
-          result.error = format("lrun was signaled (%d)", WTERMSIG(status));
-        } else if (status && WEXITSTATUS(status) != 0) {
-          result.error = format("lrun exited with non-zero (%d)", WEXITSTATUS(status));
-        } else {
-          result.error = format("lrun did not generate expected output");
-        }
-        break;
-      }
-    }
-    close(pipe_fd[0]);
-    log_debug("lrun output:\n%s", lrun_output.c_str());
-
-  } else {
-    prctl(PR_SET_PDEATHSIG, SIGTERM);
-    close(pipe_fd[0]);
-    // pass lrun's fd (3) output
-    static const int LRUN_FILENO = 3;
-    setfd(LRUN_FILENO, pipe_fd[1]);
-    // prepare fds
-    if (!stdin_path.empty()) {
-      fclose(stdin);
-      int ret = open(stdin_path.c_str(), O_RDONLY);
-      if (ret < 0) fatal("can not open %s for reading", stdin_path.c_str());
-      setfd(STDIN_FILENO, ret);
-    }
-    if (!stderr_path.empty()) {
-      fclose(stderr);
-      int ret = open(stderr_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0600);
-      if (ret < 0) fatal("can not open %s for writing", stderr_path.c_str());
-      setfd(STDERR_FILENO, ret);
-    }
-    if (!stdout_path.empty()) {
-      fclose(stdout);
-      if (stderr_path == stdout_path) {
-        dup2(STDERR_FILENO, STDOUT_FILENO);
-      } else {
-        int ret = open(stdout_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0600);
-        if (ret < 0) fatal("can not open %s for writing", stdout_path.c_str());
-        setfd(STDOUT_FILENO, ret);
-      }
-    }
-    // prepare args
-    const char **argv = (const char**)malloc(sizeof(char*) * (args.size() + 2));
-    argv[0] = "lrun";
-    for (int i = 0; i < (int)args.size(); ++i) {
-      argv[i + 1] = args[i].c_str();
-    }
-    argv[args.size() + 1] = 0;
-    execvp("lrun", (char * const *) argv);
-    close(pipe_fd[1]);
-    log_error("can not start lrun");
-    // not using cleanup_exit here because it is the child
     exit(1);
   }
-
-  return result;
-}
-
-static string get_process_tmp_dir(const string& cache_dir) {
-  static string result;
-  if (result.empty()) {
-    result = fs::join(cache_dir, SUBDIR_TEMP, format("%lu", (unsigned long)(getpid())));
-    enforce_mkdir_p(result);
-    register_cleanup_path(result);
-  }
-  return result;
-}
-
-static string get_code_work_dir(const string& base_dir, const string& code_path) {
-  // assume code file doesn't change
-  static map<string, string> cache;
-  string key = code_path + "///" + base_dir;
-  if (cache.count(key)) return cache[key];
-  string code_sha1 = sha1(fs::read(code_path));
-  string dest = fs::join(base_dir, format("%s/%s", code_sha1.substr(0, 2), code_sha1.substr(2)));
-  cache[key] = dest;
-  return dest;
-}
-
-static string get_temp_file_path(const string& cache_dir, const string& prefix = "", int len = 10) {
-  string dest;
-#ifdef _OPENMP
-  ScopedOMPLock("temp_file_path_lock");
-#endif
-  do {
-    string hash = get_random_hash(len);
-    dest = fs::join(get_process_tmp_dir(cache_dir), prefix.empty() ? hash : format("%s-%s", prefix, hash));
-  } while (fs::exists(dest));
-  enforce_mkdir_p(fs::dirname(dest));
-  if (!fs::touch(dest)) fatal("can not prepare temp file %s", dest.c_str());
-  // no more needed since it is inside the process tmp dir, which will be removed
-  // register_cleanup_path(dest);
-  return dest;
-}
-
-static map<string, string> get_mappings(const string& src_name, const string& exe_name, const string& dest) {
-  map<string, string> mappings;
-  mappings["$src"] = src_name;  // basename
-  mappings["$exe"] = exe_name;  // basename
-  mappings["$dir"] = dest;      // unsandboxed, workdir full path
-
-  return mappings;
-}
-
-static CompileResult compile_code(const string& etc_dir, const string& cache_dir, const string& dest /* work dir */, const string& code_path, const Limit& limit) {
-  log_debug("compile_code: %s %s", code_path.c_str(), dest.c_str());
-
-  CompileResult result;
-  result.success = false;
-
-  if (!is_language_supported(etc_dir, code_path)) {
-    result.error = format("Compiling `%s` is not supported. No appropriate config found.", fs::basename(code_path));
-    return result;
-  }
-
-  enforce_mkdir_p(dest);
-
-  do {
-    // compile_code is not running in 2 threads. locking processes is enough.
-    fs::ScopedFileLock lock(dest);
-
-    string src_name = get_src_name(etc_dir, code_path);
-    string dest_code_path = fs::join(dest, src_name);
-    if (!fs::exists(dest_code_path)) {
-      log_debug("copying code from %s to %s", code_path.c_str(), dest_code_path.c_str());
-      string code_content = fs::read(code_path);
-      size_t n = fs::write(dest_code_path, code_content.c_str());
-      if (n != code_content.length()) fatal("fail to copy code file to %s", dest_code_path.c_str());
-    }
-
-    std::list<string> compile_cmd = get_config_list(etc_dir, code_path, ENV_COMPILE EXT_CMD_LIST);
-    if (compile_cmd.empty()) {
-      result.success = true;
-      log_debug("skip compilation because get_config_list() returns nothing");
-      break;
-    }
-
-    string dest_compile_log_path = fs::join(dest, "compile.log");
-    string exe_name = get_config_content(etc_dir, code_path, ENV_COMPILE EXT_EXE_NAME, DEFAULT_EXE_NAME);
-    string dest_exe_path = fs::join(dest, exe_name);
-    if (fs::exists(dest_exe_path)) {
-      result.success = true;
-      log_debug("skip compilation because binary exists: %s", dest_exe_path.c_str());
-      result.log = fs::nread(dest_compile_log_path, TRUNC_LOG);
-      break;
-    }
-
-    string chroot_path = prepare_chroot(etc_dir, code_path, ENV_COMPILE);
-
-    LrunArgs lrun_args;
-    lrun_args.append_default();
-    lrun_args.append("--chroot", chroot_path);
-    lrun_args.append("--bindfs", fs::join(chroot_path, "/tmp"), dest);
-    lrun_args.append(limit);
-
-    map<string, string> mappings = get_mappings(src_name, exe_name, dest);
-    lrun_args.append(filter_user_lrun_args(escape_list(get_config_list(etc_dir, code_path, ENV_COMPILE EXT_LRUN_ARGS), mappings), cache_dir));
-    lrun_args.append(filter_user_lrun_args(escape_list(get_config_list(etc_dir, code_path, ENV_EXTRA EXT_LRUN_ARGS), mappings), cache_dir));
-    // Override (hide) files using user provided options
-    lrun_args.append(get_override_lrun_args(etc_dir, cache_dir, code_path, ENV_COMPILE, chroot_path));
-    lrun_args.append("--");
-    lrun_args.append(escape_list(compile_cmd, mappings));
-
-    LrunResult lrun_result = lrun(lrun_args, DEV_NULL, dest_compile_log_path, dest_compile_log_path);
-
-    string log = string_chomp(fs::nread(dest_compile_log_path, TRUNC_LOG));
-
-    // check internal error (mostly lrun can not exec the compiler)
-    if (!lrun_result.error.empty()) {
-      result.error = lrun_result.error + "\n" + log;
-      break;
-    }
-
-    // compiler did run. check its status and outputs
-    result.log = log;
-    if (!lrun_result.exceed.empty()) {
-      result.log += format("%sCompiler exceeded %s limit", (log.empty() ? "" : "\n\n"), lrun_result.exceed);
-    } else if (lrun_result.signaled) {
-      result.log += format("%sCompiler was killed by signal %d\n\n", (log.empty() ? "" : "\n\n"), lrun_result.term_sig);
-    } else if (lrun_result.exit_code != 0) {
-      // the message is too common. only write to "log" if log is empty
-      if (result.log.empty()) result.log = format("Compiler exited with code %d", lrun_result.exit_code);
-    } else if (!fs::exists(dest_exe_path)) {
-      if (result.log.empty()) result.log = "Compiler did not create the expected binary";
-    } else {
-      result.success = true;
-    }
-  } while (false);
-
-  if (!result.success) {
-#ifndef NDEBUG
-    if (!getenv("DEBUG") && !getenv("NOCLEANUP")) {
-#endif
-      log_debug("cleaning: rm -rf %s", dest.c_str());
-      fs::rm_rf(dest);
-#ifndef NDEBUG
-    }
-#endif
-  }
-  return result;
 }
 
-static LrunResult run_code(
-    const string& etc_dir,
-    const string& cache_dir,
-    const string& dest,
-    const string& code_path,
-    const Limit& limit,
-    const string& stdin_path,
-    const string& stdout_path,
-    const string& stderr_path = DEV_NULL,
-    const vector<string>& extra_lrun_args = vector<string>(),
-    const string& env = ENV_RUN,
-    const vector<string>& extra_argv = vector<string>()
-) {
-  log_debug("run_code: %s", code_path.c_str());
-
-  string chroot_path = prepare_chroot(etc_dir, code_path, env);
-  string exe_name = get_config_content(etc_dir, code_path, ENV_COMPILE EXT_EXE_NAME, DEFAULT_EXE_NAME);
-
-  // assume it is precompiled
-  {
-    // not locking here because the directory is read-only
-    // fs::ScopedFileLock lock(dest);
-    std::list<string> run_cmd = get_config_list(etc_dir, code_path, ENV_RUN EXT_CMD_LIST);
-    if (run_cmd.empty()) {
-      // use exe name as fallback
-      run_cmd.push_back("./" + exe_name);
-    }
-
-    string src_name = get_src_name(etc_dir, code_path);
-    map<string, string> mappings = get_mappings(src_name, exe_name, dest);
-    mappings["$chroot"] = chroot_path;
-
-    LrunArgs lrun_args;
-    lrun_args.append_default();
-    lrun_args.append("--chroot", chroot_path);
-    lrun_args.append("--bindfs-ro", fs::join(chroot_path, "/tmp"), dest);
-    lrun_args.append(get_override_lrun_args(etc_dir, cache_dir, code_path, ENV_RUN, chroot_path, run_cmd.size() >= 2 ? (*run_cmd.begin()) : "" ));
-    lrun_args.append(limit);
-    lrun_args.append(escape_list(extra_lrun_args, mappings));
-    lrun_args.append(filter_user_lrun_args(escape_list(get_config_list(etc_dir, code_path, format("%s%s", env, EXT_LRUN_ARGS)), mappings), cache_dir));
-    lrun_args.append(filter_user_lrun_args(escape_list(get_config_list(etc_dir, code_path, ENV_EXTRA EXT_LRUN_ARGS), mappings), cache_dir));
-    lrun_args.append("--");
-    lrun_args.append(escape_list(run_cmd, mappings));
-    lrun_args.append(escape_list(extra_argv, mappings));
-
-    LrunResult run_result = lrun(lrun_args, stdin_path, stdout_path, stderr_path);
-
-    return run_result;
-  }
-}
-
-static void write_compile_result(j::object& jo, const CompileResult& compile_result, const string& key) {
-  j::object jco;
-  jco["log"] = j::value(compile_result.log);
-  if (!compile_result.error.empty()) jco["error"] = j::value(compile_result.error);
-  jco["success"] = j::value(compile_result.success);
-  jo[key] = j::value(jco);
-}
-
-static string remove_space(const string& str) {
-  string result;
-  result.reserve(str.length());
-  for (size_t i = 0, l = str.length(); i < l; ++i) {
-    if (isspace(str[i])) continue;
-    result += str[i];
-  }
-  return result;
-}
-
-static void run_standard_checker(j::object& result, const Testcase& testcase, const string& user_output_path) {
-  log_debug("run_standard_checker: %s %s", testcase.output_path.c_str(), user_output_path.c_str());
-  bool use_sha1 = !testcase.output_sha1.empty();
-  string usr = string_chomp(fs::read(user_output_path));
+static void print_with_color(const string& content, int color, FILE *fp = stderr) {
+  if (content.empty()) return;
 
-  if (use_sha1) {
-    if (sha1(usr) == testcase.output_sha1) {
-      result["result"] = j::value(TestcaseResult::ACCEPTED);
-    } else if (!testcase.output_pe_sha1.empty() && sha1(remove_space(usr)) == testcase.output_pe_sha1) {
-      result["result"] = j::value(TestcaseResult::PRESENTATION_ERROR);
-    } else {
-      result["result"] = j::value(TestcaseResult::WRONG_ANSWER);
-    }
-  } else {
-    string out = string_chomp(fs::read(testcase.output_path));
-    if (usr == out) {
-      result["result"] = j::value(TestcaseResult::ACCEPTED);
-    } else if (remove_space(usr) == remove_space(out)) {
-      result["result"] = j::value(TestcaseResult::PRESENTATION_ERROR);
-    } else {
-      result["result"] = j::value(TestcaseResult::WRONG_ANSWER);
-    }
-  }
+  term::set(term::attr::RESET, color, fp);
+  fprintf(fp, "%s", content.c_str());
+  if (content[content.length() - 1] != '\n') fprintf(fp, "\n");
+  term::set(term::attr::RESET, fp);
 }
 
-static string get_full_path(const string& path) {
-  if (fs::is_absolute(path)) return path;
-  return fs::join(get_current_dir_name(), path);
-}
+static void print_direct_result(Context& ctx, const Options& opts, const CompileResult& compile_result, bool compiled) {
+  // not checking everything here because direct-mode is not that serious
+  print_with_color(compile_result.log, term::fg::YELLOW);
+  if (!compiled) return;
 
-static void prepare_checker_mount_bind_files(const string& dest) {
-  // prepare files used for mount bind in checker work dir:
-  // - input: standard input
-  // - output: standard output
-  // - user_output: user output
-  // - user_code: user code
-
-  // lrun requires non-root users to use full path
-  fs::touch(fs::join(dest, "input"));
-  fs::touch(fs::join(dest, "output"));
-  fs::touch(fs::join(dest, "user_output"));
-  fs::touch(fs::join(dest, "user_code"));
+  run_testcases(ctx, opts, [](int i, const TestcaseReport& report) {
+    if (i != 0) return;
+    printf("%s", fs::nread(report.stdout_path, TRUNC_LOG).c_str());
+    print_with_color(fs::nread(report.stderr_path, TRUNC_LOG), term::fg::RED);
+  });
 }
 
-static void run_custom_checker(j::object& result, const string& etc_dir, const string& cache_dir, const string& code_path, const string& checker_code_path, const map<string, string>& envs, const Testcase& testcase, const string& user_output_path) {
-  log_debug("run_custom_checker: %s %s", testcase.output_path.c_str(), user_output_path.c_str());
-
-  // prepare check environment
-  // to be compatible with legacy checkers:
-  // - a file named "output" is standard output
-  // - a file named argv[1] is user output file path
-  // - stdin is standard input
-
-
-  // extra lrun args
-  LrunArgs lrun_args;
-
-  lrun_args.append("--bindfs-ro", "$chroot/tmp/input", get_full_path(testcase.input_path));
-  lrun_args.append("--bindfs-ro", "$chroot/tmp/output", get_full_path(testcase.output_path));
-  lrun_args.append("--bindfs-ro", "$chroot/tmp/user_output", get_full_path(user_output_path));
-  lrun_args.append("--bindfs-ro", "$chroot/tmp/user_code", get_full_path(code_path));
+// one request per line. responses are written as soon as they are in order
+static void run_batch(const Options& opts, const Testcase& default_case) {
+  Options defaults = opts;
+  defaults.pretty_print = false;  // one response per line
 
-  for (__typeof(envs.begin()) it = envs.begin(); it != envs.end(); ++it) {
-      lrun_args.append("--env", it->first, it->second);
-  }
-
-  // run checker
-  string checker_output;
-  LrunResult lrun_result;
-  {
-    string output_path = get_temp_file_path(cache_dir, "checker-out");
-    // should flock output_path, but since we use different tmp path, and it is scoped in pid dir. no more necessary
-    // the checker needs argv[1], which is "user_output"
-    vector<string> checker_argv;
-    checker_argv.push_back("user_output");
-
-    // dest must be the same as the dest used for compile_code
-    string dest = get_code_work_dir(fs::join(cache_dir, SUBDIR_CHECKER), checker_code_path);
-    lrun_result = run_code(etc_dir, cache_dir, dest, checker_code_path, testcase.checker_limit, testcase.input_path, output_path, DEV_NULL /* stderr */, lrun_args, ENV_CHECK, checker_argv);
-    checker_output = fs::nread(output_path, TRUNC_LOG);
-  }
-
-  string status = TestcaseResult::INTERNAL_ERROR;
-  string error_message;
-  static const int CHECKER_EXITCODE_ACCEPTED = 0;
-  static const int CHECKER_EXITCODE_WRONG_ANSWER = 1;
-  static const int CHECKER_EXITCODE_PRESENTATION_ERROR = 2;
-  // In most unix systems exit code is limited to 8 bits, -1 becomes 255
-  static const int LEGACY_CHECKER_EXITCODE_WRONG_ANSWER = 255;
-
-  if (!lrun_result.error.empty()) {
-    error_message = "lrun internal error: " + lrun_result.error;
-  } else if (!lrun_result.exceed.empty()) {
-    error_message = "checker exceeded " + lrun_result.exceed + " limit";
-  } else if (lrun_result.signaled) {
-    error_message = format("checker was killed by signal %d", lrun_result.term_sig);
-  } else if (lrun_result.exit_code == CHECKER_EXITCODE_ACCEPTED) {
-    status = TestcaseResult::ACCEPTED;
-  } else if (lrun_result.exit_code == CHECKER_EXITCODE_WRONG_ANSWER || lrun_result.exit_code == LEGACY_CHECKER_EXITCODE_WRONG_ANSWER) {
-    status = TestcaseResult::WRONG_ANSWER;
-  } else if (lrun_result.exit_code == CHECKER_EXITCODE_PRESENTATION_ERROR) {
-    status = TestcaseResult::PRESENTATION_ERROR;
-  } else {
-    error_message = format("unknown checker exit code %d", lrun_result.exit_code);
-  }
-
-  if (!checker_output.empty()) result["checkerOutput"] = j::value(checker_output);
-
-  if (!error_message.empty()) result["error"] = j::value(error_message);
-  result["result"] = j::value(status);
+  char *line = NULL;
+  size_t line_size = 0;
+  judge_batch(opts.nthread, true /* ordered */, [&](long, Options& request_opts, string& error) {
+    for (;;) {
+      ssize_t line_len = getline(&line, &line_size, stdin);
+      if (line_len == -1) return false;
+      string request = string_chomp(string(line, line_len));
+      if (request.find_first_not_of(" \t\r") == string::npos) continue;  // skip empty lines
+      request_opts = defaults;
+      prepare_request(request, request_opts, default_case, error);
+      return true;
+    }
+  }, [](long, const string& response) {
+    fwrite(response.data(), 1, response.length(), stdout);
+    fflush(stdout);
+  });
+  if (line) free(line);
 }
 
-static j::object run_testcase(const string& etc_dir, const string& cache_dir, const string& code_path, const string& checker_code_path, const map<string, string>& envs, const Testcase& testcase, bool skip_checker = false, bool keep_stdout = false, bool keep_stderr = false) {
-  log_debug("run_testcase: %s", testcase.input_path.c_str());
-
-  // assume user code and checker code are pre-compiled
-  j::object result;
-
-  // prepare output file path
-  string stdout_path = testcase.user_stdout_path.empty() ? get_temp_file_path(cache_dir, "out") : testcase.user_stdout_path;
-  string stderr_path = testcase.user_stderr_path.empty() ? (keep_stderr ? get_temp_file_path(cache_dir, "err") : DEV_NULL) : testcase.user_stderr_path;
-  LrunResult run_result;
-  do {
-    // should flock stdout_path, but since we use different tmp path, and it is scoped in pid dir. no more necessary
-    // dest must be the same with dest used in compile_code
-    string dest = get_code_work_dir(get_process_tmp_dir(cache_dir), code_path);
-    run_result = run_code(etc_dir, cache_dir, dest, code_path, testcase.runtime_limit, testcase.input_path, stdout_path, stderr_path, vector<string>() /* extra_lrun_args */, ENV_RUN /* env */);
-
-    // write stdout, stderr
-    if (keep_stdout) result["stdout"] = j::value(fs::nread(stdout_path, TRUNC_LOG));
-    if (keep_stderr) result["stderr"] = j::value(fs::nread(stderr_path, TRUNC_LOG));
-
-    // check lrun internal error
-    if (!run_result.error.empty()) {
-      result["result"] = j::value(TestcaseResult::INTERNAL_ERROR);
-      result["error"] = j::value(run_result.error);
-      break;
-    }
-
-    // check limits
-    if (!run_result.exceed.empty()) {
-      const string& exceed = run_result.exceed;
-      if (exceed == "CPU_TIME" || exceed == "REAL_TIME") {
-        result["result"] = j::value(TestcaseResult::TIME_LIMIT_EXCEEDED);
-      } else if (exceed == "MEMORY") {
-        result["result"] = j::value(TestcaseResult::MEMORY_LIMIT_EXCEEDED);
-      } else if (exceed == "OUTPUT") {
-        result["result"] = j::value(TestcaseResult::OUTPUT_LIMIT_EXCEEDED);
-      }
-      result["exceed"] = j::value(exceed);
-      break;
-    }
+int main(int argc, char const *argv[]) {
+  if (argc == 1) print_usage();
 
-    // write memory, cpu_time
-    result["time"] = j::value(run_result.cpu_time);
-    result["memory"] = j::value((double)run_result.memory);
-
-    // check signaled and exit code
-    if (run_result.signaled) {
-      // check known signals
-      int termsig = run_result.term_sig;
-      result["termsig"] = j::value((double)termsig);
-      if (termsig == SIGFPE) {
-        result["result"] = j::value(TestcaseResult::FLOAT_POINT_EXCEPTION);
-      } else if (termsig == SIGSEGV) {
-        result["result"] = j::value(TestcaseResult::SEGMENTATION_FAULT);
+  Testcase default_case;
+  Options opts = parse_cli_options(argc, argv, default_case);
+  CacheBudget cache_budget = { opts.cache_size, opts.cache_entries };
+  set_data_cache_size(opts.test_data_cache);
+  if (opts.batch_mode || !opts.spool_dir.empty() || !opts.worker_address.empty()) {
+    start_garbage_collector(opts.cache_dir, cache_budget);
+    // a single judgment would exit before it pays off
+    set_lock_budget(opts.lock_test_data);
+  }
+  if (opts.batch_mode) {
+    run_batch(opts, default_case);
+    spawn_garbage_collector(opts.cache_dir, cache_budget);
+    return 0;
+  }
+  if (!opts.spool_dir.empty() || !opts.worker_address.empty()) {
+    try {
+      if (!opts.spool_dir.empty()) {
+        judge_spool(opts.spool_dir, opts.nthread, opts, default_case);
       } else {
-        result["result"] = j::value(TestcaseResult::RUNTIME_ERROR);
+        serve_worker(opts.worker_address, opts.nthread, opts, default_case);
       }
-      break;
-    } else if (run_result.exit_code != 0) {
-      int exitcode = run_result.exit_code;
-      result["exitcode"] = j::value((double)exitcode);
-      result["result"] = j::value(TestcaseResult::NON_ZERO_EXIT_CODE);
-      break;
+    } catch (const JudgeError& ex) {
+      fprintf(stderr, "%s\n", ex.what());
+      return 1;
     }
+    return 0;
+  }
+  check_options(opts);
 
-    if (skip_checker) {
-      // just accept it
-      result["result"] = j::value(TestcaseResult::ACCEPTED);
-    } else {
-      // run checker
-      if (checker_code_path.empty()) {
-        run_standard_checker(result, testcase, stdout_path);
+  int exit_code = 0;
+  {
+    Context ctx(opts.cache_dir);
+    try {
+      if (opts.direct_mode) {
+        CompileResult compile_result, checker_compile_result;
+        bool compiled = precompile(ctx, opts, compile_result, checker_compile_result);
+        print_direct_result(ctx, opts, compile_result, compiled);
       } else {
-        run_custom_checker(result, etc_dir, cache_dir, code_path, checker_code_path, envs, testcase, stdout_path);
-      }
-    }
-  } while (false);
-
-  return result;
-}
-
-static j::value run_testcases(const Options& opts) {
-  log_debug("nthread = %u", opts.nthread);
-#ifdef _OPENMP
-  if (opts.nthread > 0) omp_set_num_threads(opts.nthread);
-#endif
-
-  vector<j::value> results;
-  results.resize(opts.cases.size());
-  if (opts.skip_on_first_failure) {
-    for (int i = 0; i < (int)opts.cases.size(); ++i) {
-      j::object testcase_result = run_testcase(opts.etc_dir, opts.cache_dir, opts.user_code_path, opts.checker_code_path, opts.envs, opts.cases[i], opts.skip_checker, opts.keep_stdout, opts.keep_stderr);
-      results[i] = j::value(testcase_result);
-      if (testcase_result["result"].to_str() != TestcaseResult::ACCEPTED) {
-        j::object skipped_result;
-        skipped_result["result"] = j::value(TestcaseResult::SKIPPED);
-        for (int j = i + 1; j < (int)opts.cases.size(); ++j) {
-          results[j] = j::value(skipped_result);
+        JsonWriter json_writer(stdout, opts.pretty_print);
+        CborWriter cbor_writer(stdout);
+        ResponseWriter& writer = (opts.format == FORMAT_CBOR) ? (ResponseWriter&)cbor_writer : (ResponseWriter&)json_writer;
+        if (opts.nodes.empty()) {
+          judge(ctx, opts, writer);
+        } else {
+          judge_distributed(ctx, opts, writer);
         }
-        break;
       }
+    } catch (const JudgeError& ex) {
+      fprintf(stderr, "%s\n", ex.what());
+      exit_code = 1;
     }
-  } else {
-#ifdef _OPENMP
-    #pragma omp parallel for if (opts.nthread != 1 && opts.cases.size() > 1)
-#endif
-    for (int i = 0; i < (int)opts.cases.size(); ++i) {
-      j::object testcase_result = run_testcase(opts.etc_dir, opts.cache_dir, opts.user_code_path, opts.checker_code_path, opts.envs, opts.cases[i], opts.skip_checker, opts.keep_stdout, opts.keep_stderr);
-      results[i] = j::value(testcase_result);
-    }
-  }
-  return j::value(results);
-}
-
-static void print_with_color(const string& content, int color, FILE *fp = stderr) {
-  if (content.empty()) return;
-
-  term::set(term::attr::RESET, color, fp);
-  fprintf(fp, "%s", content.c_str());
-  if (content[content.length() - 1] != '\n') fprintf(fp, "\n");
-  term::set(term::attr::RESET, fp);
-}
-
-static void print_final_result(const Options& opts, const j::value& jv) {
-  if (opts.direct_mode) {
-    // not checking all "contains()" here because direct-mode is not that serious
-    string compiler_log = jv.get("compilation").get("log").to_str();
-    print_with_color(compiler_log, term::fg::YELLOW);
-
-    if (jv.contains("testcases")) {
-      const auto& test_result = jv.get("testcases").get(0);
-      printf("%s", test_result.get("stdout").to_str().c_str());
-      print_with_color(test_result.get("stderr").to_str(), term::fg::RED);
-    }
-  } else {
-    printf("%s", jv.serialize(opts.pretty_print).c_str());
-  }
-}
-
-int main(int argc, char const *argv[]) {
-  if (argc == 1) print_usage();
-
-  Options opts = parse_cli_options(argc, argv);
-  check_options(opts);
-
-  j::object jo;
-  bool compiled = true;
-
-  // time(0) is only accurate to seconds, which is not enough, add some pid randomness
-  srand((time(0) << 4) | getpid());
-
-  { // precompile user code
-    string dest = get_code_work_dir(get_process_tmp_dir(opts.cache_dir), opts.user_code_path);
-    CompileResult compile_result = compile_code(opts.etc_dir, opts.cache_dir, dest, opts.user_code_path, opts.compiler_limit);
-    write_compile_result(jo, compile_result, "compilation");
-    if (!compile_result.success) compiled = false;
-  }
-
-  if (compiled && !opts.checker_code_path.empty()) { // precompile checker code
-    string dest = get_code_work_dir(fs::join(opts.cache_dir, SUBDIR_CHECKER), opts.checker_code_path);
-    CompileResult compile_result = compile_code(opts.etc_dir, opts.cache_dir, dest, opts.checker_code_path, opts.compiler_limit);
-    write_compile_result(jo, compile_result, "checkerCompilation");
-    if (!compile_result.success) compiled = false;
-    prepare_checker_mount_bind_files(dest);
-  }
-
-  if (compiled) {
-    j::value results = run_testcases(opts);
-    jo["testcases"] = results;
   }
+  // the tmp dir of ctx is in the trash now
+  spawn_garbage_collector(opts.cache_dir, cache_budget);
 
-  print_final_result(opts, j::value(jo));
-  cleanup_exit(0);
+  return exit_code;
 }
@@ -0,0 +1,56 @@
+#ifndef LJUDGE_H
+#define LJUDGE_H
+
+/*
+ * libljudge: judge submissions from another program, without running the
+ * ljudge binary.
+ *
+ * ljudge_judge is re-entrant. Several judgments can run in one process at
+ * the same time, from different threads. Besides files in the cache
+ * directory (shared like several ljudge processes do), they share what is
+ * meant to be per host: the debug level, the memory budget of running
+ * testcases (see --max-memory) and the controller of how many testcases
+ * run at once (see --max-jitter). Archive indexes and the test data cache
+ * are also process-wide.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* return values of ljudge_judge */
+#define LJUDGE_OK 0
+#define LJUDGE_ERROR_REQUEST 1   /* the request is malformed or invalid */
+#define LJUDGE_ERROR_INTERNAL 2  /* judging failed, ex. lrun or a config file is missing */
+
+/* kinds of data passed to the callback */
+#define LJUDGE_DATA_RESPONSE 0   /* a chunk of the response */
+#define LJUDGE_DATA_ERROR 1      /* a human readable error message */
+
+/*
+ * Receives the response (see schema/response.json), in chunks, as test
+ * cases finish. Error messages are passed once, before ljudge_judge
+ * returns an error. Called from the thread calling ljudge_judge, or from
+ * the threads running its testcases (see "threads" in the request), never
+ * by two threads at once for the same judgment.
+ */
+typedef void (*ljudge_callback)(int kind, const char *data, size_t size, void *userdata);
+
+/*
+ * Judge a submission. request is a JSON object, see schema/request.json.
+ * Return LJUDGE_OK or one of the LJUDGE_ERROR_* values.
+ */
+int ljudge_judge(const char *request, ljudge_callback callback, void *userdata);
+
+/* Logs are written to stderr. 0 (default) logs warnings, 10 logs everything. Process-wide. */
+void ljudge_set_debug_level(int level);
+
+const char *ljudge_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "fs.hpp"
+#include "pin.hpp"
+#include "slot.hpp"
+#include "utils.hpp"
+#include "deps/tinyformat/tinyformat.h"
+
+extern "C" {
+#include "deps/log.h/log.h"
+}
+
+using std::list;
+using std::map;
+using std::string;
+using std::vector;
+using tfm::format;
+
+#define SYS_CPU_DIR "/sys/devices/system/cpu"
+#define SYS_NODE_DIR "/sys/devices/system/node"
+
+// pages looked at to find where a file is cached
+static const int NODE_SAMPLE_PAGES = 16;
+
+struct CpuUnit {
+  int cpu;
+  int node;
+  vector<int> locked_cpus;  // cpu, and its siblings with "cores"
+};
+
+// cpu held by this thread, inherited by forked children
+static thread_local int pinned_cpu = -1;
+
+static int read_topology_number(int cpu, const char *name) {
+  string content = fs::nread(format(SYS_CPU_DIR "/cpu%d/topology/%s", cpu, name), 32);
+  return content.empty() ? -1 : atoi(content.c_str());
+}
+
+static int get_cpu_node(int cpu) {
+  list<string> entries = fs::scandir(format(SYS_CPU_DIR "/cpu%d", cpu));
+  for (__typeof(entries.begin()) it = entries.begin(); it != entries.end(); ++it) {
+    if (it->length() > 4 && it->compare(0, 4, "node") == 0) return atoi(it->c_str() + 4);
+  }
+  return -1;
+}
+
+// cpus of the cpuset. with "cores", one per physical core. with "threads",
+// first siblings of all cores, then second siblings, etc.
+static vector<CpuUnit> discover_units(const string& mode) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) return vector<CpuUnit>();
+
+  map<std::pair<int, int>, vector<int> > cores;  // (package, core) -> cpus
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &set)) continue;
+    std::pair<int, int> core(read_topology_number(cpu, "physical_package_id"), read_topology_number(cpu, "core_id"));
+    // without topology every cpu is its own core
+    if (core.second < 0) core.second = 1000000 + cpu;
+    vector<int>& cpus = cores[core];
+    cpus.push_back(cpu);
+  }
+
+  vector<std::pair<int, CpuUnit> > ranked;  // (sibling index, unit)
+  for (__typeof(cores.begin()) it = cores.begin(); it != cores.end(); ++it) {
+    const vector<int>& cpus = it->second;
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      if (mode == PIN_CPUS_CORES && i > 0) break;
+      CpuUnit unit;
+      unit.cpu = cpus[i];
+      unit.node = get_cpu_node(cpus[i]);
+      // a core is owned with its siblings, so "threads" users elsewhere keep off it
+      unit.locked_cpus = mode == PIN_CPUS_CORES ? cpus : vector<int>(1, cpus[i]);
+      ranked.push_back(std::make_pair((int)i, unit));
+    }
+  }
+  std::stable_sort(ranked.begin(), ranked.end(), [](const std::pair<int, CpuUnit>& a, const std::pair<int, CpuUnit>& b) {
+    return a.first < b.first || (a.first == b.first && a.second.cpu < b.second.cpu);
+  });
+
+  vector<CpuUnit> units;
+  for (size_t i = 0; i < ranked.size(); ++i) units.push_back(ranked[i].second);
+  return units;
+}
+
+static const vector<CpuUnit>& get_units(const string& mode) {
+  static std::mutex mutex;
+  static map<string, vector<CpuUnit> > units_by_mode;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!units_by_mode.count(mode)) {
+    units_by_mode[mode] = discover_units(mode);
+    log_debug("pin-cpus %s: %d cpus", mode.c_str(), (int)units_by_mode[mode].size());
+  }
+  return units_by_mode[mode];
+}
+
+// flocks of all cpus of the unit, or none
+static bool try_lock_unit(const string& dir, const CpuUnit& unit, vector<int>& fds) {
+  for (size_t i = 0; i < unit.locked_cpus.size(); ++i) {
+    int fd = try_lock_file(fs::join(dir, format("%d", unit.locked_cpus[i])));
+    if (fd < 0) {
+      for (size_t j = 0; j < fds.size(); ++j) close(fds[j]);
+      fds.clear();
+      return false;
+    }
+    fds.push_back(fd);
+  }
+  return true;
+}
+
+ScopedCpu::ScopedCpu(const string& dir, const string& mode, int preferred_node) {
+  if (mode.empty()) return;
+  const vector<CpuUnit>& units = get_units(mode);
+  if (units.empty()) return;
+  if (fs::mkdir_p(dir, 0777) < 0) {
+    log_warn("cannot mkdir %s, not pinning", dir.c_str());
+    return;
+  }
+
+  // cpus on the preferred node first
+  vector<const CpuUnit*> candidates;
+  for (size_t i = 0; i < units.size(); ++i) if (units[i].node == preferred_node) candidates.push_back(&units[i]);
+  for (size_t i = 0; i < units.size(); ++i) if (units[i].node != preferred_node) candidates.push_back(&units[i]);
+
+  const CpuUnit *unit = NULL;
+  double waited = wait_until_locked([this, &dir, &candidates, &unit]() {
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      if (!try_lock_unit(dir, *candidates[i], fds_)) continue;
+      unit = candidates[i];
+      return true;
+    }
+    return false;
+  });
+  pinned_cpu = unit->cpu;
+  log_debug("pinned to cpu %d (node %d, preferred %d, waited %.3fs)", pinned_cpu, unit->node, preferred_node, waited);
+}
+
+ScopedCpu::~ScopedCpu() {
+  if (fds_.empty()) return;
+  pinned_cpu = -1;
+  for (size_t i = 0; i < fds_.size(); ++i) close(fds_[i]);
+}
+
+void pin_current_process() {
+  if (pinned_cpu < 0) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(pinned_cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+int get_page_cache_node(const string& path) {
+  // single node machines are common. do not bother
+  if (!fs::exists(SYS_NODE_DIR "/node1")) return -1;
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t npage = (st.st_size + page_size - 1) / page_size;
+  void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return -1;
+
+  vector<unsigned char> resident(npage);
+  mincore(addr, st.st_size, &resident[0]);
+
+  // ask the kernel where cached pages are. only resident pages are touched,
+  // so nothing is read from disk here
+  vector<void*> pages;
+  size_t step = std::max((size_t)1, npage / NODE_SAMPLE_PAGES);
+  for (size_t i = 0; i < npage && pages.size() < (size_t)NODE_SAMPLE_PAGES; i += step) {
+    if (!(resident[i] & 1)) continue;
+    char *page = (char *)addr + i * page_size;
+    *(volatile char *)page;
+    pages.push_back(page);
+  }
+  map<int, int> votes;
+  if (!pages.empty()) {
+    vector<int> status(pages.size(), -1);
+    if (syscall(SYS_move_pages, 0, pages.size(), &pages[0], NULL, &status[0], 0) == 0) {
+      for (size_t i = 0; i < status.size(); ++i) if (status[i] >= 0) ++votes[status[i]];
+    }
+  }
+  munmap(addr, st.st_size);
+
+  int node = -1, best = 0;
+  for (__typeof(votes.begin()) it = votes.begin(); it != votes.end(); ++it) {
+    if (it->second > best) {
+      best = it->second;
+      node = it->first;
+    }
+  }
+  return node;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// --pin-cpus modes
+#define PIN_CPUS_CORES "cores"  // a testcase owns a physical core. its SMT siblings stay idle
+#define PIN_CPUS_THREADS "threads"  // a testcase owns a logical cpu. all cores are used before siblings
+
+// Holds a cpu while a testcase runs. lrun started by the same thread
+// meanwhile is restricted to that cpu. Cpus are owned host-wide: dir holds a
+// lock file per cpu (see slot.hpp), so ljudge processes sharing it never
+// pin two testcases to one cpu. With "cores", the locks of all siblings of
+// the core are held. There are no more pinned testcases at once than cpus
+// (or cores) in the cpuset.
+class ScopedCpu {
+  public:
+    // blocks until a cpu is free. prefers cpus on numa node preferred_node
+    // (-1: any). does nothing if mode is empty
+    ScopedCpu(const std::string& dir, const std::string& mode, int preferred_node = -1);
+    ~ScopedCpu();
+  private:
+    ScopedCpu(const ScopedCpu&);
+    ScopedCpu& operator=(const ScopedCpu&);
+    std::vector<int> fds_;  // flocks of the cpus held
+};
+
+// restrict the calling process to the cpu held by the calling thread, if
+// any. called in a forked child before exec
+void pin_current_process();
+
+// the numa node holding most (sampled) pages of the file in page cache.
+// -1 if unknown, not cached, or there is only one node
+int get_page_cache_node(const std::string& path);
@@ -0,0 +1,225 @@
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include "archive.hpp"
+#include "prefetch.hpp"
+#include "deps/tinyformat/tinyformat.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+extern "C" {
+#include "deps/log.h/log.h"
+}
+
+using std::string;
+using tfm::format;
+
+static std::atomic<long> prefetch_hits(0);
+static std::atomic<long> prefetch_misses(0);
+static std::atomic<long> prefetch_files(0);
+static std::atomic<long long> prefetch_bytes(0);
+static std::atomic<long long> prefetch_nanoseconds(0);
+
+// a page aligned mapping of a range of a file
+struct Mapping {
+  void *addr;
+  size_t size;
+};
+
+static bool map_range(int fd, unsigned long long offset, unsigned long long length, Mapping& mapping) {
+  if (length == 0) return false;
+  unsigned long long start = offset - offset % sysconf(_SC_PAGESIZE);
+  mapping.size = length + (offset - start);
+  mapping.addr = mmap(NULL, mapping.size, PROT_READ, MAP_SHARED, fd, start);
+  return mapping.addr != MAP_FAILED;
+}
+
+// data locked by run_locker, by "dev:ino:offset"
+struct LockedData {
+  string file;
+  Mapping mapping;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+};
+
+struct LockRequest {
+  string file;
+  unsigned long long offset;
+  unsigned long long length;
+};
+
+static std::mutex locked_mutex;
+static std::deque<LockRequest> lock_requests;
+static bool locker_running = false;
+static long long lock_budget = 0;
+static std::map<string, LockedData> locked_data;
+static long long locked_bytes = 0;
+
+static void unlock_data(std::map<string, LockedData>::iterator it) {
+  munmap(it->second.mapping.addr, it->second.mapping.size);
+  locked_bytes -= it->second.mapping.size;
+  locked_data.erase(it);
+}
+
+static bool is_unchanged(const LockedData& data, const struct stat& st) {
+  return data.dev == st.st_dev && data.ino == st.st_ino && data.size == st.st_size && data.mtime.tv_sec == st.st_mtim.tv_sec && data.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+// unlock data whose file was deleted, replaced or changed since
+static void sweep_locked_data() {
+  for (__typeof(locked_data.begin()) it = locked_data.begin(); it != locked_data.end(); ) {
+    __typeof(it) next = it;
+    ++next;
+    struct stat st;
+    if (stat(it->second.file.c_str(), &st) != 0 || !is_unchanged(it->second, st)) {
+      log_debug("unlocking %s, it changed", it->second.file.c_str());
+      unlock_data(it);
+    }
+    it = next;
+  }
+}
+
+// called by run_locker only, without holding locked_mutex
+static void lock_data(const LockRequest& request) {
+  int fd = open(request.file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  struct stat st;
+  LockedData data;
+  string key;
+  if (fstat(fd, &st) == 0) {
+    key = format("%lu:%lu:%llu", (unsigned long)st.st_dev, (unsigned long)st.st_ino, request.offset);
+    std::lock_guard<std::mutex> lock(locked_mutex);
+    __typeof(locked_data.begin()) it = locked_data.find(key);
+    if (it != locked_data.end() && is_unchanged(it->second, st)) key.clear();
+    if (it != locked_data.end() && !key.empty()) unlock_data(it);
+    if (locked_bytes + (long long)request.length > lock_budget) key.clear();
+  }
+  bool mapped = !key.empty() && map_range(fd, request.offset, request.length, data.mapping);
+  close(fd);
+  if (!mapped) return;
+  // faults the whole range in, which is why it is done here
+  if (mlock(data.mapping.addr, data.mapping.size) != 0) {
+    // usually RLIMIT_MEMLOCK
+    log_debug("cannot mlock %llu bytes: %s", request.length, strerror(errno));
+    munmap(data.mapping.addr, data.mapping.size);
+    return;
+  }
+  data.file = request.file;
+  data.dev = st.st_dev;
+  data.ino = st.st_ino;
+  data.mtime = st.st_mtim;
+  data.size = st.st_size;
+  std::lock_guard<std::mutex> lock(locked_mutex);
+  locked_data[key] = data;
+  locked_bytes += data.mapping.size;
+}
+
+// lock requested data, then exit. at most one runs
+static void run_locker() {
+  std::unique_lock<std::mutex> lock(locked_mutex);
+  // about once per prefetch round. files can be deleted or replaced between submissions
+  sweep_locked_data();
+  while (!lock_requests.empty()) {
+    LockRequest request = lock_requests.front();
+    lock_requests.pop_front();
+    lock.unlock();
+    lock_data(request);
+    lock.lock();
+  }
+  locker_running = false;
+}
+
+static void request_lock(const string& file, unsigned long long offset, unsigned long long length) {
+  std::lock_guard<std::mutex> lock(locked_mutex);
+  if (lock_budget <= 0) return;
+  LockRequest request = { file, offset, length };
+  lock_requests.push_back(request);
+  if (!locker_running) {
+    locker_running = true;
+    std::thread(run_locker).detach();
+  }
+}
+
+void set_lock_budget(long long bytes) {
+  std::lock_guard<std::mutex> lock(locked_mutex);
+  lock_budget = bytes;
+}
+
+static double monotonic_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void prefetch_data_file(const string& path) {
+  double start = monotonic_seconds();
+  string file;
+  unsigned long long offset, length;
+  if (!get_data_file_range(path, file, offset, length)) return;
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+  close(fd);
+  request_lock(file, offset, length);
+  ++prefetch_files;
+  prefetch_bytes += length;
+  prefetch_nanoseconds += (long long)((monotonic_seconds() - start) * 1e9);
+}
+
+// whether all pages of the data of path are in the page cache. true if it
+// is not a file (ex. /dev/null), there is nothing to read from disk
+static bool is_cached(const string& path) {
+  string file;
+  unsigned long long offset, length;
+  if (!get_data_file_range(path, file, offset, length)) return true;
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  Mapping mapping;
+  bool mapped = map_range(fd, offset, length, mapping);
+  close(fd);
+  // empty
+  if (!mapped) return length == 0;
+  long page_size = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> resident((mapping.size + page_size - 1) / page_size);
+  bool cached = mincore(mapping.addr, mapping.size, &resident[0]) == 0;
+  for (size_t i = 0; cached && i < resident.size(); ++i) {
+    if (!(resident[i] & 1)) cached = false;
+  }
+  munmap(mapping.addr, mapping.size);
+  return cached;
+}
+
+void count_prefetch_hit(const string& input_path, const string& output_path) {
+  bool cached = (input_path.empty() || is_cached(input_path)) && (output_path.empty() || is_cached(output_path));
+  if (cached) {
+    ++prefetch_hits;
+  } else {
+    ++prefetch_misses;
+  }
+}
+
+PrefetchStats get_prefetch_stats() {
+  PrefetchStats stats;
+  stats.hits = prefetch_hits;
+  stats.misses = prefetch_misses;
+  stats.files = prefetch_files;
+  stats.bytes = prefetch_bytes;
+  stats.seconds = prefetch_nanoseconds / 1e9;
+  std::lock_guard<std::mutex> lock(locked_mutex);
+  stats.locked_bytes = locked_bytes;
+  return stats;
+}
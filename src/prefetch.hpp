@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+// Test data of the next testcases is read into the page cache while earlier
+// ones run (and while code compiles), so a cold page cache is not paid for
+// inside the real time limit of a testcase. Reading is left to the kernel
+// (posix_fadvise WILLNEED) and locking to a background thread, nothing
+// waits for them.
+
+struct PrefetchStats {
+  long hits;  // testcases whose test data was all in the page cache when they started
+  long misses;
+  long files;  // prefetched
+  long long bytes;
+  double seconds;  // spent asking the kernel to read them
+  long long locked_bytes;  // see set_lock_budget
+};
+
+// start reading the data of path (a file, an archive entry, a compressed
+// file) into the page cache, and locking it if set_lock_budget was called
+void prefetch_data_file(const std::string& path);
+
+// prefetched data is also locked in memory (mlock) while the process has
+// less than bytes locked. 0 (default): nothing is locked. locked data stays
+// until its file is deleted, replaced or changed, which is checked on every
+// prefetch. for long-running processes
+void set_lock_budget(long long bytes);
+
+// count a hit if the data of path is in the page cache now. empty paths
+// are skipped
+void count_prefetch_hit(const std::string& input_path, const std::string& output_path);
+
+PrefetchStats get_prefetch_stats();
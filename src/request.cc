@@ -0,0 +1,200 @@
+#include "archive.hpp"
+#include "request.hpp"
+#include "utils.hpp"
+#include "deps/picojson/picojson.h"
+#include "deps/tinyformat/tinyformat.h"
+
+using tfm::format;
+namespace j = picojson;
+
+// picojson's default context appends a temporary value() for every array
+// item, which gcc warns about (-Wmaybe-uninitialized). construct it in place
+struct JsonParseContext : public j::default_parse_context {
+  JsonParseContext(j::value *out) : j::default_parse_context(out) {}
+  template <typename Iter> bool parse_array_item(j::input<Iter>& in, size_t) {
+    j::array& a = out_->get<j::array>();
+    a.resize(a.size() + 1);
+    JsonParseContext ctx(&a.back());
+    return j::_parse(ctx, in);
+  }
+  template <typename Iter> bool parse_object_item(j::input<Iter>& in, const string& key) {
+    j::object& o = out_->get<j::object>();
+    JsonParseContext ctx(&o[key]);
+    return j::_parse(ctx, in);
+  }
+};
+
+bool parse_json(const string& text, j::value& value, string& error) {
+  JsonParseContext ctx(&value);
+  error.clear();
+  j::_parse(ctx, text.begin(), text.end(), &error);
+  return error.empty();
+}
+
+static void read_string(const j::object& jo, const char *key, string& value, vector<string>& errors) {
+  j::object::const_iterator it = jo.find(key);
+  if (it == jo.end()) return;
+  if (!it->second.is<string>()) {
+    errors.push_back(format("'%s' must be a string", key));
+    return;
+  }
+  value = it->second.get<string>();
+}
+
+static void read_bool(const j::object& jo, const char *key, bool& value, vector<string>& errors) {
+  j::object::const_iterator it = jo.find(key);
+  if (it == jo.end()) return;
+  if (!it->second.is<bool>()) {
+    errors.push_back(format("'%s' must be a boolean", key));
+    return;
+  }
+  value = it->second.get<bool>();
+}
+
+template<typename T>
+static void read_number(const j::object& jo, const char *key, T& value, vector<string>& errors) {
+  j::object::const_iterator it = jo.find(key);
+  if (it == jo.end()) return;
+  if (!it->second.is<double>()) {
+    errors.push_back(format("'%s' must be a number", key));
+    return;
+  }
+  value = (T)it->second.get<double>();
+}
+
+// bytes can also be strings like "64m", same as the command line
+static void read_bytes(const j::object& jo, const char *key, long long& value, vector<string>& errors) {
+  j::object::const_iterator it = jo.find(key);
+  if (it == jo.end()) return;
+  if (it->second.is<string>()) {
+    value = parse_bytes(it->second.get<string>());
+  } else {
+    read_number(jo, key, value, errors);
+  }
+}
+
+static void read_limit(const j::object& jo, const char *key, Limit& limit, vector<string>& errors) {
+  j::object::const_iterator it = jo.find(key);
+  if (it == jo.end()) return;
+  if (!it->second.is<j::object>()) {
+    errors.push_back(format("'%s' must be an object", key));
+    return;
+  }
+  const j::object& jl = it->second.get<j::object>();
+  read_number(jl, "cpuTime", limit.cpu_time, errors);
+  read_number(jl, "realTime", limit.real_time, errors);
+  read_bytes(jl, "memory", limit.memory, errors);
+  read_bytes(jl, "output", limit.output, errors);
+  read_bytes(jl, "stack", limit.stack, errors);
+}
+
+// file descriptors of this process are not for requests
+static void read_data_path(const j::object& jo, const char *key, string& value, vector<string>& errors) {
+  int fd;
+  read_string(jo, key, value, errors);
+  if (parse_fd_ref(value, fd)) errors.push_back(format("'%s' cannot be a file descriptor", key));
+}
+
+static void read_testcase(const j::object& jo, Testcase& testcase, vector<string>& errors) {
+  read_data_path(jo, "input", testcase.input_path, errors);
+  read_data_path(jo, "output", testcase.output_path, errors);
+  read_string(jo, "userStdout", testcase.user_stdout_path, errors);
+  read_string(jo, "userStderr", testcase.user_stderr_path, errors);
+  string sha1s;
+  read_string(jo, "outputSha1", sha1s, errors);
+  if (!sha1s.empty()) {
+    // ac-sha1(chomp),pe-sha1
+    testcase.output_sha1 = sha1s.substr(0, 40);
+    if (sha1s.length() > 41) testcase.output_pe_sha1 = sha1s.substr(41, 40);
+  }
+  read_limit(jo, "limit", testcase.runtime_limit, errors);
+  read_limit(jo, "checkerLimit", testcase.checker_limit, errors);
+}
+
+bool parse_request(const string& request, Options& options, const Testcase& request_default_case, string& error) {
+  j::value jv;
+  if (!parse_json(request, jv, error)) return false;
+  if (!jv.is<j::object>()) {
+    error = "request must be an object";
+    return false;
+  }
+
+  vector<string> errors;
+  const j::object& jo = jv.get<j::object>();
+  Testcase default_case = request_default_case;
+
+  read_string(jo, "etcDir", options.etc_dir, errors);
+  read_string(jo, "cacheDir", options.cache_dir, errors);
+  read_string(jo, "userCode", options.user_code_path, errors);
+  read_string(jo, "checkerCode", options.checker_code_path, errors);
+  read_string(jo, "format", options.format, errors);
+  read_bool(jo, "prettyPrint", options.pretty_print, errors);
+  read_bool(jo, "skipChecker", options.skip_checker, errors);
+  read_bool(jo, "keepStdout", options.keep_stdout, errors);
+  read_bool(jo, "keepStderr", options.keep_stderr, errors);
+  read_bool(jo, "skipOnFirstFailure", options.skip_on_first_failure, errors);
+  read_number(jo, "threads", options.nthread, errors);
+  read_number(jo, "maxTotalCpuTime", options.max_total_cpu_time, errors);
+  read_number(jo, "maxTotalRealTime", options.max_total_real_time, errors);
+  read_limit(jo, "compilerLimit", options.compiler_limit, errors);
+  read_limit(jo, "limit", default_case.runtime_limit, errors);
+  read_limit(jo, "checkerLimit", default_case.checker_limit, errors);
+  if (options.skip_checker) options.keep_stdout = true;
+  if (options.skip_on_first_failure) options.nthread = 1;
+
+  if (jo.count("envs")) {
+    const j::value& envs = jo.find("envs")->second;
+    if (!envs.is<j::object>()) {
+      errors.push_back("'envs' must be an object");
+    } else {
+      const j::object& je = envs.get<j::object>();
+      for (j::object::const_iterator it = je.begin(); it != je.end(); ++it) {
+        options.envs[it->first] = it->second.to_str();
+      }
+    }
+  }
+
+  if (jo.count("testcases")) {
+    const j::value& testcases = jo.find("testcases")->second;
+    if (!testcases.is<j::array>()) {
+      errors.push_back("'testcases' must be an array");
+    } else {
+      const j::array& ja = testcases.get<j::array>();
+      for (size_t i = 0; i < ja.size(); ++i) {
+        if (!ja[i].is<j::object>()) {
+          errors.push_back(format("testcases[%d] must be an object", (int)i));
+          continue;
+        }
+        Testcase testcase = default_case;
+        read_testcase(ja[i].get<j::object>(), testcase, errors);
+        options.cases.push_back(testcase);
+      }
+    }
+  }
+
+  // a request without testcases captures the output of the program with empty input
+  if (options.cases.empty() && options.skip_checker) {
+    Testcase testcase = default_case;
+    testcase.input_path = DEV_NULL;
+    options.cases.push_back(testcase);
+  }
+
+  for (size_t i = 0; i < errors.size(); ++i) {
+    if (!error.empty()) error += "\n";
+    error += errors[i];
+  }
+  return error.empty();
+}
+
+bool prepare_request(const string& request, Options& options, const Testcase& default_case, string& error) {
+  if (!parse_request(request, options, default_case, error)) return false;
+
+  vector<string> errors;
+  resolve_data_refs(options, errors);
+  if (errors.empty()) validate_options(options, errors);
+  for (size_t i = 0; i < errors.size(); ++i) {
+    if (i > 0) error += "\n";
+    error += errors[i];
+  }
+  return error.empty();
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include "judge.hpp"
+#include "deps/picojson/picojson.h"
+
+// parse a JSON text. false (with error) if it is malformed
+bool parse_json(const std::string& text, picojson::value& value, std::string& error);
+
+// Parse a judge request (see schema/request.json) into options. Fields
+// which are missing keep their values in options. Testcases start from
+// default_case. Return false and set error if the request is malformed.
+bool parse_request(const std::string& request, Options& options, const Testcase& default_case, std::string& error);
+// parse_request, then validate_options. errors are joined by "\n"
+bool prepare_request(const std::string& request, Options& options, const Testcase& default_case, std::string& error);
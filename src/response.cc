@@ -0,0 +1,317 @@
+#include "response.hpp"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using std::string;
+
+static const int INDENT_WIDTH = 2;
+
+// read at most TRUNC_LOG bytes. unlike fs::nread, '\0' does not end the content
+static string read_log(const string& path) {
+  string result;
+  if (path.empty()) return result;
+  FILE *fp = fopen(path.c_str(), "r");
+  if (!fp) return result;
+  result.resize(TRUNC_LOG);
+  size_t n = fread(&result[0], 1, TRUNC_LOG, fp);
+  result.resize(n);
+  fclose(fp);
+  return result;
+}
+
+JsonWriter::JsonWriter(FILE *fp, bool pretty) : fp_(fp), pretty_(pretty), after_key_(false) {
+}
+
+void JsonWriter::indent() {
+  putc('\n', fp_);
+  for (int i = 0; i < (int)counts_.size() * INDENT_WIDTH; ++i) putc(' ', fp_);
+}
+
+void JsonWriter::before_value() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (counts_.empty()) return;
+  if (counts_.back()++ > 0) putc(',', fp_);
+  if (pretty_) indent();
+}
+
+void JsonWriter::after_value() {
+  if (counts_.empty()) {
+    if (pretty_) putc('\n', fp_);
+    fflush(fp_);
+  }
+}
+
+void JsonWriter::begin_object(size_t) {
+  before_value();
+  putc('{', fp_);
+  counts_.push_back(0);
+}
+
+void JsonWriter::end_object() {
+  int count = counts_.back();
+  counts_.pop_back();
+  if (pretty_ && count > 0) indent();
+  putc('}', fp_);
+  after_value();
+}
+
+void JsonWriter::begin_array() {
+  before_value();
+  putc('[', fp_);
+  counts_.push_back(0);
+}
+
+void JsonWriter::end_array() {
+  int count = counts_.back();
+  counts_.pop_back();
+  if (pretty_ && count > 0) indent();
+  putc(']', fp_);
+  after_value();
+}
+
+void JsonWriter::write_key(const string& name) {
+  if (counts_.back()++ > 0) putc(',', fp_);
+  if (pretty_) indent();
+  write_escaped(name.data(), name.length());
+  putc(':', fp_);
+  if (pretty_) putc(' ', fp_);
+  after_key_ = true;
+}
+
+void JsonWriter::write_escaped(const char *data, size_t len) {
+  putc('"', fp_);
+  // write unescaped runs in one go, output can be large (--keep-stdout)
+  size_t run_start = 0;
+  for (size_t i = 0; i < len; ++i) {
+    char c = data[i];
+    const char *escaped = NULL;
+    char buf[7];
+    switch (c) {
+      case '"': escaped = "\\\""; break;
+      case '\\': escaped = "\\\\"; break;
+      case '/': escaped = "\\/"; break;
+      case '\b': escaped = "\\b"; break;
+      case '\f': escaped = "\\f"; break;
+      case '\n': escaped = "\\n"; break;
+      case '\r': escaped = "\\r"; break;
+      case '\t': escaped = "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+          snprintf(buf, sizeof(buf), "\\u%04x", c & 0xff);
+          escaped = buf;
+        }
+    }
+    if (!escaped) continue;
+    if (i > run_start) fwrite(data + run_start, 1, i - run_start, fp_);
+    fputs(escaped, fp_);
+    run_start = i + 1;
+  }
+  if (len > run_start) fwrite(data + run_start, 1, len - run_start, fp_);
+  putc('"', fp_);
+}
+
+void JsonWriter::write_string(const string& str) {
+  before_value();
+  write_escaped(str.data(), str.length());
+  after_value();
+}
+
+void JsonWriter::write_bytes(const string& bytes) {
+  write_string(bytes);
+}
+
+void JsonWriter::write_number(double number) {
+  before_value();
+  double tmp;
+  // same format as picojson
+  fprintf(fp_, fabs(number) < (1ULL << 53) && modf(number, &tmp) == 0 ? "%.f" : "%.4g", number);
+  after_value();
+}
+
+void JsonWriter::write_integer(long long number) {
+  write_number((double)number);
+}
+
+void JsonWriter::write_bool(bool value) {
+  before_value();
+  fputs(value ? "true" : "false", fp_);
+  after_value();
+}
+
+void JsonWriter::flush() {
+  fflush(fp_);
+}
+
+namespace CborType {
+  const int UNSIGNED = 0;
+  const int NEGATIVE = 1;
+  const int BYTES = 2;
+  const int TEXT = 3;
+  const int ARRAY = 4;
+  const int MAP = 5;
+  const int SIMPLE = 7;
+};
+
+static const int CBOR_FALSE = 0xf4;
+static const int CBOR_TRUE = 0xf5;
+static const int CBOR_FLOAT64 = 0xfb;
+static const int CBOR_INDEFINITE_ARRAY = 0x9f;
+static const int CBOR_BREAK = 0xff;
+
+CborWriter::CborWriter(FILE *fp) : fp_(fp), depth_(0) {
+}
+
+void CborWriter::write_head(int major_type, unsigned long long value) {
+  int type = major_type << 5;
+  if (value < 24) {
+    putc(type | (int)value, fp_);
+    return;
+  }
+  int nbytes;
+  if (value <= 0xff) {
+    putc(type | 24, fp_);
+    nbytes = 1;
+  } else if (value <= 0xffff) {
+    putc(type | 25, fp_);
+    nbytes = 2;
+  } else if (value <= 0xffffffffULL) {
+    putc(type | 26, fp_);
+    nbytes = 4;
+  } else {
+    putc(type | 27, fp_);
+    nbytes = 8;
+  }
+  // big endian
+  for (int i = nbytes - 1; i >= 0; --i) putc((int)((value >> (i * 8)) & 0xff), fp_);
+}
+
+void CborWriter::begin_object(size_t size) {
+  write_head(CborType::MAP, size);
+  ++depth_;
+}
+
+void CborWriter::end_object() {
+  if (--depth_ == 0) fflush(fp_);
+}
+
+void CborWriter::begin_array() {
+  putc(CBOR_INDEFINITE_ARRAY, fp_);
+  ++depth_;
+}
+
+void CborWriter::end_array() {
+  putc(CBOR_BREAK, fp_);
+  if (--depth_ == 0) fflush(fp_);
+}
+
+void CborWriter::write_key(const string& name) {
+  write_string(name);
+}
+
+void CborWriter::write_string(const string& str) {
+  write_head(CborType::TEXT, str.length());
+  fwrite(str.data(), 1, str.length(), fp_);
+}
+
+void CborWriter::write_bytes(const string& bytes) {
+  write_head(CborType::BYTES, bytes.length());
+  fwrite(bytes.data(), 1, bytes.length(), fp_);
+}
+
+void CborWriter::write_number(double number) {
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  putc(CBOR_FLOAT64, fp_);
+  for (int i = 7; i >= 0; --i) putc((int)((bits >> (i * 8)) & 0xff), fp_);
+}
+
+void CborWriter::write_integer(long long number) {
+  if (number >= 0) {
+    write_head(CborType::UNSIGNED, (unsigned long long)number);
+  } else {
+    write_head(CborType::NEGATIVE, (unsigned long long)(-1 - number));
+  }
+}
+
+void CborWriter::write_bool(bool value) {
+  putc(value ? CBOR_TRUE : CBOR_FALSE, fp_);
+}
+
+void CborWriter::flush() {
+  fflush(fp_);
+}
+
+void write_compile_result(ResponseWriter& writer, const CompileResult& compile_result) {
+  bool has_error = !compile_result.error.empty();
+  writer.begin_object(has_error ? 3 : 2);
+  if (has_error) {
+    writer.write_key("error");
+    writer.write_string(compile_result.error);
+  }
+  writer.write_key("log");
+  writer.write_string(compile_result.log);
+  writer.write_key("success");
+  writer.write_bool(compile_result.success);
+  writer.end_object();
+}
+
+void write_testcase_report(ResponseWriter& writer, const TestcaseReport& report) {
+  string checker_output = read_log(report.checker_output_path);
+  bool has_stdout = !report.stdout_path.empty();
+  bool has_stderr = !report.stderr_path.empty();
+
+  size_t size = 1 /* result */ + !checker_output.empty() + !report.error.empty() + !report.exceed.empty() \
+                + report.has_exitcode + report.has_usage * 2 + has_stderr + has_stdout + report.has_termsig + !report.times.empty();
+  writer.begin_object(size);
+  if (!checker_output.empty()) {
+    writer.write_key("checkerOutput");
+    writer.write_bytes(checker_output);
+  }
+  if (!report.error.empty()) {
+    writer.write_key("error");
+    writer.write_string(report.error);
+  }
+  if (!report.exceed.empty()) {
+    writer.write_key("exceed");
+    writer.write_string(report.exceed);
+  }
+  if (report.has_exitcode) {
+    writer.write_key("exitcode");
+    writer.write_integer(report.exitcode);
+  }
+  if (report.has_usage) {
+    writer.write_key("memory");
+    writer.write_integer(report.memory);
+  }
+  writer.write_key("result");
+  writer.write_string(report.result);
+  if (has_stderr) {
+    writer.write_key("stderr");
+    writer.write_bytes(read_log(report.stderr_path));
+  }
+  if (has_stdout) {
+    writer.write_key("stdout");
+    writer.write_bytes(read_log(report.stdout_path));
+  }
+  if (report.has_termsig) {
+    writer.write_key("termsig");
+    writer.write_integer(report.termsig);
+  }
+  if (report.has_usage) {
+    writer.write_key("time");
+    writer.write_number(report.time);
+  }
+  if (!report.times.empty()) {
+    writer.write_key("times");
+    writer.begin_array();
+    for (size_t i = 0; i < report.times.size(); ++i) writer.write_number(report.times[i]);
+    writer.end_array();
+  }
+  writer.end_object();
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// truncate log size, ex. compiler log, stdout, stderr, etc.
+#define TRUNC_LOG 65535
+
+struct CompileResult {
+  std::string log;
+  std::string error;
+  bool success;
+  bool cached;  // not written. the binary was compiled by an earlier judgment
+  bool skipped;  // not written. the language has no compile step
+
+  CompileResult() : success(false), cached(false), skipped(false) {}
+};
+
+// Result of a single test case. Captured outputs are not kept in memory,
+// only the paths to them. They are read (up to TRUNC_LOG bytes) when the
+// record gets written.
+struct TestcaseReport {
+  std::string result;
+  std::string exceed;
+  std::string error;
+  double time;
+  double real_time;  // not written, see ConcurrencyController
+  long long memory;
+  int exitcode;
+  int termsig;
+  bool has_usage;     // time and memory are present
+  bool has_exitcode;
+  bool has_termsig;
+  std::string stdout_path;          // present if not empty (--keep-stdout)
+  std::string stderr_path;          // present if not empty (--keep-stderr)
+  std::string checker_output_path;  // present if the file is not empty
+  std::vector<double> times;  // cpu time of every run (--borderline-rerun), present if not empty
+
+  TestcaseReport() : time(0), real_time(0), memory(0), exitcode(0), termsig(0), has_usage(false), has_exitcode(false), has_termsig(false) {}
+};
+
+// Writes a response directly to a FILE, without building a tree first.
+// Objects must be given their number of keys up front (required by CBOR).
+// Arrays have unknown length so test cases can be written as they finish.
+class ResponseWriter {
+  public:
+    virtual ~ResponseWriter() {}
+
+    virtual void begin_object(size_t size) = 0;
+    virtual void end_object() = 0;
+    virtual void begin_array() = 0;
+    virtual void end_array() = 0;
+    virtual void write_key(const std::string& name) = 0;
+    virtual void write_string(const std::string& str) = 0;
+    virtual void write_bytes(const std::string& bytes) = 0;  // captured outputs
+    virtual void write_number(double number) = 0;
+    virtual void write_integer(long long number) = 0;
+    virtual void write_bool(bool value) = 0;
+    virtual void flush() = 0;
+};
+
+// The output is byte-to-byte compatible with picojson::value::serialize.
+class JsonWriter : public ResponseWriter {
+  public:
+    JsonWriter(FILE *fp, bool pretty = false);
+
+    void begin_object(size_t size);
+    void end_object();
+    void begin_array();
+    void end_array();
+    void write_key(const std::string& name);
+    void write_string(const std::string& str);
+    void write_bytes(const std::string& bytes);
+    void write_number(double number);
+    void write_integer(long long number);
+    void write_bool(bool value);
+    void flush();
+
+  private:
+    void before_value();
+    void after_value();
+    void indent();
+    void write_escaped(const char *data, size_t len);
+
+    FILE *fp_;
+    bool pretty_;
+    bool after_key_;
+    std::vector<int> counts_;  // number of items written, per nesting level
+};
+
+// RFC 7049 CBOR. Captured outputs are byte strings and go out raw. Numbers
+// keep their native type: time is a float64, memory and exit codes are
+// integers.
+class CborWriter : public ResponseWriter {
+  public:
+    CborWriter(FILE *fp);
+
+    void begin_object(size_t size);
+    void end_object();
+    void begin_array();
+    void end_array();
+    void write_key(const std::string& name);
+    void write_string(const std::string& str);
+    void write_bytes(const std::string& bytes);
+    void write_number(double number);
+    void write_integer(long long number);
+    void write_bool(bool value);
+    void flush();
+
+  private:
+    void write_head(int major_type, unsigned long long value);
+
+    FILE *fp_;
+    int depth_;
+};
+
+// Keys are written in alphabetical order to match picojson::object
+void write_compile_result(ResponseWriter& writer, const CompileResult& compile_result);
+void write_testcase_report(ResponseWriter& writer, const TestcaseReport& report);
@@ -1,4 +1,5 @@
 #include "sha1.hpp"
+#include <algorithm>
 #include <cstdio>
 #include <cstdint>
 #include <string>
@@ -9,12 +10,30 @@ extern "C" {
 }
 
 std::string sha1(const std::string& content) {
-  SHA1_CTX sha;
-  uint8_t results[20];
+  return sha1(content.data(), content.length());
+}
+
+std::string sha1(const char *data, size_t len) {
+  Sha1Stream sha;
+  sha.update(data, len);
+  return sha.hex();
+}
+
+Sha1Stream::Sha1Stream() {
+  SHA1Init(&ctx_);
+}
 
-  SHA1Init(&sha);
-  SHA1Update(&sha, (uint8_t *)content.data(), content.length());
-  SHA1Final(results, &sha);
+void Sha1Stream::update(const char *data, size_t len) {
+  // SHA1Update takes 32-bit lengths, files can be larger
+  static const size_t CHUNK = 1 << 30;
+  for (size_t offset = 0; offset < len; offset += CHUNK) {
+    SHA1Update(&ctx_, (const unsigned char *)data + offset, (uint32_t)std::min(CHUNK, len - offset));
+  }
+}
+
+std::string Sha1Stream::hex() {
+  uint8_t results[20];
+  SHA1Final(results, &ctx_);
 
   // Convert binary to string
   char result[41];
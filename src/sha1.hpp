@@ -1,4 +1,21 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
+extern "C" {
+#include "deps/sha1/sha1.h"
+}
+
 std::string sha1(const std::string& content);
+std::string sha1(const char *data, size_t len);
+
+// incremental, for contents which are not in memory at once
+class Sha1Stream {
+  public:
+    Sha1Stream();
+    void update(const char *data, size_t len);
+    std::string hex();  // once, at the end
+  private:
+    SHA1_CTX ctx_;
+};
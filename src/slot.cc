@@ -0,0 +1,69 @@
+#include <algorithm>
+#include <ctime>
+#include <fcntl.h>
+#include <string>
+#include <sys/file.h>
+#include <unistd.h>
+#include "fs.hpp"
+#include "judge.hpp"
+#include "slot.hpp"
+#include "deps/tinyformat/tinyformat.h"
+
+using tfm::format;
+
+#define fatal(...) { throw JudgeError(format(__VA_ARGS__)); }
+
+// poll interval while all slots are taken, doubles up to the max
+static const int MIN_POLL_INTERVAL = 1000;  // microseconds
+static const int MAX_POLL_INTERVAL = 50000;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int try_lock_file(const string& path) {
+  // everyone sharing the cache_dir may lock it
+  int fd = open(path.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) fatal("cannot open slot %s", path.c_str());
+  if (flock(fd, LOCK_EX | LOCK_NB) == 0) return fd;
+  close(fd);
+  return -1;
+}
+
+double wait_until_locked(const std::function<bool()>& try_lock) {
+  if (try_lock()) return 0;
+  double begin = now();
+  for (int interval = MIN_POLL_INTERVAL; ; interval = std::min(interval * 2, MAX_POLL_INTERVAL)) {
+    usleep(interval);
+    if (try_lock()) break;
+  }
+  return now() - begin;
+}
+
+// take a free slot or return -1
+static int try_lock_slot(const string& dir, int count, int start) {
+  for (int k = 0; k < count; ++k) {
+    int fd = try_lock_file(fs::join(dir, format("%d", (start + k) % count)));
+    if (fd >= 0) return fd;
+  }
+  return -1;
+}
+
+ScopedSlot::ScopedSlot(const string& dir, int count) : fd_(-1), waited_(0) {
+  if (count <= 0) return;
+  if (fs::mkdir_p(dir, 0777) < 0) fatal("cannot mkdir: %s", dir.c_str());
+  // start at different slots so that processes do not fight for the first ones
+  int start = (int)((unsigned)getpid() % count);
+  waited_ = wait_until_locked([this, &dir, count, start]() {
+    fd_ = try_lock_slot(dir, count, start);
+    return fd_ >= 0;
+  });
+}
+
+ScopedSlot::~ScopedSlot() {
+  if (fd_ < 0) return;
+  flock(fd_, LOCK_UN);
+  close(fd_);
+}
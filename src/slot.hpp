@@ -0,0 +1,31 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+// sub-directory name in cache_dir. lock files of host-wide slots
+#define SUBDIR_SLOTS "slots"
+
+// Host-wide counting semaphore. dir holds `count` lock files, holding the
+// flock of any of them is holding a slot. All ljudge processes using the
+// same dir share the slots. The kernel frees slots of crashed processes.
+class ScopedSlot {
+  public:
+    // blocks until a slot is free. no limit if count <= 0
+    ScopedSlot(const std::string& dir, int count);
+    ~ScopedSlot();
+    double waited() const { return waited_; }  // seconds spent waiting
+  private:
+    ScopedSlot(const ScopedSlot&);
+    ScopedSlot& operator=(const ScopedSlot&);
+    int fd_;
+    double waited_;
+};
+
+// flock path (created if missing) without blocking. the fd holding the
+// lock, -1 if someone else holds it
+int try_lock_file(const std::string& path);
+
+// call try_lock until it returns true, polling with the same backoff as
+// ScopedSlot. returns seconds waited
+double wait_until_locked(const std::function<bool()>& try_lock);
@@ -0,0 +1,167 @@
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <map>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "fs.hpp"
+#include "request.hpp"
+#include "spool.hpp"
+#include "deps/tinyformat/tinyformat.h"
+
+extern "C" {
+#include "deps/log.h/log.h"
+}
+
+using tfm::format;
+
+#define fatal(...) { throw JudgeError(format(__VA_ARGS__)); }
+
+// rescan directories this often, for missed events and jobs of dead workers
+static const int RESCAN_INTERVAL = 5;  // seconds
+
+struct SpoolJob {
+  string name;
+  fs::ScopedFileLock *lock;  // held until the response is written
+};
+
+struct Spool {
+  string incoming_dir;
+  string running_dir;
+  string done_dir;
+  int inotify_fd;
+  time_t last_rescan;
+  std::mutex mutex;
+  map<long, SpoolJob> jobs;  // by sequence number of judge_batch
+};
+
+static bool is_job_name(const string& name) {
+  return !name.empty() && name[0] != '.';
+}
+
+// path still refers to the locked file. it may have been replaced after we opened it
+static bool is_same_file(const fs::ScopedFileLock& lock, const string& path) {
+  struct stat locked_st, path_st;
+  if (fstat(lock.fd(), &locked_st) != 0 || stat(path.c_str(), &path_st) != 0) return false;
+  return locked_st.st_dev == path_st.st_dev && locked_st.st_ino == path_st.st_ino;
+}
+
+// workers hold the lock of their running jobs. an unlocked one belongs to a dead worker
+static void requeue_stale_jobs(Spool& spool) {
+  list<string> names = fs::scandir(spool.running_dir);
+  for (__typeof(names.begin()) it = names.begin(); it != names.end(); ++it) {
+    const string& name = *it;
+    if (!is_job_name(name)) continue;
+    string path = fs::join(spool.running_dir, name);
+    fs::ScopedFileLock lock(path, true /* nonblock */);
+    if (!lock.locked() || !is_same_file(lock, path)) continue;
+    if (rename(path.c_str(), fs::join(spool.incoming_dir, name).c_str()) == 0) {
+      log_info("spool: re-queued %s", name.c_str());
+    }
+  }
+  spool.last_rescan = time(NULL);
+}
+
+// return the lock of the claimed job, or NULL if there is nothing to do
+static fs::ScopedFileLock *claim_job(Spool& spool, string& name, string& content) {
+  list<string> names = fs::scandir(spool.incoming_dir);
+  for (__typeof(names.begin()) it = names.begin(); it != names.end(); ++it) {
+    if (!is_job_name(*it)) continue;
+    string path = fs::join(spool.incoming_dir, *it);
+    string running_path = fs::join(spool.running_dir, *it);
+    // lock before rename, so the job is never unlocked in running/
+    fs::ScopedFileLock *lock = new fs::ScopedFileLock(path, true /* nonblock */);
+    if (!lock->locked() || rename(path.c_str(), running_path.c_str()) != 0) {
+      // claimed by another worker
+      delete lock;
+      continue;
+    }
+    if (!is_same_file(*lock, running_path)) {
+      // a new job with the same name took its place. leave it to requeue_stale_jobs
+      delete lock;
+      continue;
+    }
+    name = *it;
+    content = fs::read(running_path);
+    log_debug("spool: claimed %s", name.c_str());
+    return lock;
+  }
+  return NULL;
+}
+
+static void wait_for_jobs(Spool& spool) {
+  struct pollfd pfd = { spool.inotify_fd, POLLIN, 0 };
+  int ret = poll(&pfd, 1, RESCAN_INTERVAL * 1000);
+  if (ret > 0) {
+    // only the wake up matters, drain the events
+    char buf[4096];
+    while (read(spool.inotify_fd, buf, sizeof(buf)) > 0);
+  }
+  if (time(NULL) - spool.last_rescan >= RESCAN_INTERVAL) requeue_stale_jobs(spool);
+}
+
+static void finish_job(Spool& spool, long seq, const string& response) {
+  SpoolJob job;
+  {
+    std::lock_guard<std::mutex> lock(spool.mutex);
+    job = spool.jobs[seq];
+    spool.jobs.erase(seq);
+  }
+  string done_path = fs::join(spool.done_dir, job.name);
+  if (fs::atomic_write(done_path, response.data(), response.length()) == 0) {
+    log_debug("spool: done %s", job.name.c_str());
+    unlink(fs::join(spool.running_dir, job.name).c_str());
+  } else {
+    // keep it in running/. it gets re-queued once the lock is released
+    log_error("spool: cannot write %s", done_path.c_str());
+  }
+  delete job.lock;
+}
+
+void judge_spool(const string& spool_dir, int nthread, const Options& defaults, const Testcase& default_case) {
+  Spool spool;
+  spool.incoming_dir = fs::join(spool_dir, SPOOL_INCOMING);
+  spool.running_dir = fs::join(spool_dir, SPOOL_RUNNING);
+  spool.done_dir = fs::join(spool_dir, SPOOL_DONE);
+  string dirs[] = { spool.incoming_dir, spool.running_dir, spool.done_dir };
+  for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i) {
+    if (fs::mkdir_p(dirs[i]) < 0) fatal("cannot mkdir: %s", dirs[i].c_str());
+  }
+
+  spool.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (spool.inotify_fd < 0) fatal("inotify_init1: %s", strerror(errno));
+  if (inotify_add_watch(spool.inotify_fd, spool.incoming_dir.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+    fatal("cannot watch %s: %s", spool.incoming_dir.c_str(), strerror(errno));
+  }
+
+  // jobs left by a crashed worker
+  requeue_stale_jobs(spool);
+
+  Options request_defaults = defaults;
+  request_defaults.pretty_print = false;
+  judge_batch(nthread, false /* ordered */, [&](long seq, Options& opts, string& error) {
+    string name, content;
+    fs::ScopedFileLock *lock;
+    while ((lock = claim_job(spool, name, content)) == NULL) wait_for_jobs(spool);
+    {
+      std::lock_guard<std::mutex> guard(spool.mutex);
+      SpoolJob job = { name, lock };
+      spool.jobs[seq] = job;
+    }
+    opts = request_defaults;
+    prepare_request(content, opts, default_case, error);
+    return true;
+  }, [&spool](long seq, const string& response) {
+    finish_job(spool, seq, response);
+  });
+
+  close(spool.inotify_fd);
+}
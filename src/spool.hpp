@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include "judge.hpp"
+
+// sub-directory names in a spool directory
+#define SPOOL_INCOMING "incoming"
+#define SPOOL_RUNNING "running"
+#define SPOOL_DONE "done"
+
+// Judge requests (see schema/request.json) dropped into spool_dir/incoming,
+// one request per file. Producers should write a job somewhere else and
+// rename it into incoming/, names starting with "." are ignored.
+//
+// A job is claimed by locking it and renaming it to running/. Its response
+// is written to done/<name> atomically, then it is removed from running/.
+// Jobs in running/ which are not locked (their worker died) are moved back
+// to incoming/. So several workers can share one spool, and a crash never
+// loses a job. Runs until the process is killed.
+void judge_spool(const string& spool_dir, int nthread, const Options& defaults, const Testcase& default_case);
@@ -0,0 +1,245 @@
+#include "utils.hpp"
+#include "fs.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <sched.h>
+#include <string>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <vector>
+
+using std::list;
+using std::string;
+using std::vector;
+
+string string_chomp(const string& str) {
+  if (str.empty() || str[str.length() - 1] != '\n') return str;
+  return str.substr(0, str.length() - 1);
+}
+
+vector<string> string_split(const string& str, const string& delim) {
+  vector<string> result;
+  if (delim.empty()) {
+    result.push_back(str);
+  } else {
+    size_t pos = 0, start = 0;
+    for (int running = 1; running;) {
+      pos = str.find(delim, start);
+      size_t len;
+      if (pos == string::npos) {
+        len = string::npos;
+        running = 0;
+      } else {
+        len = pos - start;
+      }
+      result.push_back(str.substr(start, len));
+      start = pos + delim.length();
+    }
+  }
+  return result;
+}
+
+void string_replacei(string& str, const string& from, const string& to) {
+  size_t pos = 0;
+  while ((pos = str.find(from, pos)) != string::npos) {
+    str.replace(pos, from.length(), to);
+    pos += to.length();
+  }
+}
+
+string which(const string& name, int access) {
+  string result;
+  char * path_env = getenv("PATH");
+  if (path_env) {
+    vector<string> dirs = string_split(path_env, ":");
+    for (int i = 0; i < (int)dirs.size(); ++i) {
+       string path = fs::join(dirs[i], name);
+       if (fs::is_accessible(path, access)) {
+         result = path;
+         break;
+       }
+    }
+  }
+  return result;
+}
+
+string shell_escape(const string& str) {
+  bool should_escape = false;
+  static const char safe_chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-+=./$:";
+  for (size_t i = 0; i < str.length(); ++i) {
+    if (strchr(safe_chars, str[i]) == NULL) {
+      should_escape = true;
+      break;
+    }
+  }
+
+  if (!should_escape) return str;
+
+  string result = "'";
+  for (size_t i = 0; i < str.length(); ++i) {
+    char c = str[i];
+    if (c == '\'') {
+      result += "'\"'\"'";
+    } else {
+      result += c;
+    }
+  }
+  return result + "'";
+}
+
+string shell_escape(const list<string>& items) {
+  string result = "";
+  for (__typeof(items.begin()) it = items.begin(); it != items.end(); ++it) {
+    if (!result.empty()) result += " ";
+    result += shell_escape(*it);
+  }
+  return result;
+}
+
+long long parse_bytes(const string& str) {
+    long long result = 1;
+    // accept str which ends with 'k', 'kb', 'm', 'M', etc.
+    int pos = str.length() - 1;
+    if (pos > 0 && (str[pos] == 'b' || str[pos] == 'B')) --pos;
+    if (pos > 0) {
+        switch (str[pos]) {
+            case 'g': case 'G':
+                result *= 1024;
+            case 'm': case 'M':
+                result *= 1024;
+            case 'k': case 'K':
+                result *= 1024;
+        }
+    }
+    if (result == 1) {
+        // read as long long
+        sscanf(str.c_str(), "%lld", &result);
+    } else {
+        // read as double so that the user can use things like 0.5mb
+        double v = 0;
+        sscanf(str.c_str(), "%lf", &v);
+        result *= v;
+    }
+    return result;
+}
+
+string uname_r() {
+  struct utsname buf;
+  uname(&buf);
+  return buf.release;
+}
+
+bool is_sha1(const string& str) {
+  if (str.length() != 40) return false;
+  for (int i = 0; i < 40; ++i) {
+    if (str[i] < '0' || str[i] > 'f') return false;
+  }
+  return true;
+}
+
+// a "Name: n kB" line of /proc/meminfo, in bytes
+static long long read_meminfo(const char *format) {
+  FILE *fp = fopen("/proc/meminfo", "r");
+  if (!fp) return 0;
+  char line[256];
+  long long kb = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, format, &kb) == 1) break;
+  }
+  fclose(fp);
+  return kb * 1024;
+}
+
+long long get_total_memory() {
+  return read_meminfo("MemTotal: %lld kB");
+}
+
+// "hierarchy:controllers:path" lines of /proc/self/cgroup. v2 has hierarchy 0 and no controllers
+static string get_cgroup_path(const string& controller) {
+  FILE *fp = fopen("/proc/self/cgroup", "r");
+  if (!fp) return "";
+  char line[4096];
+  string result;
+  while (fgets(line, sizeof(line), fp)) {
+    vector<string> fields = string_split(string_chomp(line), ":");
+    if (fields.size() < 3) continue;
+    vector<string> controllers = string_split(fields[1], ",");
+    bool matched = controller.empty() ? fields[1].empty() : std::find(controllers.begin(), controllers.end(), controller) != controllers.end();
+    if (matched) {
+      result = fields[2];
+      break;
+    }
+  }
+  fclose(fp);
+  return result;
+}
+
+static bool is_cgroup_v2() {
+  return fs::exists("/sys/fs/cgroup/cgroup.controllers");
+}
+
+// content of a cgroup file of this process. inside a cgroup namespace the
+// path is "/" and the own cgroup is mounted as the root
+static string read_cgroup_file(const string& controller, const string& name) {
+  string mount_dir = is_cgroup_v2() ? "/sys/fs/cgroup" : fs::join("/sys/fs/cgroup", controller);
+  string path = get_cgroup_path(is_cgroup_v2() ? "" : controller);
+  string content;
+  if (!path.empty()) content = string_chomp(fs::nread(fs::join(mount_dir, path, name), 64));
+  if (content.empty()) content = string_chomp(fs::nread(fs::join(mount_dir, name), 64));
+  return content;
+}
+
+// "max", negative and absurd v1 values are 0
+static long long parse_cgroup_number(const string& str) {
+  if (str.empty() || str == "max") return 0;
+  long long value = atoll(str.c_str());
+  return (value <= 0 || value >= (1LL << 60)) ? 0 : value;
+}
+
+static long long get_cgroup_memory_limit() {
+  if (is_cgroup_v2()) return parse_cgroup_number(read_cgroup_file("memory", "memory.max"));
+  return parse_cgroup_number(read_cgroup_file("memory", "memory.limit_in_bytes"));
+}
+
+// in cpus, 0 if unlimited
+static double get_cgroup_cpu_quota() {
+  long long quota, period;
+  if (is_cgroup_v2()) {
+    // "$MAX $PERIOD"
+    vector<string> fields = string_split(read_cgroup_file("cpu", "cpu.max"), " ");
+    if (fields.size() < 2) return 0;
+    quota = parse_cgroup_number(fields[0]);
+    period = parse_cgroup_number(fields[1]);
+  } else {
+    quota = parse_cgroup_number(read_cgroup_file("cpu", "cpu.cfs_quota_us"));
+    period = parse_cgroup_number(read_cgroup_file("cpu", "cpu.cfs_period_us"));
+  }
+  return (quota > 0 && period > 0) ? (double)quota / period : 0;
+}
+
+static Resources discover_resources() {
+  Resources res;
+  res.online_cpus = std::max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+  cpu_set_t set;
+  res.cpuset_cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : res.online_cpus;
+  res.cpu_quota = get_cgroup_cpu_quota();
+  res.cpus = res.cpuset_cpus;
+  if (res.cpu_quota > 0) res.cpus = std::min(res.cpus, (int)ceil(res.cpu_quota));
+  res.cpus = std::max(1, res.cpus);
+
+  res.memory_total = get_total_memory();
+  res.memory_limit = get_cgroup_memory_limit();
+  res.memory = res.memory_total;
+  if (res.memory_limit > 0 && (res.memory <= 0 || res.memory_limit < res.memory)) res.memory = res.memory_limit;
+  return res;
+}
+
+const Resources& get_resources() {
+  // thread-safe since C++11
+  static Resources resources = discover_resources();
+  return resources;
+}
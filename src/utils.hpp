@@ -0,0 +1,34 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+std::string string_chomp(const std::string& str);
+std::vector<std::string> string_split(const std::string& str, const std::string& delim);
+void string_replacei(std::string& str, const std::string& from, const std::string& to);
+std::string which(const std::string& name, int access = R_OK | X_OK);
+std::string shell_escape(const std::string& str);
+std::string shell_escape(const std::list<std::string>& items);
+// accept str which ends with 'k', 'kb', 'm', 'M', etc.
+long long parse_bytes(const std::string& str);
+std::string uname_r();
+bool is_sha1(const std::string& str);
+// MemTotal in /proc/meminfo, in bytes. 0 if unknown
+long long get_total_memory();
+
+// CPUs and memory this process can use, with cgroup (v1 or v2) limits
+// applied. Discovered once, at the first call. Memory is the total, not
+// what is available at the moment, so it does not depend on when (or by
+// which process) it is asked.
+struct Resources {
+  int online_cpus;
+  int cpuset_cpus;  // sched_getaffinity, follows the cpuset
+  double cpu_quota;  // in cpus, cpu.max or cpu.cfs_quota_us / cpu.cfs_period_us. 0 if unlimited
+  int cpus;  // effective: cpuset cpus, at most the quota rounded up
+  long long memory_total;  // MemTotal, bytes
+  long long memory_limit;  // memory.max or memory.limit_in_bytes. 0 if unlimited
+  long long memory;  // effective: the smaller one
+};
+const Resources& get_resources();